@@ -0,0 +1,470 @@
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "config.h"
+
+#include "cpus.h"
+#include "log.h"
+#include "options.h"
+#include "util.h"
+
+/*
+ * The number of online CPUs is a poor guide to how many threads are worth running. A process
+ * restricted to some CPUs by taskset or a cpuset only gets those, and a container with a CPU
+ * quota (e.g. docker --cpus=2) gets throttled for the rest of the period once it has used its
+ * share, however many CPUs the host has. Running more workers than that just gets them throttled.
+ *
+ * Which CPUs the workers go on matters too. The usable CPUs are put in the order workers should
+ * be placed on them, according to --placement, using the topology in sysfs:
+ *
+ * - spread: one thread per physical core before any SMT siblings, taking turns between NUMA
+ *   nodes and between L3 caches within a node, so each worker gets as much cache and memory
+ *   bandwidth as possible.
+ * - compact: fill one L3 cache's cores (then their siblings) before moving on to the next, so
+ *   workers share a cache and stay on as few NUMA nodes as possible.
+ * - cores: like spread, but never use SMT siblings, so there's at most one worker per core.
+ */
+
+typedef struct {
+    int id;
+    int core; /* package and core id, combined */
+    int l3;   /* lowest-numbered CPU sharing the L3 cache */
+    int node;
+    /* Position within the enclosing level of the topology, used to sort by */
+    int smt_pos;
+    int core_pos;
+    int l3_pos;
+    int node_pos;
+    int first_l3;   /* first CPU of its L3 cache */
+    int first_node; /* first CPU of its NUMA node */
+    int node_index; /* NUMA nodes numbered in the order their first CPU comes up */
+} cpu_t;
+
+static cpu_t *cpus = NULL;
+static int cpus_len = 0;
+static int usable = 0;
+
+#ifdef OS_LINUX
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+static int read_sysfs_int(const char *fmt, int cpu, int fallback) {
+    char *path;
+    char *buf;
+    size_t len;
+    int val = fallback;
+
+    ag_asprintf(&path, fmt, cpu);
+    buf = read_file(path, &len);
+    free(path);
+    if (buf != NULL) {
+        buf[len] = '\0';
+        /* Lists like "0-3,8-11" start with the lowest CPU, which is all that's needed */
+        val = (int)strtol(buf, NULL, 10);
+        free(buf);
+    }
+    return val;
+}
+
+static void read_topology(cpu_t *cpu) {
+    char *path;
+    DIR *dir;
+    struct dirent *d;
+    int i;
+
+    cpu->core = read_sysfs_int(SYSFS_CPU "/cpu%i/topology/physical_package_id", cpu->id, 0) * 65536 +
+                read_sysfs_int(SYSFS_CPU "/cpu%i/topology/core_id", cpu->id, cpu->id);
+
+    cpu->l3 = -1;
+    for (i = 0; i < 8 && cpu->l3 < 0; i++) {
+        char *fmt;
+        ag_asprintf(&fmt, SYSFS_CPU "/cpu%%i/cache/index%i/level", i);
+        if (read_sysfs_int(fmt, cpu->id, 0) == 3) {
+            free(fmt);
+            ag_asprintf(&fmt, SYSFS_CPU "/cpu%%i/cache/index%i/shared_cpu_list", i);
+            cpu->l3 = read_sysfs_int(fmt, cpu->id, -1);
+        }
+        free(fmt);
+    }
+    if (cpu->l3 < 0) {
+        /* No L3 cache (or no information about it). Treat the package as the shared domain. */
+        cpu->l3 = cpu->core / 65536;
+    }
+
+    /* The CPU's directory has a nodeN link to its NUMA node */
+    cpu->node = 0;
+    ag_asprintf(&path, SYSFS_CPU "/cpu%i", cpu->id);
+    dir = opendir(path);
+    free(path);
+    while (dir && (d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, "node", 4) == 0 && d->d_name[4] >= '0' && d->d_name[4] <= '9') {
+            cpu->node = atoi(d->d_name + 4);
+            break;
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+}
+#endif
+
+static int compare_spread(const void *a, const void *b) {
+    const cpu_t *x = a;
+    const cpu_t *y = b;
+    if (x->smt_pos != y->smt_pos) {
+        return x->smt_pos - y->smt_pos;
+    }
+    if (x->core_pos != y->core_pos) {
+        return x->core_pos - y->core_pos;
+    }
+    if (x->l3_pos != y->l3_pos) {
+        return x->l3_pos - y->l3_pos;
+    }
+    if (x->node_pos != y->node_pos) {
+        return x->node_pos - y->node_pos;
+    }
+    return x->id - y->id;
+}
+
+static int compare_compact(const void *a, const void *b) {
+    const cpu_t *x = a;
+    const cpu_t *y = b;
+    if (x->node_pos != y->node_pos) {
+        return x->node_pos - y->node_pos;
+    }
+    if (x->l3_pos != y->l3_pos) {
+        return x->l3_pos - y->l3_pos;
+    }
+    if (x->smt_pos != y->smt_pos) {
+        return x->smt_pos - y->smt_pos;
+    }
+    if (x->core_pos != y->core_pos) {
+        return x->core_pos - y->core_pos;
+    }
+    return x->id - y->id;
+}
+
+/* Work out where each CPU sits in the topology, then sort them into placement order */
+static void order_cpus(void) {
+    int i, j, nodes = 0;
+
+    /* cpus is in id order here. A CPU is the first of its core, cache or node if no CPU before
+     * it shares that; those are what get counted to find the positions. */
+    for (i = 0; i < cpus_len; i++) {
+        cpu_t *c = &cpus[i];
+        c->smt_pos = c->core_pos = c->l3_pos = c->node_pos = 0;
+        c->first_l3 = c->first_node = TRUE;
+        for (j = 0; j < i; j++) {
+            const cpu_t *o = &cpus[j];
+            if (o->core == c->core) {
+                c->smt_pos++;
+            }
+            if (o->node == c->node) {
+                c->first_node = FALSE;
+                if (o->l3 == c->l3) {
+                    c->first_l3 = FALSE;
+                }
+            }
+        }
+    }
+    for (i = 0; i < cpus_len; i++) {
+        cpu_t *c = &cpus[i];
+        for (j = 0; j < cpus_len; j++) {
+            const cpu_t *o = &cpus[j];
+            if (o->smt_pos == 0 && o->node == c->node && o->l3 == c->l3 && o->core < c->core) {
+                c->core_pos++;
+            }
+            if (o->first_l3 && o->node == c->node && o->l3 < c->l3) {
+                c->l3_pos++;
+            }
+            if (o->first_node && o->node < c->node) {
+                c->node_pos++;
+            }
+        }
+    }
+
+    qsort(cpus, cpus_len, sizeof(cpu_t), opts.placement == PLACEMENT_COMPACT ? compare_compact : compare_spread);
+
+    if (opts.placement == PLACEMENT_CORES) {
+        /* Spread order has all the first threads of cores ahead of any siblings */
+        for (i = 0; i < cpus_len && cpus[i].smt_pos == 0; i++) {
+        }
+        cpus_len = i;
+    }
+
+    for (i = 0; i < cpus_len; i++) {
+        cpus[i].node_index = -1;
+        for (j = 0; j < i && cpus[i].node_index < 0; j++) {
+            if (cpus[j].node == cpus[i].node) {
+                cpus[i].node_index = cpus[j].node_index;
+            }
+        }
+        if (cpus[i].node_index < 0) {
+            cpus[i].node_index = nodes++;
+        }
+        log_debug("Worker CPU %i: CPU %i, core %i, L3 %i, node %i", i, cpus[i].id, cpus[i].core, cpus[i].l3,
+                  cpus[i].node);
+    }
+}
+
+#ifdef OS_LINUX
+/* Read a cgroup quota file into quota and period, which are left alone if there's no limit */
+static void read_cgroup_quota(const char *dir, int v2, long *quota, long *period) {
+    char *path;
+    char *buf;
+    size_t len;
+    long q = -1, p = 0;
+
+    if (v2) {
+        /* "max 100000" or "200000 100000" */
+        ag_asprintf(&path, "%s/cpu.max", dir);
+        buf = read_file(path, &len);
+        free(path);
+        if (buf == NULL) {
+            return;
+        }
+        buf[len] = '\0';
+        if (strncmp(buf, "max", 3) != 0 && sscanf(buf, "%ld %ld", &q, &p) != 2) {
+            q = -1;
+        }
+        free(buf);
+    } else {
+        ag_asprintf(&path, "%s/cpu.cfs_quota_us", dir);
+        buf = read_file(path, &len);
+        free(path);
+        if (buf == NULL) {
+            return;
+        }
+        buf[len] = '\0';
+        q = strtol(buf, NULL, 10);
+        free(buf);
+        ag_asprintf(&path, "%s/cpu.cfs_period_us", dir);
+        buf = read_file(path, &len);
+        free(path);
+        if (buf == NULL) {
+            return;
+        }
+        buf[len] = '\0';
+        p = strtol(buf, NULL, 10);
+        free(buf);
+    }
+
+    if (q > 0 && p > 0 && (*quota < 0 || (double)q / p < (double)*quota / *period)) {
+        log_debug("CPU quota of %ld/%ld in %s", q, p, dir);
+        *quota = q;
+        *period = p;
+    }
+}
+
+/* Check the cgroup the process is in, and its ancestors up to where the hierarchy is mounted,
+ * since a quota anywhere along the way applies */
+static void check_cgroup(const char *mount_point, const char *mount_root, const char *cgroup, int v2,
+                         long *quota, long *period) {
+    size_t root_len = strlen(mount_root);
+    size_t mount_point_len = strlen(mount_point);
+    char *dir;
+    char *slash;
+
+    /* The cgroup is relative to the root of the hierarchy, which may not be what's mounted */
+    if (strcmp(mount_root, "/") != 0) {
+        if (strncmp(cgroup, mount_root, root_len) != 0 || (cgroup[root_len] != '/' && cgroup[root_len] != '\0')) {
+            return;
+        }
+        cgroup += root_len;
+    }
+    ag_asprintf(&dir, "%s%s", mount_point, cgroup);
+    while (strlen(dir) > 1 && dir[strlen(dir) - 1] == '/') {
+        dir[strlen(dir) - 1] = '\0';
+    }
+    for (;;) {
+        read_cgroup_quota(dir, v2, quota, period);
+        slash = strrchr(dir, '/');
+        if (slash == NULL || (size_t)(slash - dir) < mount_point_len) {
+            break;
+        }
+        *slash = '\0';
+    }
+    free(dir);
+}
+
+/* Is controller one of the entries in a comma-separated list? */
+static int has_controller(const char *list, const char *controller) {
+    size_t len = strlen(controller);
+    const char *p = list;
+
+    while ((p = strstr(p, controller)) != NULL) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+            return TRUE;
+        }
+        p += len;
+    }
+    return FALSE;
+}
+
+/* CPUs' worth of quota from the cgroup CPU controller, v1 or v2, or -1 if there isn't one */
+static double cgroup_cpu_limit(void) {
+    FILE *fp;
+    char *line = NULL;
+    size_t line_cap = 0;
+    char *v1_path = NULL;
+    char *v2_path = NULL;
+    long quota = -1, period = 0;
+
+    /* Which cgroup we're in: "0::/path" for v2, "N:cpu,cpuacct:/path" for v1 */
+    fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (getline(&line, &line_cap, fp) > 0) {
+        char *controllers, *path;
+        line[strcspn(line, "\n")] = '\0';
+        controllers = strchr(line, ':');
+        if (controllers == NULL || (path = strchr(controllers + 1, ':')) == NULL) {
+            continue;
+        }
+        *path++ = '\0';
+        controllers++;
+        if (*controllers == '\0' && v2_path == NULL) {
+            v2_path = ag_strdup(path);
+        } else if (has_controller(controllers, "cpu") && v1_path == NULL) {
+            v1_path = ag_strdup(path);
+        }
+    }
+    fclose(fp);
+
+    /* Where the hierarchies are mounted */
+    fp = (v1_path || v2_path) ? fopen("/proc/self/mountinfo", "r") : NULL;
+    while (fp && getline(&line, &line_cap, fp) > 0) {
+        /* id parent major:minor root mount_point options [optional...] - fstype source super_options */
+        char root[PATH_MAX], mount_point[PATH_MAX], fstype[64], super_options[256];
+        const char *sep = strstr(line, " - ");
+        if (sep == NULL || sscanf(line, "%*s %*s %*s %4095s %4095s", root, mount_point) != 2 ||
+            sscanf(sep + 3, "%63s %*s %255s", fstype, super_options) != 2) {
+            continue;
+        }
+        if (strcmp(fstype, "cgroup2") == 0 && v2_path) {
+            check_cgroup(mount_point, root, v2_path, TRUE, &quota, &period);
+        } else if (strcmp(fstype, "cgroup") == 0 && v1_path && has_controller(super_options, "cpu")) {
+            check_cgroup(mount_point, root, v1_path, FALSE, &quota, &period);
+        }
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    free(line);
+    free(v1_path);
+    free(v2_path);
+
+    return quota > 0 ? (double)quota / period : -1;
+}
+#endif
+
+static void find_cpus(void) {
+    int online;
+    int i;
+
+#ifdef _WIN32
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        online = si.dwNumberOfProcessors;
+    }
+#else
+    online = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (online < 1) {
+        online = 1;
+    }
+
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(USE_CPU_SET)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+            cpus = ag_calloc(CPU_SETSIZE, sizeof(cpu_t));
+            for (i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &cpu_set)) {
+                    cpus[cpus_len++].id = i;
+                }
+            }
+        }
+    }
+#endif
+    if (cpus_len == 0) {
+        free(cpus);
+        cpus = ag_calloc(online, sizeof(cpu_t));
+        for (i = 0; i < online; i++) {
+            cpus[i].id = i;
+        }
+        cpus_len = online;
+    }
+    log_debug("%i CPUs online, %i in the affinity mask", online, cpus_len);
+
+    for (i = 0; i < cpus_len; i++) {
+#ifdef OS_LINUX
+        read_topology(&cpus[i]);
+#else
+        /* Without the topology, treat every CPU as a core of its own, all sharing one cache */
+        cpus[i].core = cpus[i].id;
+        cpus[i].l3 = 0;
+        cpus[i].node = 0;
+#endif
+    }
+    order_cpus();
+    usable = cpus_len;
+
+#ifdef OS_LINUX
+    {
+        double limit = cgroup_cpu_limit();
+        /* Round up: a quota of 1.5 CPUs can keep 2 threads busy much of the time */
+        int limit_cpus = (int)limit + ((int)limit < limit);
+        if (limit > 0 && limit_cpus < usable) {
+            usable = limit_cpus;
+            log_debug("cgroup CPU quota limits us to %i CPUs", usable);
+        }
+    }
+#endif
+}
+
+int cpus_usable(void) {
+    if (usable == 0) {
+        find_cpus();
+    }
+    return usable;
+}
+
+int cpus_nth(int i) {
+    if (usable == 0) {
+        find_cpus();
+    }
+    return cpus[i % usable].id;
+}
+
+int cpus_node_index(int i) {
+    if (usable == 0) {
+        find_cpus();
+    }
+    return cpus[i % usable].node_index;
+}
+
+int cpus_nodes(int n) {
+    int nodes = 0;
+    int i;
+
+    if (usable == 0) {
+        find_cpus();
+    }
+    for (i = 0; i < n && i < usable; i++) {
+        if (cpus[i].node_index >= nodes) {
+            nodes = cpus[i].node_index + 1;
+        }
+    }
+    return nodes > 0 ? nodes : 1;
+}
@@ -0,0 +1,15 @@
+#ifndef CPUS_H
+#define CPUS_H
+
+/* Number of CPUs this process can actually make use of: the ones its affinity mask allows,
+ * further limited by a cgroup CPU quota if it's running in a container with one, and to one per
+ * physical core with --placement=cores. */
+int cpus_usable(void);
+/* The CPU to pin the i'th worker to. Cycles through the usable CPUs in --placement order. */
+int cpus_nth(int i);
+/* The NUMA node of the i'th worker's CPU, numbered from 0 in the order workers reach them */
+int cpus_node_index(int i);
+/* How many NUMA nodes the first n workers are spread over */
+int cpus_nodes(int n);
+
+#endif
@@ -0,0 +1,340 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "direct_io.h"
+#include "log.h"
+#include "options.h"
+#include "uring.h"
+#include "util.h"
+
+/*
+ * With --direct, files of at least --direct-min bytes are read with O_DIRECT, straight from the
+ * device into memory, rather than through the page cache. For a one-off scan of more data than
+ * fits in memory, the page cache only adds a copy of everything read, and the work of evicting it
+ * all again.
+ *
+ * O_DIRECT needs aligned buffers, so each thread keeps a pool of two, reused from one file to the
+ * next. A worker starts the reads for its next file into one of them before searching the file
+ * in the other, so that the device is busy while the matcher is. The reads go through io_uring
+ * where it's available, a chunk at a time with up to DIRECT_QUEUE_DEPTH chunks in flight, and
+ * are topped up whenever the thread comes back to wait for a file. Without io_uring, files are
+ * read synchronously, one after another.
+ *
+ * Lengths have to be aligned too, so the last partial block of a file is read through the page
+ * cache, before the file descriptor is switched over to O_DIRECT. So is the rest of a file after
+ * a short read or an error (e.g. from a filesystem that doesn't do direct I/O after all).
+ */
+
+/* Buffers in each thread's pool. A file being searched, and the next one. */
+#define DIRECT_POOL_SLOTS 2
+/* Bigger files get a buffer of their own, rather than keeping one that size around */
+#define DIRECT_BUFFER_MAX (256 * 1024 * 1024)
+/* Size of each read */
+#define DIRECT_CHUNK_SIZE (8 * 1024 * 1024)
+/* Most reads in flight for each file */
+#define DIRECT_QUEUE_DEPTH 8
+
+#ifdef O_DIRECT
+typedef struct {
+    char *buf;
+    size_t size;
+    int busy;
+    /* The file being read into it */
+    int fd;
+    int flags;        /* of fd, before O_DIRECT was set */
+    off_t direct_len; /* how much is read with O_DIRECT: the file's length in whole blocks */
+    off_t next;       /* start of the next chunk to read */
+    off_t redo;       /* where reading has to carry on without O_DIRECT */
+    unsigned in_flight;
+} direct_slot_t;
+
+static __thread direct_slot_t slots[DIRECT_POOL_SLOTS];
+
+#ifdef USE_IO_URING
+static __thread uring_t ring;
+static __thread int ring_state = 0; /* 1 if it's set up, -1 if it can't be, 0 if not tried yet */
+#endif
+
+/* Read [off, len) of fd through the page cache. Returns FALSE if the file came up short. */
+static int read_buffered(int fd, char *buf, off_t off, off_t len) {
+    while (off < len) {
+        ssize_t r = pread(fd, buf + off, len - off, off);
+        if (r <= 0) {
+            return FALSE;
+        }
+        off += r;
+    }
+    return TRUE;
+}
+
+/* Read [off, end) of fd, which has O_DIRECT set. Returns how far it got. */
+static off_t read_direct(int fd, char *buf, off_t off, off_t end) {
+    while (off < end) {
+        ssize_t r = pread(fd, buf + off, ag_min(end - off, DIRECT_CHUNK_SIZE), off);
+        if (r <= 0) {
+            break;
+        }
+        off += r;
+        if (r % DIRECT_IO_ALIGN != 0) {
+            /* The next read wouldn't be aligned */
+            break;
+        }
+    }
+    return off;
+}
+
+static direct_slot_t *slot_of(const char *buf) {
+    int i;
+    for (i = 0; i < DIRECT_POOL_SLOTS; i++) {
+        if (slots[i].busy && slots[i].buf == buf) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+#ifdef USE_IO_URING
+static int ring_ready(void) {
+    static const int ops[] = { IORING_OP_READ };
+    int rv;
+
+    if (ring_state == 0) {
+        rv = uring_init(&ring, DIRECT_POOL_SLOTS * DIRECT_QUEUE_DEPTH, ops, sizeof(ops) / sizeof(ops[0]));
+        if (rv != 0) {
+            log_debug("Can't use io_uring for direct I/O (%s). Reading files synchronously.", strerror(rv));
+        }
+        ring_state = rv == 0 ? 1 : -1;
+    }
+    return ring_state == 1;
+}
+
+/* Queue up reads of the next chunks of each slot's file */
+static void queue_chunks(void) {
+    int i;
+
+    for (i = 0; i < DIRECT_POOL_SLOTS; i++) {
+        direct_slot_t *slot = &slots[i];
+        while (slot->busy && slot->in_flight < DIRECT_QUEUE_DEPTH && slot->next < slot->redo) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+            size_t chunk = ag_min(slot->redo - slot->next, DIRECT_CHUNK_SIZE);
+            if (sqe == NULL) {
+                return;
+            }
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = slot->fd;
+            sqe->addr = (unsigned long)(slot->buf + slot->next);
+            sqe->len = (unsigned)chunk;
+            sqe->off = slot->next;
+            sqe->user_data = (unsigned long long)slot->next * DIRECT_POOL_SLOTS + i;
+            slot->next += chunk;
+            slot->in_flight++;
+        }
+    }
+}
+
+/* Submit whatever more can be read, and record the reads that have finished. With wait, wait
+ * for at least one to. */
+static void reap(int wait) {
+    struct io_uring_cqe *cqe;
+    int rv, i;
+
+    queue_chunks();
+    rv = uring_submit(&ring, wait ? 1 : 0);
+    if (rv < 0) {
+        log_err("io_uring failed: %s. Reading files synchronously.", strerror(-rv));
+        /* Whatever was in flight gets read again, without O_DIRECT */
+        uring_free(&ring);
+        ring_state = -1;
+        for (i = 0; i < DIRECT_POOL_SLOTS; i++) {
+            slots[i].redo = 0;
+            slots[i].next = 0;
+            slots[i].in_flight = 0;
+        }
+        return;
+    }
+    while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+        direct_slot_t *slot = &slots[cqe->user_data % DIRECT_POOL_SLOTS];
+        off_t off = (off_t)(cqe->user_data / DIRECT_POOL_SLOTS);
+        size_t chunk = ag_min(slot->direct_len - off, DIRECT_CHUNK_SIZE);
+        if (cqe->res < 0 || (size_t)cqe->res < chunk) {
+            /* Anything after this gets read again, without O_DIRECT */
+            off_t got = off + (cqe->res > 0 ? cqe->res : 0);
+            if (got < slot->redo) {
+                slot->redo = got;
+            }
+        }
+        slot->in_flight--;
+        uring_cqe_seen(&ring);
+    }
+}
+#endif
+
+int direct_load(int fd, off_t len, loaded_file_t *f, int pooled) {
+    size_t size = ((size_t)len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+    off_t direct_len = len & ~(off_t)(DIRECT_IO_ALIGN - 1);
+    int flags = fcntl(fd, F_GETFL);
+    direct_slot_t *slot = NULL;
+    void *buf = NULL;
+    off_t got;
+    int i;
+
+    if (flags == -1) {
+        return FALSE;
+    }
+    if (pooled && len <= DIRECT_BUFFER_MAX) {
+        for (i = 0; i < DIRECT_POOL_SLOTS && slot == NULL; i++) {
+            if (!slots[i].busy) {
+                slot = &slots[i];
+            }
+        }
+    }
+    if (slot != NULL && slot->size < size) {
+        free(slot->buf);
+        slot->buf = NULL;
+        slot->size = 0;
+        if (posix_memalign(&buf, DIRECT_IO_ALIGN, size) != 0) {
+            die("Memory allocation failed.");
+        }
+        slot->buf = buf;
+        slot->size = size;
+    } else if (slot != NULL) {
+        buf = slot->buf;
+    } else if (posix_memalign(&buf, DIRECT_IO_ALIGN, size) != 0) {
+        die("Memory allocation failed.");
+    }
+
+    /* The tail goes through the page cache, so read it before switching to O_DIRECT */
+    if (!read_buffered(fd, buf, direct_len, len)) {
+        goto fail;
+    }
+    if (direct_len > 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+        /* e.g. a filesystem that doesn't do direct I/O */
+        direct_len = 0;
+        if (!read_buffered(fd, buf, 0, len)) {
+            goto fail;
+        }
+    }
+
+    if (slot != NULL) {
+        slot->busy = TRUE;
+        slot->fd = fd;
+        slot->flags = flags;
+        slot->direct_len = direct_len;
+        slot->next = 0;
+        slot->redo = direct_len;
+        slot->in_flight = 0;
+    }
+#ifdef USE_IO_URING
+    if (slot != NULL && direct_len > 0 && ring_ready()) {
+        /* Leave it reading. direct_wait() picks up the pieces. */
+        reap(FALSE);
+        f->buf = buf;
+        f->contents = FILE_DIRECT;
+        return TRUE;
+    }
+#endif
+    got = read_direct(fd, buf, 0, direct_len);
+    if (direct_len > 0) {
+        fcntl(fd, F_SETFL, flags);
+    }
+    if (got < direct_len && !read_buffered(fd, buf, got, direct_len)) {
+        if (slot != NULL) {
+            slot->busy = FALSE;
+        }
+        goto fail;
+    }
+    if (slot != NULL) {
+        /* Nothing to wait for */
+        slot->direct_len = 0;
+    }
+    if (opts.stats) {
+        __sync_fetch_and_add(&stats.direct_bytes, got);
+    }
+    f->buf = buf;
+    f->contents = slot != NULL ? FILE_DIRECT : FILE_ALLOCATED;
+    return TRUE;
+
+fail:
+    fcntl(fd, F_SETFL, flags);
+    if (slot == NULL) {
+        free(buf);
+    }
+    return FALSE;
+}
+
+int direct_wait(loaded_file_t *f) {
+    direct_slot_t *slot = slot_of(f->buf);
+    off_t redo, end;
+
+    if (slot == NULL || slot->direct_len == 0) {
+        return TRUE;
+    }
+#ifdef USE_IO_URING
+    while (ring_state == 1 && (slot->in_flight > 0 || slot->next < slot->redo)) {
+        reap(TRUE);
+    }
+#endif
+    fcntl(slot->fd, F_SETFL, slot->flags);
+    if (opts.stats) {
+        __sync_fetch_and_add(&stats.direct_bytes, slot->redo);
+    }
+    redo = slot->redo;
+    end = slot->direct_len;
+    slot->direct_len = 0;
+    return read_buffered(slot->fd, slot->buf, redo, end);
+}
+
+void direct_release(loaded_file_t *f) {
+    direct_slot_t *slot = slot_of(f->buf);
+
+    if (slot != NULL) {
+        /* Don't let anything read into it after it's been handed to another file */
+        direct_wait(f);
+        slot->busy = FALSE;
+    }
+}
+
+void direct_free_buffers(void) {
+    int i;
+
+    for (i = 0; i < DIRECT_POOL_SLOTS; i++) {
+        free(slots[i].buf);
+        slots[i].buf = NULL;
+        slots[i].size = 0;
+        slots[i].busy = FALSE;
+    }
+#ifdef USE_IO_URING
+    if (ring_state == 1) {
+        uring_free(&ring);
+    }
+    ring_state = 0;
+#endif
+}
+
+#else
+/* No direct I/O here */
+int direct_load(int fd, off_t len, loaded_file_t *f, int pooled) {
+    (void)fd;
+    (void)len;
+    (void)f;
+    (void)pooled;
+    return FALSE;
+}
+
+int direct_wait(loaded_file_t *f) {
+    (void)f;
+    return TRUE;
+}
+
+void direct_release(loaded_file_t *f) {
+    (void)f;
+}
+
+void direct_free_buffers(void) {
+}
+#endif
@@ -0,0 +1,24 @@
+#ifndef DIRECT_IO_H
+#define DIRECT_IO_H
+
+#include <sys/types.h>
+
+#include "search.h"
+
+/* Alignment of buffers, offsets and lengths for O_DIRECT reads */
+#define DIRECT_IO_ALIGN 4096
+
+/* Read the file of len bytes open on fd into a new buffer with O_DIRECT, setting f->buf and
+ * f->contents. With pooled, the buffer is one of this thread's, and the read may still be going
+ * on in the background when this returns: search_loaded_file() waits for it with direct_wait().
+ * Only two pooled files can be loaded at once on a thread. Returns FALSE if direct I/O didn't
+ * work out, to load the file the usual way. */
+int direct_load(int fd, off_t len, loaded_file_t *f, int pooled);
+/* Wait for the rest of a FILE_DIRECT file to be read. Returns FALSE if it couldn't be. */
+int direct_wait(loaded_file_t *f);
+/* Give back the buffer of a FILE_DIRECT file */
+void direct_release(loaded_file_t *f);
+/* Free this thread's buffers */
+void direct_free_buffers(void);
+
+#endif
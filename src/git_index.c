@@ -0,0 +1,546 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "git_index.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * Reader for git's index file (see gitformat-index(5)).
+ *
+ * Versions 2 through 4 are supported, as is the split index ("link" extension), where most
+ * entries live in a shared index and the index file only records changes to it. Everything we
+ * don't need to build a list of tracked files (stat data, object ids, the cache tree, the
+ * untracked cache, etc.) is skipped over. The trailing checksum isn't verified: if the index is
+ * corrupt enough to matter, we notice while parsing it and fall back to walking the tree.
+ */
+
+#define INDEX_SIGNATURE "DIRC"
+#define INDEX_ENTRY_STAT_SIZE 40 /* ctime, mtime, dev, ino, mode, uid, gid, size */
+
+#define INDEX_FLAG_EXTENDED 0x4000
+#define INDEX_FLAG_STAGE_MASK 0x3000
+#define INDEX_FLAG_NAME_MASK 0x0fff
+#define INDEX_EXT_FLAG_SKIP_WORKTREE 0x4000
+
+typedef struct {
+    size_t name_off; /* offset of the name in the names buffer */
+    uint32_t ino;
+    uint32_t mode;
+    uint16_t flags;
+    uint16_t ext_flags;
+} raw_entry_t;
+
+typedef struct {
+    raw_entry_t *entries;
+    size_t entries_len;
+    char *names; /* either the index file itself (v2/v3) or the expanded names (v4) */
+    char *file_buf;
+    /* split index */
+    int has_link;
+    char shared_oid[65];
+    uint8_t *delete_bits;
+    uint8_t *replace_bits;
+    size_t bits_len;
+} raw_index_t;
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void free_raw_index(raw_index_t *raw) {
+    free(raw->entries);
+    if (raw->names != raw->file_buf) {
+        free(raw->names);
+    }
+    free(raw->file_buf);
+    free(raw->delete_bits);
+    free(raw->replace_bits);
+    memset(raw, 0, sizeof(*raw));
+}
+
+/* Variable-width integer used for v4 path prefix compression. Returns 0 on overrun. */
+static int read_varint(const unsigned char **p, const unsigned char *end, size_t *out) {
+    const unsigned char *q = *p;
+    size_t val;
+    unsigned char c;
+
+    if (q >= end) {
+        return 0;
+    }
+    c = *q++;
+    val = c & 127;
+    while (c & 128) {
+        if (q >= end) {
+            return 0;
+        }
+        val += 1;
+        c = *q++;
+        val = (val << 7) + (c & 127);
+    }
+    *p = q;
+    *out = val;
+    return 1;
+}
+
+/* Decode an EWAH-compressed bitmap into one byte per bit. Bits past bits_len are ignored.
+ * Returns the number of bytes consumed, or 0 if the bitmap is malformed. */
+static size_t read_ewah(const unsigned char *p, size_t len, uint8_t *bits, size_t bits_len) {
+    size_t words_len, i, bit = 0;
+    const unsigned char *words;
+
+    if (len < 12) {
+        return 0;
+    }
+    words_len = get_be32(p + 4);
+    if (words_len > (len - 12) / 8) {
+        return 0;
+    }
+    words = p + 8;
+
+    i = 0;
+    while (i < words_len) {
+        uint64_t rlw = ((uint64_t)get_be32(words + i * 8) << 32) | get_be32(words + i * 8 + 4);
+        int running_bit = rlw & 1;
+        uint64_t running_len = (rlw >> 1) & 0xffffffffULL;
+        uint64_t literal_words = rlw >> 33;
+        size_t j;
+
+        if (running_bit) {
+            for (j = bit; j < bits_len && j < bit + running_len * 64; j++) {
+                bits[j] = 1;
+            }
+        }
+        bit += running_len * 64;
+        i++;
+        if (literal_words > words_len - i) {
+            return 0;
+        }
+        for (; literal_words > 0; literal_words--, i++) {
+            uint64_t word = ((uint64_t)get_be32(words + i * 8) << 32) | get_be32(words + i * 8 + 4);
+            for (j = 0; j < 64; j++) {
+                if ((word >> j) & 1 && bit + j < bits_len) {
+                    bits[bit + j] = 1;
+                }
+            }
+            bit += 64;
+        }
+    }
+
+    return 12 + words_len * 8;
+}
+
+static int parse_link_extension(raw_index_t *raw, const unsigned char *p, size_t len, size_t oid_size) {
+    size_t i, n;
+
+    if (len < oid_size) {
+        return 0;
+    }
+    for (i = 0; i < oid_size; i++) {
+        snprintf(raw->shared_oid + i * 2, 3, "%02x", p[i]);
+    }
+    raw->has_link = 1;
+    p += oid_size;
+    len -= oid_size;
+    if (len == 0) {
+        return 1;
+    }
+
+    /* The bitmaps index into the shared index, whose size we don't know yet. They can't have
+     * more bits than they have room for, so size them by the extension length. */
+    raw->bits_len = len * 8;
+    raw->delete_bits = ag_calloc(raw->bits_len, 1);
+    raw->replace_bits = ag_calloc(raw->bits_len, 1);
+    n = read_ewah(p, len, raw->delete_bits, raw->bits_len);
+    if (n == 0) {
+        return 0;
+    }
+    return read_ewah(p + n, len - n, raw->replace_bits, raw->bits_len) != 0;
+}
+
+/* Parse an index file into raw, which takes ownership of buf. Returns FALSE on malformed input. */
+static int parse_index(raw_index_t *raw, char *buf, size_t len, size_t oid_size, const char *path) {
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    uint32_t version, count, i;
+    size_t names_len = 0, names_size = 0;
+    size_t prev_name_len = 0;
+
+    memset(raw, 0, sizeof(*raw));
+    raw->file_buf = buf;
+
+    if (len < 12 + oid_size || memcmp(p, INDEX_SIGNATURE, 4) != 0) {
+        log_debug("%s is not a git index", path);
+        return FALSE;
+    }
+    version = get_be32(p + 4);
+    count = get_be32(p + 8);
+    if (version < 2 || version > 4) {
+        log_debug("Unsupported git index version %u in %s", version, path);
+        return FALSE;
+    }
+    if (count > len / 8) {
+        goto corrupt;
+    }
+    /* Checksum at the end isn't part of the entries or extensions */
+    end -= oid_size;
+    p += 12;
+
+    raw->entries = ag_malloc(count * sizeof(raw_entry_t) + 1);
+    raw->names = version == 4 ? NULL : buf;
+
+    for (i = 0; i < count; i++) {
+        raw_entry_t *entry = &raw->entries[i];
+        const unsigned char *entry_start = p;
+        size_t fixed_len = INDEX_ENTRY_STAT_SIZE + oid_size + 2;
+        size_t name_len;
+
+        if ((size_t)(end - p) < fixed_len) {
+            goto corrupt;
+        }
+        entry->ino = get_be32(p + 20);
+        entry->mode = get_be32(p + 24);
+        entry->flags = get_be16(p + INDEX_ENTRY_STAT_SIZE + oid_size);
+        entry->ext_flags = 0;
+        p += fixed_len;
+        if (entry->flags & INDEX_FLAG_EXTENDED) {
+            if (version < 3 || end - p < 2) {
+                goto corrupt;
+            }
+            entry->ext_flags = get_be16(p);
+            p += 2;
+        }
+
+        if (version == 4) {
+            size_t strip;
+            const unsigned char *suffix_end;
+            size_t suffix_len;
+
+            if (!read_varint(&p, end, &strip) || strip > prev_name_len) {
+                goto corrupt;
+            }
+            suffix_end = memchr(p, '\0', end - p);
+            if (suffix_end == NULL) {
+                goto corrupt;
+            }
+            suffix_len = suffix_end - p;
+            name_len = prev_name_len - strip + suffix_len;
+
+            if (names_len + name_len + 1 > names_size) {
+                names_size = (names_size + name_len + 1) * 2;
+                raw->names = ag_realloc(raw->names, names_size);
+            }
+            /* Previous name is at the end of the buffer, so copy its prefix forward */
+            if (i > 0) {
+                memmove(raw->names + names_len, raw->names + names_len - prev_name_len - 1, prev_name_len - strip);
+            }
+            memcpy(raw->names + names_len + prev_name_len - strip, p, suffix_len);
+            raw->names[names_len + name_len] = '\0';
+            entry->name_off = names_len;
+            names_len += name_len + 1;
+            prev_name_len = name_len;
+            p = suffix_end + 1;
+        } else {
+            const unsigned char *name_end = memchr(p, '\0', end - p);
+            size_t entry_len;
+            if (name_end == NULL) {
+                goto corrupt;
+            }
+            name_len = name_end - p;
+            entry->name_off = (const char *)p - buf;
+            /* Entries are padded with 1-8 NULs to a multiple of 8 bytes */
+            entry_len = ((size_t)(p - entry_start) + name_len + 8) & ~(size_t)7;
+            if ((size_t)(end - entry_start) < entry_len) {
+                goto corrupt;
+            }
+            p = entry_start + entry_len;
+        }
+    }
+    raw->entries_len = count;
+
+    while (end - p >= 8) {
+        const unsigned char *ext = p;
+        uint32_t ext_len = get_be32(p + 4);
+        p += 8;
+        if ((size_t)(end - p) < ext_len) {
+            goto corrupt;
+        }
+        if (memcmp(ext, "link", 4) == 0) {
+            if (!parse_link_extension(raw, p, ext_len, oid_size)) {
+                goto corrupt;
+            }
+        } else if (ext[0] >= 'a' && ext[0] <= 'z' && memcmp(ext, "sdir", 4) != 0) {
+            /* Lowercase extensions must be understood to use the index */
+            log_debug("Unsupported required extension %.4s in git index %s", (const char *)ext, path);
+            return FALSE;
+        }
+        p += ext_len;
+    }
+
+    return TRUE;
+
+corrupt:
+    log_debug("Git index %s is corrupt or truncated", path);
+    return FALSE;
+}
+
+static int read_index(raw_index_t *raw, const char *path, size_t oid_size) {
+    size_t len;
+    char *buf = read_file(path, &len);
+
+    if (buf == NULL) {
+        log_debug("Unable to read git index %s: %s", path, strerror(errno));
+        memset(raw, 0, sizeof(*raw));
+        return FALSE;
+    }
+    if (!parse_index(raw, buf, len, oid_size, path)) {
+        free_raw_index(raw);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const git_index_entry_t *)a)->name, ((const git_index_entry_t *)b)->name);
+}
+
+/* Append the usable entries of raw to index, optionally skipping some of them */
+static void add_entries(git_index_t *index, const raw_index_t *raw, size_t start, const uint8_t *skip, size_t skip_len) {
+    size_t i;
+    for (i = start; i < raw->entries_len; i++) {
+        const raw_entry_t *entry = &raw->entries[i];
+        if (skip && i < skip_len && skip[i]) {
+            continue;
+        }
+        if (entry->ext_flags & INDEX_EXT_FLAG_SKIP_WORKTREE) {
+            continue;
+        }
+        index->entries[index->entries_len].name = raw->names + entry->name_off;
+        index->entries[index->entries_len].mode = entry->mode;
+        index->entries[index->entries_len].ino = entry->ino;
+        index->entries_len++;
+    }
+}
+
+/* Look for the config that decides the object id size. Linked work trees keep theirs in the
+ * common dir. */
+static size_t get_oid_size(const char *git_dir) {
+    char *path = join_paths(git_dir, "commondir");
+    size_t len;
+    char *buf = read_file(path, &len);
+    char *config = NULL;
+    size_t oid_size = 20;
+
+    free(path);
+    if (buf) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (buf[0] == '/') {
+            config = join_paths(buf, "config");
+        } else {
+            ag_asprintf(&config, "%s/%s/config", git_dir, buf);
+        }
+        free(buf);
+    } else {
+        config = join_paths(git_dir, "config");
+    }
+
+    buf = read_file(config, &len);
+    free(config);
+    if (buf) {
+        char *line;
+        for (line = buf; line != NULL && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+            size_t line_len = strcspn(line, "\n");
+            char *key = line + strspn(line, " \t");
+            if (strncasecmp(key, "objectformat", 12) == 0) {
+                char *value = memchr(key, '=', line_len - (key - line));
+                if (value && strncmp(value + 1 + strspn(value + 1, " \t"), "sha256", 6) == 0) {
+                    oid_size = 32;
+                }
+            }
+        }
+        free(buf);
+    }
+    return oid_size;
+}
+
+/* Walk up from path looking for .git. Returns the git dir and sets *work_tree. */
+static char *find_git_dir(const char *path, char **work_tree) {
+    char *dir = ag_strdup(path);
+    size_t len = strlen(dir);
+    struct stat st;
+
+    while (len > 1 && dir[len - 1] == '/') {
+        dir[--len] = '\0';
+    }
+
+    while (TRUE) {
+        char *dot_git = join_paths(len == 1 ? "" : dir, ".git");
+        if (stat(dot_git, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                *work_tree = dir;
+                return dot_git;
+            }
+            if (S_ISREG(st.st_mode)) {
+                /* Submodules and linked work trees use a "gitdir: <path>" file */
+                size_t buf_len;
+                char *buf = read_file(dot_git, &buf_len);
+                char *git_dir = NULL;
+                if (buf && strncmp(buf, "gitdir: ", 8) == 0) {
+                    buf[strcspn(buf, "\r\n")] = '\0';
+                    if (buf[8] == '/') {
+                        git_dir = ag_strdup(buf + 8);
+                    } else {
+                        git_dir = join_paths(len == 1 ? "" : dir, buf + 8);
+                    }
+                }
+                free(buf);
+                free(dot_git);
+                if (git_dir) {
+                    *work_tree = dir;
+                    return git_dir;
+                }
+                break;
+            }
+        }
+        free(dot_git);
+
+        if (len <= 1) {
+            break;
+        }
+        while (len > 1 && dir[len - 1] != '/') {
+            len--;
+        }
+        if (len > 1) {
+            len--;
+        }
+        dir[len] = '\0';
+    }
+
+    free(dir);
+    return NULL;
+}
+
+git_index_t *git_index_load(const char *path) {
+    char *work_tree = NULL;
+    char *git_dir;
+    char *index_path = NULL;
+    char *shared_path = NULL;
+    size_t oid_size;
+    raw_index_t raw, shared;
+    git_index_t *index = NULL;
+    size_t i, j;
+
+    memset(&shared, 0, sizeof(shared));
+
+    git_dir = find_git_dir(path, &work_tree);
+    if (git_dir == NULL) {
+        log_debug("%s is not in a git work tree", path);
+        return NULL;
+    }
+    if (strcmp(work_tree, "/") == 0) {
+        work_tree[0] = '\0';
+    }
+    oid_size = get_oid_size(git_dir);
+    index_path = join_paths(git_dir, "index");
+    if (!read_index(&raw, index_path, oid_size)) {
+        goto cleanup;
+    }
+
+    index = ag_calloc(1, sizeof(git_index_t));
+    index->work_tree = work_tree;
+    work_tree = NULL;
+
+    if (raw.has_link) {
+        ag_asprintf(&shared_path, "%s/sharedindex.%s", git_dir, raw.shared_oid);
+        if (!read_index(&shared, shared_path, oid_size) || shared.has_link) {
+            log_debug("Unable to use shared git index %s", shared_path);
+            git_index_free(index);
+            index = NULL;
+            free_raw_index(&raw);
+            free_raw_index(&shared);
+            goto cleanup;
+        }
+
+        /* Replaced entries come first in the split index, in the order of the bits set in the
+         * replace bitmap. They keep the shared entry's name, so only their mode and flags matter. */
+        for (i = 0, j = 0; i < shared.entries_len && i < raw.bits_len; i++) {
+            if (!raw.replace_bits[i]) {
+                continue;
+            }
+            if (j >= raw.entries_len) {
+                break;
+            }
+            shared.entries[i].ino = raw.entries[j].ino;
+            shared.entries[i].mode = raw.entries[j].mode;
+            shared.entries[i].ext_flags = raw.entries[j].ext_flags;
+            j++;
+        }
+
+        index->entries = ag_malloc((shared.entries_len + raw.entries_len + 1) * sizeof(git_index_entry_t));
+        add_entries(index, &shared, 0, raw.delete_bits, raw.bits_len);
+        add_entries(index, &raw, j, NULL, 0);
+        qsort(index->entries, index->entries_len, sizeof(git_index_entry_t), compare_entries);
+    } else {
+        index->entries = ag_malloc((raw.entries_len + 1) * sizeof(git_index_entry_t));
+        add_entries(index, &raw, 0, NULL, 0);
+    }
+
+    /* Keep the buffers the names point into */
+    index->bufs = ag_calloc(4, sizeof(char *));
+    index->bufs[index->bufs_len++] = raw.file_buf;
+    if (raw.names != raw.file_buf) {
+        index->bufs[index->bufs_len++] = raw.names;
+    }
+    raw.file_buf = raw.names = NULL;
+    if (shared.file_buf) {
+        index->bufs[index->bufs_len++] = shared.file_buf;
+        if (shared.names != shared.file_buf) {
+            index->bufs[index->bufs_len++] = shared.names;
+        }
+        shared.file_buf = shared.names = NULL;
+    }
+    free_raw_index(&raw);
+    free_raw_index(&shared);
+
+    /* Entries in conflict appear once per stage */
+    for (i = 0, j = 0; i < index->entries_len; i++) {
+        if (j > 0 && strcmp(index->entries[j - 1].name, index->entries[i].name) == 0) {
+            continue;
+        }
+        index->entries[j++] = index->entries[i];
+    }
+    index->entries_len = j;
+
+    log_debug("Read %zu entries from git index %s", index->entries_len, index_path);
+
+cleanup:
+    free(work_tree);
+    free(git_dir);
+    free(index_path);
+    free(shared_path);
+    return index;
+}
+
+void git_index_free(git_index_t *index) {
+    size_t i;
+    if (index == NULL) {
+        return;
+    }
+    for (i = 0; i < index->bufs_len; i++) {
+        free(index->bufs[i]);
+    }
+    free(index->bufs);
+    free(index->entries);
+    free(index->work_tree);
+    free(index);
+}
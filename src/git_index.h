@@ -0,0 +1,33 @@
+#ifndef GIT_INDEX_H
+#define GIT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Object types stored in the top bits of an index entry's mode */
+#define GIT_INDEX_TYPE_MASK 0170000
+#define GIT_INDEX_TYPE_REGULAR 0100000
+#define GIT_INDEX_TYPE_SYMLINK 0120000
+#define GIT_INDEX_TYPE_GITLINK 0160000
+
+typedef struct {
+    char *name; /* path relative to the work tree, '/'-separated */
+    uint32_t mode;
+    uint32_t ino; /* as of the last time git looked at the file, truncated to 32 bits */
+} git_index_entry_t;
+
+typedef struct {
+    char *work_tree; /* absolute path of the work tree, without a trailing '/' */
+    git_index_entry_t *entries;
+    size_t entries_len;
+    char **bufs; /* storage the entry names point into */
+    size_t bufs_len;
+} git_index_t;
+
+/* Find the git work tree containing path (an absolute directory) and read its index.
+ * Entries are sorted by name, with merge conflict stages and skip-worktree entries dropped.
+ * Returns NULL if path isn't in a git work tree or the index can't be read. */
+git_index_t *git_index_load(const char *path);
+void git_index_free(git_index_t *index);
+
+#endif
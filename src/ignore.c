@@ -8,6 +8,7 @@
 
 #include "config.h"
 #include "ignore.h"
+#include "ignore_cache.h"
 #include "log.h"
 #include "options.h"
 #include "scandir.h"
@@ -69,6 +70,10 @@ ignores *init_ignore(ignores *parent, const char *dirname, const size_t dirname_
     } else {
         ig->parent = parent;
     }
+    if (ig->parent) {
+        ig->parent->refs++;
+    }
+    ig->refs = 1;
 
     if (parent && parent->abs_path_len > 0) {
         ig->abs_path = join_paths(parent->abs_path, dirname);
@@ -85,7 +90,7 @@ ignores *init_ignore(ignores *parent, const char *dirname, const size_t dirname_
 }
 
 void cleanup_ignore(ignores *ig) {
-    if (ig == NULL) {
+    if (ig == NULL || --ig->refs > 0) {
         return;
     }
     free_strings(ig->extensions, ig->extensions_len);
@@ -97,12 +102,59 @@ void cleanup_ignore(ignores *ig) {
     if (ig->abs_path) {
         free(ig->abs_path);
     }
+    cleanup_ignore(ig->parent);
     free(ig);
 }
 
-void add_ignore_pattern(ignores *ig, const char *pattern) {
-    int i;
-    int pattern_len;
+static char ***ignore_list_ptr(ignores *ig, enum ignore_list list, size_t **patterns_len) {
+    switch (list) {
+        case IGNORE_EXTENSIONS:
+            *patterns_len = &(ig->extensions_len);
+            return &(ig->extensions);
+        case IGNORE_NAMES:
+            *patterns_len = &(ig->names_len);
+            return &(ig->names);
+        case IGNORE_SLASH_NAMES:
+            *patterns_len = &(ig->slash_names_len);
+            return &(ig->slash_names);
+        case IGNORE_REGEXES:
+            *patterns_len = &(ig->regexes_len);
+            return &(ig->regexes);
+        case IGNORE_INVERT_REGEXES:
+            *patterns_len = &(ig->invert_regexes_len);
+            return &(ig->invert_regexes);
+        case IGNORE_SLASH_REGEXES:
+        default:
+            *patterns_len = &(ig->slash_regexes_len);
+            return &(ig->slash_regexes);
+    }
+}
+
+int ignores_equal(ignores *a, ignores *b) {
+    int list;
+    size_t i;
+
+    for (list = 0; list < IGNORE_LIST_COUNT; list++) {
+        size_t *a_len, *b_len;
+        char **a_patterns = *ignore_list_ptr(a, list, &a_len);
+        char **b_patterns = *ignore_list_ptr(b, list, &b_len);
+        if (*a_len != *b_len) {
+            return FALSE;
+        }
+        for (i = 0; i < *a_len; i++) {
+            if (strcmp(a_patterns[i], b_patterns[i]) != 0) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/* Strip the parts of pattern that don't get stored and figure out which list it goes in.
+ * Returns the length of what's left, or 0 if there's nothing to add. */
+static size_t classify_ignore_pattern(const char **pattern_p, enum ignore_list *list) {
+    const char *pattern = *pattern_p;
+    size_t pattern_len;
 
     /* Strip off the leading dot so that matches are more likely. */
     if (strncmp(pattern, "./", 2) == 0) {
@@ -117,88 +169,213 @@ void add_ignore_pattern(ignores *ig, const char *pattern) {
     }
 
     if (pattern_len == 0) {
-        log_debug("Pattern is empty. Not adding any ignores.");
-        return;
+        return 0;
     }
 
-    char ***patterns_p;
-    size_t *patterns_len;
     if (is_fnmatch(pattern)) {
         if (pattern[0] == '*' && pattern[1] == '.' && strchr(pattern + 2, '.') && !is_fnmatch(pattern + 2)) {
-            patterns_p = &(ig->extensions);
-            patterns_len = &(ig->extensions_len);
+            *list = IGNORE_EXTENSIONS;
             pattern += 2;
             pattern_len -= 2;
         } else if (pattern[0] == '/') {
-            patterns_p = &(ig->slash_regexes);
-            patterns_len = &(ig->slash_regexes_len);
+            *list = IGNORE_SLASH_REGEXES;
             pattern++;
             pattern_len--;
         } else if (pattern[0] == '!') {
-            patterns_p = &(ig->invert_regexes);
-            patterns_len = &(ig->invert_regexes_len);
+            *list = IGNORE_INVERT_REGEXES;
             pattern++;
             pattern_len--;
         } else {
-            patterns_p = &(ig->regexes);
-            patterns_len = &(ig->regexes_len);
+            *list = IGNORE_REGEXES;
         }
     } else {
         if (pattern[0] == '/') {
-            patterns_p = &(ig->slash_names);
-            patterns_len = &(ig->slash_names_len);
+            *list = IGNORE_SLASH_NAMES;
             pattern++;
             pattern_len--;
         } else {
-            patterns_p = &(ig->names);
-            patterns_len = &(ig->names_len);
+            *list = IGNORE_NAMES;
         }
     }
 
-    ++*patterns_len;
+    *pattern_p = pattern;
+    return pattern_len;
+}
+
+void add_ignore_pattern(ignores *ig, const char *pattern) {
+    size_t i;
+    size_t pattern_len;
+    enum ignore_list list;
+
+    pattern_len = classify_ignore_pattern(&pattern, &list);
+    if (pattern_len == 0) {
+        log_debug("Pattern is empty. Not adding any ignores.");
+        return;
+    }
 
-    char **patterns;
+    char *new_pattern = ag_strndup(pattern, pattern_len);
+    size_t *patterns_len;
+    char ***patterns_p = ignore_list_ptr(ig, list, &patterns_len);
 
-    /* a balanced binary tree is best for performance, but I'm lazy */
-    *patterns_p = patterns = ag_realloc(*patterns_p, (*patterns_len) * sizeof(char *));
-    /* TODO: de-dupe these patterns */
-    for (i = *patterns_len - 1; i > 0; i--) {
-        if (strcmp(pattern, patterns[i - 1]) > 0) {
+    if (binary_search(new_pattern, *patterns_p, 0, *patterns_len) >= 0) {
+        log_debug("ignore pattern %s already in %s", new_pattern,
+                  ig == root_ignores ? "root ignores" : ig->abs_path);
+        free(new_pattern);
+        return;
+    }
+
+    /* Keep the list sorted so we can binary search it. Loading a whole file
+     * goes through merge_ignore_patterns instead, which merges already-sorted lists. */
+    char **patterns = ag_realloc(*patterns_p, (*patterns_len + 1) * sizeof(char *));
+    for (i = *patterns_len; i > 0; i--) {
+        if (strcmp(new_pattern, patterns[i - 1]) > 0) {
             break;
         }
         patterns[i] = patterns[i - 1];
     }
-    patterns[i] = ag_strndup(pattern, pattern_len);
-    log_debug("added ignore pattern %s to %s", pattern,
+    patterns[i] = new_pattern;
+    *patterns_p = patterns;
+    ++*patterns_len;
+    log_debug("added ignore pattern %s to %s", new_pattern,
               ig == root_ignores ? "root ignores" : ig->abs_path);
 }
 
-/* For loading git/hg ignore patterns */
-void load_ignore_patterns(ignores *ig, const char *path) {
-    FILE *fp = NULL;
-    fp = fopen(path, "r");
-    if (fp == NULL) {
-        log_debug("Skipping ignore file %s: not readable", path);
+static int cmp_patterns(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Sort and de-dupe a list of patterns in place. Returns the new length. */
+static size_t sort_ignore_patterns(char **patterns, size_t patterns_len) {
+    size_t i, j;
+
+    qsort(patterns, patterns_len, sizeof(char *), cmp_patterns);
+    for (i = 0, j = 0; i < patterns_len; i++) {
+        if (j > 0 && strcmp(patterns[i], patterns[j - 1]) == 0) {
+            free(patterns[i]);
+            continue;
+        }
+        patterns[j++] = patterns[i];
+    }
+    return j;
+}
+
+/* Merge a sorted, de-duped array of new patterns into one of ig's lists.
+ * Takes ownership of the strings in new_patterns, but not the array itself. */
+static void merge_ignore_patterns(ignores *ig, enum ignore_list list, char **new_patterns, size_t new_len) {
+    size_t *patterns_len;
+    char ***patterns_p = ignore_list_ptr(ig, list, &patterns_len);
+    char **old_patterns = *patterns_p;
+    size_t old_len = *patterns_len;
+    size_t i = 0, j = 0, k = 0;
+
+    if (new_len == 0) {
         return;
     }
-    log_debug("Loading ignore file %s.", path);
 
-    char *line = NULL;
-    ssize_t line_len = 0;
-    size_t line_cap = 0;
+    char **patterns = ag_malloc((old_len + new_len) * sizeof(char *));
+    while (i < old_len && j < new_len) {
+        int rc = strcmp(old_patterns[i], new_patterns[j]);
+        if (rc < 0) {
+            patterns[k++] = old_patterns[i++];
+        } else if (rc > 0) {
+            patterns[k++] = new_patterns[j++];
+        } else {
+            free(new_patterns[j++]);
+        }
+    }
+    while (i < old_len) {
+        patterns[k++] = old_patterns[i++];
+    }
+    while (j < new_len) {
+        patterns[k++] = new_patterns[j++];
+    }
 
-    while ((line_len = getline(&line, &line_cap, fp)) > 0) {
-        if (line_len == 0 || line[0] == '\n' || line[0] == '#') {
-            continue;
+    free(old_patterns);
+    *patterns_p = patterns;
+    *patterns_len = k;
+}
+
+/* Read an ignore file and sort its patterns into lists, which are each sorted and de-duped.
+ * Returns FALSE if the file couldn't be read. */
+static int parse_ignore_file(const char *path, char **new_patterns[], size_t new_len[]) {
+    char *buf;
+    size_t buf_len = 0;
+    size_t new_size[IGNORE_LIST_COUNT] = { 0 };
+    int i;
+
+    buf = read_file(path, &buf_len);
+    if (buf == NULL) {
+        return FALSE;
+    }
+
+    char *line = buf;
+    char *buf_end = buf + buf_len;
+    while (line < buf_end) {
+        char *line_end = memchr(line, '\n', buf_end - line);
+        if (line_end == NULL) {
+            line_end = buf_end;
+        }
+        *line_end = '\0'; /* kill the \n. read_file leaves room for a trailing null */
+
+        if (line[0] != '\0' && line[0] != '#') {
+            const char *pattern = line;
+            enum ignore_list list;
+            size_t pattern_len = classify_ignore_pattern(&pattern, &list);
+            if (pattern_len > 0) {
+                if (new_len[list] == new_size[list]) {
+                    new_size[list] = new_size[list] ? new_size[list] * 2 : 32;
+                    new_patterns[list] = ag_realloc(new_patterns[list], new_size[list] * sizeof(char *));
+                }
+                new_patterns[list][new_len[list]++] = ag_strndup(pattern, pattern_len);
+            }
+        }
+        line = line_end + 1;
+    }
+    free(buf);
+
+    for (i = 0; i < IGNORE_LIST_COUNT; i++) {
+        new_len[i] = sort_ignore_patterns(new_patterns[i], new_len[i]);
+    }
+    return TRUE;
+}
+
+/* For loading git/hg ignore patterns */
+void load_ignore_patterns(ignores *ig, const char *path) {
+    char **new_patterns[IGNORE_LIST_COUNT] = { NULL };
+    size_t new_len[IGNORE_LIST_COUNT] = { 0 };
+    struct stat statbuf;
+    int cached = FALSE;
+    size_t i, j;
+
+    if (opts.ignore_cache_dir) {
+        if (stat(path, &statbuf) != 0) {
+            log_debug("Skipping ignore file %s: not readable", path);
+            return;
         }
-        if (line[line_len - 1] == '\n') {
-            line[line_len - 1] = '\0'; /* kill the \n */
+        cached = ignore_cache_load(path, &statbuf, new_patterns, new_len);
+    }
+
+    if (cached) {
+        log_debug("Loading ignore file %s from cache.", path);
+    } else {
+        if (!parse_ignore_file(path, new_patterns, new_len)) {
+            log_debug("Skipping ignore file %s: not readable", path);
+            return;
+        }
+        log_debug("Loading ignore file %s.", path);
+        if (opts.ignore_cache_dir) {
+            ignore_cache_store(path, &statbuf, new_patterns, new_len);
         }
-        add_ignore_pattern(ig, line);
     }
 
-    free(line);
-    fclose(fp);
+    for (i = 0; i < IGNORE_LIST_COUNT; i++) {
+        for (j = 0; j < new_len[i]; j++) {
+            log_debug("added ignore pattern %s to %s", new_patterns[i][j],
+                      ig == root_ignores ? "root ignores" : ig->abs_path);
+        }
+        merge_ignore_patterns(ig, (enum ignore_list)i, new_patterns[i], new_len[i]);
+        free(new_patterns[i]);
+    }
 }
 
 static int ackmate_dir_match(const char *dir_name) {
@@ -26,9 +26,23 @@ struct ignores {
     size_t abs_path_len;
 
     struct ignores *parent;
+    /* Children hold a reference to their parent (and --watch to the ignores of each directory
+     * it watches). cleanup_ignore() drops one, and frees the ignores once they're all gone. */
+    size_t refs;
 };
 typedef struct ignores ignores;
 
+/* The lists in struct ignores that patterns get sorted into */
+enum ignore_list {
+    IGNORE_EXTENSIONS,
+    IGNORE_NAMES,
+    IGNORE_SLASH_NAMES,
+    IGNORE_REGEXES,
+    IGNORE_INVERT_REGEXES,
+    IGNORE_SLASH_REGEXES,
+    IGNORE_LIST_COUNT
+};
+
 extern ignores *root_ignores;
 
 extern const char *evil_hardcoded_ignore_files[];
@@ -44,5 +58,7 @@ void load_ignore_patterns(ignores *ig, const char *path);
 int filename_filter(const char *path, const struct dirent *dir, void *baton);
 
 int is_empty(ignores *ig);
+/* Whether a and b have the same patterns (not counting their parents') */
+int ignores_equal(ignores *a, ignores *b);
 
 #endif
@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ignore_cache.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * On-disk cache of parsed ignore files.
+ *
+ * Each ignore file gets one cache entry, named after its device and inode numbers. An entry is
+ * a header followed by the file's patterns, already classified into the lists of struct ignores
+ * and sorted/de-duped, as null-terminated strings. An entry is only used if the device, inode,
+ * size, and mtime in its header all match the ignore file, so a changed file is simply re-parsed
+ * and its entry overwritten.
+ *
+ * Entries are host-endian and unversioned beyond the magic, so bump the magic whenever the
+ * layout or the way patterns are classified changes.
+ */
+
+#define IGNORE_CACHE_MAGIC "agignc1\n"
+
+typedef struct {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint32_t counts[IGNORE_LIST_COUNT];
+    uint32_t strings_len;
+} ignore_cache_header_t;
+
+static char *cache_dir = NULL;
+
+char *ignore_cache_default_dir(void) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home_dir = getenv("HOME");
+    char *dir = NULL;
+
+    if (cache_home && cache_home[0]) {
+        dir = join_paths(cache_home, IGNORE_CACHE_SUBDIR);
+    } else if (home_dir) {
+        ag_asprintf(&dir, "%s/.cache/%s", home_dir, IGNORE_CACHE_SUBDIR);
+    }
+    return dir;
+}
+
+/* mkdir -p. Returns 0 on success, -1 with errno set on failure */
+static int make_dirs(const char *dir) {
+    char *path = ag_strdup(dir);
+    char *p = path;
+    int rv = 0;
+
+    do {
+        p = strchr(p + 1, '/');
+        if (p) {
+            *p = '\0';
+        }
+#ifdef _WIN32
+        rv = mkdir(path);
+#else
+        rv = mkdir(path, 0755);
+#endif
+        if (rv != 0 && errno == EEXIST) {
+            rv = 0;
+        }
+        if (p) {
+            *p = '/';
+        }
+    } while (p && rv == 0);
+
+    free(path);
+    return rv;
+}
+
+int ignore_cache_init(const char *dir) {
+    if (make_dirs(dir) != 0) {
+        log_warn("Not using ignore cache: can't create %s: %s", dir, strerror(errno));
+        return FALSE;
+    }
+    free(cache_dir);
+    cache_dir = ag_strdup(dir);
+    log_debug("Using ignore cache in %s", cache_dir);
+    return TRUE;
+}
+
+static void fill_header(ignore_cache_header_t *hdr, const struct stat *statbuf) {
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, IGNORE_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->dev = (uint64_t)statbuf->st_dev;
+    hdr->ino = (uint64_t)statbuf->st_ino;
+    hdr->size = (uint64_t)statbuf->st_size;
+    hdr->mtime = (int64_t)statbuf->st_mtime;
+    hdr->mtime_nsec = (int64_t)STAT_MTIME_NSEC(statbuf);
+}
+
+static char *cache_entry_path(const struct stat *statbuf) {
+    /* FNV-1a over the device and inode */
+    uint64_t key[2] = { (uint64_t)statbuf->st_dev, (uint64_t)statbuf->st_ino };
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    char *path;
+
+    for (i = 0; i < sizeof(key); i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    ag_asprintf(&path, "%s/%016llx", cache_dir, (unsigned long long)hash);
+    return path;
+}
+
+int ignore_cache_load(const char *path, const struct stat *statbuf, char **patterns[], size_t patterns_len[]) {
+    ignore_cache_header_t hdr, expected;
+    char *entry_path;
+    char *buf;
+    size_t buf_len = 0;
+    size_t i, j;
+
+    if (cache_dir == NULL) {
+        return FALSE;
+    }
+
+    entry_path = cache_entry_path(statbuf);
+    buf = read_file(entry_path, &buf_len);
+    if (buf == NULL) {
+        log_debug("No ignore cache entry %s for %s", entry_path, path);
+        free(entry_path);
+        return FALSE;
+    }
+
+    fill_header(&expected, statbuf);
+    if (buf_len < sizeof(hdr)) {
+        goto miss;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (memcmp(hdr.magic, expected.magic, sizeof(hdr.magic)) != 0 ||
+        hdr.dev != expected.dev || hdr.ino != expected.ino || hdr.size != expected.size ||
+        hdr.mtime != expected.mtime || hdr.mtime_nsec != expected.mtime_nsec ||
+        buf_len != sizeof(hdr) + hdr.strings_len) {
+        goto miss;
+    }
+
+    const char *p = buf + sizeof(hdr);
+    const char *end = p + hdr.strings_len;
+    for (i = 0; i < IGNORE_LIST_COUNT; i++) {
+        patterns[i] = hdr.counts[i] ? ag_malloc(hdr.counts[i] * sizeof(char *)) : NULL;
+        patterns_len[i] = 0;
+        for (j = 0; j < hdr.counts[i]; j++) {
+            const char *nul = memchr(p, '\0', end - p);
+            if (nul == NULL) {
+                goto corrupt;
+            }
+            patterns[i][patterns_len[i]++] = ag_strndup(p, nul - p);
+            p = nul + 1;
+        }
+    }
+    if (p != end) {
+        goto corrupt;
+    }
+
+    log_debug("Ignore cache hit for %s in %s", path, entry_path);
+    free(entry_path);
+    free(buf);
+    return TRUE;
+
+corrupt:
+    log_debug("Ignore cache entry %s is corrupt", entry_path);
+    for (i = 0; i < IGNORE_LIST_COUNT; i++) {
+        free_strings(patterns[i], patterns_len[i]);
+        patterns[i] = NULL;
+        patterns_len[i] = 0;
+    }
+    free(entry_path);
+    free(buf);
+    return FALSE;
+
+miss:
+    log_debug("Ignore cache entry %s is stale for %s", entry_path, path);
+    free(entry_path);
+    free(buf);
+    return FALSE;
+}
+
+void ignore_cache_store(const char *path, const struct stat *statbuf, char **patterns[], const size_t patterns_len[]) {
+    ignore_cache_header_t hdr;
+    char *entry_path;
+    char *tmp_path;
+    char *buf;
+    size_t buf_len;
+    size_t i, j;
+    int fd;
+
+    if (cache_dir == NULL) {
+        return;
+    }
+
+    /* Like git's "racily clean" index entries: a file modified in the same second we read it
+     * could change again without its mtime changing, so don't trust it until it settles. */
+    if (statbuf->st_mtime >= time(NULL) - 1) {
+        log_debug("Not caching %s: modified too recently", path);
+        return;
+    }
+
+    fill_header(&hdr, statbuf);
+    buf_len = sizeof(hdr);
+    for (i = 0; i < IGNORE_LIST_COUNT; i++) {
+        hdr.counts[i] = (uint32_t)patterns_len[i];
+        for (j = 0; j < patterns_len[i]; j++) {
+            buf_len += strlen(patterns[i][j]) + 1;
+        }
+    }
+    hdr.strings_len = (uint32_t)(buf_len - sizeof(hdr));
+
+    buf = ag_malloc(buf_len);
+    memcpy(buf, &hdr, sizeof(hdr));
+    char *p = buf + sizeof(hdr);
+    for (i = 0; i < IGNORE_LIST_COUNT; i++) {
+        for (j = 0; j < patterns_len[i]; j++) {
+            size_t len = strlen(patterns[i][j]) + 1;
+            memcpy(p, patterns[i][j], len);
+            p += len;
+        }
+    }
+
+    /* write to a temp file and rename so concurrent ags never see a partial entry */
+    entry_path = cache_entry_path(statbuf);
+    ag_asprintf(&tmp_path, "%s.%ld.tmp", entry_path, (long)getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_debug("Can't write ignore cache entry %s: %s", tmp_path, strerror(errno));
+        goto cleanup;
+    }
+    p = buf;
+    while (p < buf + buf_len) {
+        ssize_t written = write(fd, p, buf + buf_len - p);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_debug("Can't write ignore cache entry %s: %s", tmp_path, strerror(errno));
+            close(fd);
+            unlink(tmp_path);
+            goto cleanup;
+        }
+        p += written;
+    }
+    close(fd);
+    if (rename(tmp_path, entry_path) != 0) {
+        log_debug("Can't rename ignore cache entry %s: %s", tmp_path, strerror(errno));
+        unlink(tmp_path);
+    } else {
+        log_debug("Cached ignore file %s in %s", path, entry_path);
+    }
+
+cleanup:
+    free(tmp_path);
+    free(entry_path);
+    free(buf);
+}
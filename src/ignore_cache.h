@@ -0,0 +1,20 @@
+#ifndef IGNORE_CACHE_H
+#define IGNORE_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ignore.h"
+
+/* Default location of the cache, relative to $XDG_CACHE_HOME or $HOME/.cache */
+#define IGNORE_CACHE_SUBDIR "ag/ignore"
+
+char *ignore_cache_default_dir(void);
+int ignore_cache_init(const char *dir);
+
+/* Load the parsed patterns of the ignore file described by statbuf. On a hit, patterns and
+ * patterns_len are filled in the same way as parsing the file would, and TRUE is returned. */
+int ignore_cache_load(const char *path, const struct stat *statbuf, char **patterns[], size_t patterns_len[]);
+void ignore_cache_store(const char *path, const struct stat *statbuf, char **patterns[], const size_t patterns_len[]);
+
+#endif
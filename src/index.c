@@ -0,0 +1,925 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "decompress.h"
+#include "index.h"
+#include "log.h"
+#include "options.h"
+#include "util.h"
+
+/*
+ * With --index-build, the files a search would look at are read as usual, but instead of being
+ * searched, every sequence of three bytes (trigram) in them is noted, and the index is written
+ * with the list of files each trigram appears in. With --index, ag looks up the trigrams of the
+ * strings that every match of the query has to contain, and only searches the files that have all
+ * of them. For a literal query, that's the query itself. For a regex, it's the runs of plain
+ * characters outside of any group or class, e.g. "foo" and "bar" in foo\d+bar, and nothing if
+ * there's a | outside of a group. A query without a run of three gets nothing out of the index.
+ *
+ * Trigrams are folded to lower case (ASCII), so the same index works with or without -i.
+ *
+ * The index keeps each file's size and modification time. A file that doesn't match them any
+ * more, or was modified so close to the build that it could have changed while it was being read,
+ * is searched whatever the index says, as is anything the index doesn't have at all: new files,
+ * and binary or compressed ones, which aren't indexed. So a stale index only makes searches
+ * slower, never wrong, until it's rebuilt.
+ *
+ * The file is meant to be mapped and used as it is:
+ *
+ *   header     index_header_t
+ *   files      an index_file_t for each, numbered in the order they were indexed
+ *   by path    the file numbers (uint32_t), sorted by path, to look files up
+ *   paths      NUL-terminated, relative to the directory the index was built in, then that
+ *              directory itself
+ *   trigrams   an index_trigram_t for each, sorted
+ *   postings   for each trigram, the numbers of the files that have it: the first, then the
+ *              difference from the one before, as varints
+ *
+ * All in the byte order of the machine that built it, which has to be the one using it.
+ */
+
+#define INDEX_MAGIC "AGINDEX1"
+#define INDEX_BYTE_ORDER 0x01020304
+/* Every trigram of bytes */
+#define INDEX_TRIGRAMS (1 << 24)
+/* Most trigrams of the query to look up. The rarest go first, and after a few of them, looking up
+ * more hardly leaves fewer files to search. */
+#define INDEX_QUERY_TRIGRAMS 16
+
+typedef struct {
+    char magic[8]; /* INDEX_MAGIC */
+    uint32_t byte_order;
+    uint32_t files_len;
+    uint32_t trigrams_len;
+    uint32_t root_off; /* of the directory it was built in, in the paths */
+    int64_t built;     /* files modified this second or later may have changed since they were read */
+    uint64_t by_path_off;
+    uint64_t paths_off;
+    uint64_t trigrams_off;
+    uint64_t postings_off;
+    uint64_t size;
+} index_header_t;
+
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t path_off; /* in the paths */
+} index_file_t;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count; /* of files that have it */
+    uint64_t off;   /* of its postings, which end where the next trigram's start */
+} index_trigram_t;
+
+/* A trigram's postings, as the index is built */
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t last; /* file added */
+    size_t len;
+    size_t size;
+    unsigned char *buf;
+} posting_list_t;
+
+/* The index being built. Files are added by the workers, so all of this is under build_mtx. */
+static pthread_mutex_t build_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int64_t build_started;
+static index_file_t *build_files = NULL;
+static size_t build_files_len = 0;
+static size_t build_files_size = 0;
+static char *build_paths = NULL;
+static size_t build_paths_len = 0;
+static size_t build_paths_size = 0;
+static uint32_t *build_slots = NULL; /* for each trigram, 1 + its place in build_lists, or 0 */
+static posting_list_t *build_lists = NULL;
+static size_t build_lists_len = 0;
+static size_t build_lists_size = 0;
+
+/* The trigrams of the file a thread is adding, and a bit for each trigram, set if it's one of
+ * them */
+static __thread uint32_t *file_trigrams = NULL;
+static __thread size_t file_trigrams_size = 0;
+static __thread unsigned char *file_seen = NULL;
+
+/* The index in use */
+static char *map = NULL;
+static size_t map_len = 0;
+static const index_header_t *header = NULL;
+static const index_file_t *files = NULL;
+static const uint32_t *by_path = NULL;
+static const char *paths = NULL;
+static size_t paths_len = 0;
+static const index_trigram_t *trigrams = NULL;
+static const unsigned char *postings = NULL;
+static size_t postings_len = 0;
+static unsigned char *candidates = NULL; /* a bit for each file, set if it has all the trigrams */
+static int have_index_st = FALSE;
+static dev_t index_dev;
+static ino_t index_ino;
+
+static inline uint32_t fold(char c) {
+    unsigned char u = (unsigned char)c;
+    return u >= 'A' && u <= 'Z' ? u + ('a' - 'A') : u;
+}
+
+static long mtime_nsec(const struct stat *st) {
+#ifdef OS_LINUX
+    return st->st_mtim.tv_nsec;
+#else
+    (void)st;
+    return 0;
+#endif
+}
+
+/* Paths are kept as they'd be found walking ".", without the "./" */
+static const char *normalize_path(const char *path) {
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+    }
+    return path;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void put_varint(posting_list_t *p, uint32_t v) {
+    if (p->len + 5 > p->size) {
+        p->size = p->size ? p->size * 2 : 16;
+        p->buf = ag_realloc(p->buf, p->size);
+    }
+    while (v >= 0x80) {
+        p->buf[p->len++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p->buf[p->len++] = (unsigned char)v;
+}
+
+/* Add the file numbered id, which has trigram, to its postings */
+static void add_posting(uint32_t trigram, uint32_t id) {
+    posting_list_t *p;
+
+    if (build_slots[trigram] == 0) {
+        if (build_lists_len == build_lists_size) {
+            build_lists_size = build_lists_size ? build_lists_size * 2 : 1024;
+            build_lists = ag_realloc(build_lists, build_lists_size * sizeof(posting_list_t));
+        }
+        p = &build_lists[build_lists_len++];
+        memset(p, 0, sizeof(posting_list_t));
+        p->trigram = trigram;
+        build_slots[trigram] = build_lists_len;
+    }
+    p = &build_lists[build_slots[trigram] - 1];
+    put_varint(p, p->count == 0 ? id : id - p->last);
+    p->count++;
+    p->last = id;
+}
+
+void index_add_file(const char *path, const char *buf, size_t len) {
+    struct stat st;
+    index_file_t *f;
+    size_t i, trigrams_len = 0, path_len;
+    uint32_t trigram = 0, id;
+
+    if (is_binary(buf, len) || is_zipped(buf, len) != AG_NO_COMPRESSION) {
+        /* Always searched, as the index doesn't have it */
+        log_debug("Not indexing %s: it's binary or compressed", path);
+        return;
+    }
+    /* After reading it: if it changed in between, it was after the build started */
+    if (stat(path, &st) != 0) {
+        log_debug("Not indexing %s: %s", path, strerror(errno));
+        return;
+    }
+
+    if (file_seen == NULL) {
+        file_seen = ag_calloc(INDEX_TRIGRAMS / 8, 1);
+    }
+    for (i = 0; i < len; i++) {
+        trigram = ((trigram << 8) | fold(buf[i])) & (INDEX_TRIGRAMS - 1);
+        if (i < 2 || file_seen[trigram >> 3] & (1 << (trigram & 7))) {
+            continue;
+        }
+        file_seen[trigram >> 3] |= 1 << (trigram & 7);
+        if (trigrams_len == file_trigrams_size) {
+            file_trigrams_size = file_trigrams_size ? file_trigrams_size * 2 : 4096;
+            file_trigrams = ag_realloc(file_trigrams, file_trigrams_size * sizeof(uint32_t));
+        }
+        file_trigrams[trigrams_len++] = trigram;
+    }
+    for (i = 0; i < trigrams_len; i++) {
+        file_seen[file_trigrams[i] >> 3] = 0;
+    }
+
+    path = normalize_path(path);
+    path_len = strlen(path) + 1;
+    pthread_mutex_lock(&build_mtx);
+    if (build_slots == NULL) {
+        build_slots = ag_calloc(INDEX_TRIGRAMS, sizeof(uint32_t));
+    }
+    if (build_files_len == build_files_size) {
+        build_files_size = build_files_size ? build_files_size * 2 : 1024;
+        build_files = ag_realloc(build_files, build_files_size * sizeof(index_file_t));
+    }
+    if (build_paths_len + path_len > build_paths_size) {
+        build_paths_size = ag_max(build_paths_size * 2, build_paths_len + path_len + 65536);
+        build_paths = ag_realloc(build_paths, build_paths_size);
+    }
+    id = build_files_len++;
+    f = &build_files[id];
+    f->size = st.st_size;
+    f->mtime_sec = st.st_mtime;
+    f->mtime_nsec = mtime_nsec(&st);
+    f->path_off = build_paths_len;
+    memcpy(build_paths + build_paths_len, path, path_len);
+    build_paths_len += path_len;
+    for (i = 0; i < trigrams_len; i++) {
+        add_posting(file_trigrams[i], id);
+    }
+    if (opts.stats) {
+        stats.files_indexed++;
+    }
+    pthread_mutex_unlock(&build_mtx);
+}
+
+static int compare_lists(const void *a, const void *b) {
+    return compare_u32(&((const posting_list_t *)a)->trigram, &((const posting_list_t *)b)->trigram);
+}
+
+static int compare_build_paths(const void *a, const void *b) {
+    return strcmp(build_paths + build_files[*(const uint32_t *)a].path_off,
+                  build_paths + build_files[*(const uint32_t *)b].path_off);
+}
+
+static void free_build(void) {
+    size_t i;
+
+    for (i = 0; i < build_lists_len; i++) {
+        free(build_lists[i].buf);
+    }
+    free(build_lists);
+    free(build_slots);
+    free(build_paths);
+    free(build_files);
+    build_lists = NULL;
+    build_slots = NULL;
+    build_paths = NULL;
+    build_files = NULL;
+    build_lists_len = build_lists_size = build_paths_len = build_paths_size = build_files_len = build_files_size = 0;
+}
+
+void index_write(const char *path) {
+    static const char padding[8] = { 0 };
+    index_header_t h;
+    index_trigram_t t;
+    uint32_t *sorted;
+    char root[PATH_MAX];
+    char *tmp_path;
+    FILE *fp;
+    uint64_t off;
+    size_t i, root_len;
+    int failed;
+
+    if (getcwd(root, sizeof(root)) == NULL) {
+        die("Can't build the index: %s", strerror(errno));
+    }
+    root_len = strlen(root) + 1;
+    if (build_files_len > UINT32_MAX || build_paths_len + root_len > UINT32_MAX) {
+        die("Too many files to index.");
+    }
+
+    qsort(build_lists, build_lists_len, sizeof(posting_list_t), compare_lists);
+    sorted = ag_malloc(ag_max(build_files_len, 1) * sizeof(uint32_t));
+    for (i = 0; i < build_files_len; i++) {
+        sorted[i] = i;
+    }
+    qsort(sorted, build_files_len, sizeof(uint32_t), compare_build_paths);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.byte_order = INDEX_BYTE_ORDER;
+    h.files_len = build_files_len;
+    h.trigrams_len = build_lists_len;
+    h.root_off = build_paths_len;
+    h.built = build_started;
+    h.by_path_off = sizeof(h) + build_files_len * sizeof(index_file_t);
+    h.paths_off = h.by_path_off + build_files_len * sizeof(uint32_t);
+    h.trigrams_off = (h.paths_off + build_paths_len + root_len + 7) & ~(uint64_t)7;
+    h.postings_off = h.trigrams_off + build_lists_len * sizeof(index_trigram_t);
+    h.size = h.postings_off;
+    for (i = 0; i < build_lists_len; i++) {
+        h.size += build_lists[i].len;
+    }
+
+    /* Written next to it and moved into place, so a search never sees half of it */
+    ag_asprintf(&tmp_path, "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        die("Can't write the index to %s: %s", tmp_path, strerror(errno));
+    }
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(build_files, sizeof(index_file_t), build_files_len, fp);
+    fwrite(sorted, sizeof(uint32_t), build_files_len, fp);
+    fwrite(build_paths, 1, build_paths_len, fp);
+    fwrite(root, 1, root_len, fp);
+    fwrite(padding, 1, h.trigrams_off - (h.paths_off + build_paths_len + root_len), fp);
+    off = 0;
+    for (i = 0; i < build_lists_len; i++) {
+        t.trigram = build_lists[i].trigram;
+        t.count = build_lists[i].count;
+        t.off = off;
+        fwrite(&t, sizeof(t), 1, fp);
+        off += build_lists[i].len;
+    }
+    for (i = 0; i < build_lists_len; i++) {
+        fwrite(build_lists[i].buf, 1, build_lists[i].len, fp);
+    }
+    failed = ferror(fp);
+    if (fclose(fp) != 0 || failed) {
+        unlink(tmp_path);
+        die("Can't write the index to %s: %s", tmp_path, strerror(errno));
+    }
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        die("Can't move the index to %s: %s", path, strerror(errno));
+    }
+    log_debug("Indexed %zu files, with %zu trigrams, in %s", build_files_len, build_lists_len, path);
+    opts.match_found = TRUE;
+
+    free(tmp_path);
+    free(sorted);
+    free_build();
+}
+
+static void unload(void) {
+    if (map != NULL) {
+#ifdef _WIN32
+        free(map);
+#else
+        munmap(map, map_len);
+#endif
+    }
+    map = NULL;
+    header = NULL;
+    free(candidates);
+    candidates = NULL;
+}
+
+/* Check that everything in the index is where the header says, in order, so that using it can't
+ * go out of bounds */
+static int index_valid(void) {
+    uint32_t i;
+
+    header = (const index_header_t *)map;
+    if (map_len < sizeof(index_header_t) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != INDEX_BYTE_ORDER || header->size != map_len ||
+        header->by_path_off != sizeof(index_header_t) + (uint64_t)header->files_len * sizeof(index_file_t) ||
+        header->paths_off != header->by_path_off + (uint64_t)header->files_len * sizeof(uint32_t) ||
+        header->trigrams_off <= header->paths_off || header->trigrams_off % 8 != 0 ||
+        header->postings_off != header->trigrams_off + (uint64_t)header->trigrams_len * sizeof(index_trigram_t) ||
+        header->postings_off > map_len) {
+        return FALSE;
+    }
+    files = (const index_file_t *)(map + sizeof(index_header_t));
+    by_path = (const uint32_t *)(map + header->by_path_off);
+    paths = map + header->paths_off;
+    paths_len = header->trigrams_off - header->paths_off;
+    trigrams = (const index_trigram_t *)(map + header->trigrams_off);
+    postings = (const unsigned char *)map + header->postings_off;
+    postings_len = map_len - header->postings_off;
+    if (paths[paths_len - 1] != '\0' || header->root_off >= paths_len) {
+        return FALSE;
+    }
+    for (i = 0; i < header->trigrams_len; i++) {
+        if (trigrams[i].off > postings_len || trigrams[i].trigram >= INDEX_TRIGRAMS ||
+            (i > 0 && (trigrams[i].trigram <= trigrams[i - 1].trigram || trigrams[i].off < trigrams[i - 1].off))) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int index_load(const char *path) {
+    struct stat st;
+    char cwd[PATH_MAX];
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_warn("Can't open the index %s: %s. Searching every file.", path, strerror(errno));
+        return FALSE;
+    }
+    if (fstat(fd, &st) != 0) {
+        log_warn("Can't stat the index %s: %s. Searching every file.", path, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+    have_index_st = TRUE;
+    index_dev = st.st_dev;
+    index_ino = st.st_ino;
+    map_len = st.st_size;
+    if (map_len < sizeof(index_header_t)) {
+        log_warn("%s isn't an index. Searching every file.", path);
+        close(fd);
+        return FALSE;
+    }
+#ifdef _WIN32
+    {
+        size_t done = 0;
+        ssize_t r = 0;
+        map = ag_malloc(map_len);
+        while (done < map_len && (r = read(fd, map + done, map_len - done)) > 0) {
+            done += r;
+        }
+        if (done < map_len) {
+            log_warn("Can't read the index %s: %s. Searching every file.", path, strerror(errno));
+            close(fd);
+            unload();
+            return FALSE;
+        }
+    }
+#else
+    map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        log_warn("Can't map the index %s: %s. Searching every file.", path, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+#endif
+    close(fd);
+
+    if (!index_valid()) {
+        log_warn("%s isn't an index this version of ag can use. Searching every file.", path);
+        unload();
+        return FALSE;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL || strcmp(cwd, paths + header->root_off) != 0) {
+        /* The paths in it are relative to there */
+        log_warn("The index %s was built in %s. Searching every file.", path, paths + header->root_off);
+        unload();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Append the trigrams of s[0..len) to trigrams */
+static void add_trigrams(const char *s, size_t len, uint32_t *trigrams_out, size_t *trigrams_len) {
+    size_t i;
+
+    for (i = 2; i < len; i++) {
+        trigrams_out[(*trigrams_len)++] = fold(s[i - 2]) << 16 | fold(s[i - 1]) << 8 | fold(s[i]);
+    }
+}
+
+/* Skip the rest of a class, after its [ */
+static const char *skip_class(const char *q, const char *end) {
+    const char *close;
+
+    if (q < end && *q == '^') {
+        q++;
+    }
+    if (q < end && *q == ']') {
+        /* It's the first character, so it's part of the class */
+        q++;
+    }
+    while (q < end && *q != ']') {
+        if (*q == '\\' && q + 1 < end) {
+            q += 2;
+        } else if (*q == '[' && q + 1 < end && (q[1] == ':' || q[1] == '.' || q[1] == '=')) {
+            /* e.g. [:alpha:], which can have a ] of its own */
+            for (close = q + 2; close + 1 < end && !(close[0] == q[1] && close[1] == ']'); close++) {
+            }
+            q = close + 1 < end ? close + 2 : q + 1;
+        } else {
+            q++;
+        }
+    }
+    return q < end ? q + 1 : end;
+}
+
+/* Whether the { before q starts a quantifier, e.g. {2} or {1,3}, and if so, where it ends. If not,
+ * it's just a {. */
+static int is_quantifier(const char *q, const char *end, const char **after) {
+    int digits = 0;
+
+    for (; q < end && *q != '}'; q++) {
+        if (isdigit((unsigned char)*q)) {
+            digits++;
+        } else if (*q != ',' && *q != ' ') {
+            return FALSE;
+        }
+    }
+    if (q == end || digits == 0) {
+        return FALSE;
+    }
+    *after = q + 1;
+    return TRUE;
+}
+
+/* The character an escape like \t stands for, or 0 if it's not that kind of escape */
+static char escaped_char(char c) {
+    switch (c) {
+        case 'a':
+            return '\a';
+        case 'e':
+            return '\x1b';
+        case 'f':
+            return '\f';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 't':
+            return '\t';
+        default:
+            return 0;
+    }
+}
+
+/* Find the trigrams of the strings every match of the query has to contain, into trigrams_out,
+ * which has room for one per byte of the query. Returns how many there are. A regex is only read
+ * as far as it's easy to be sure of, so this misses some, but never gets one wrong. */
+static size_t query_trigrams(uint32_t *trigrams_out) {
+    const char *q = opts.query;
+    const char *end = opts.query + opts.query_len;
+    const char *after;
+    char *run;
+    size_t run_len = 0, trigrams_len = 0;
+    int depth = 0;
+    char c;
+
+    if (opts.literal) {
+        add_trigrams(opts.query, opts.query_len, trigrams_out, &trigrams_len);
+        return trigrams_len;
+    }
+    if (strstr(opts.query, "\\Q") != NULL || strncmp(opts.query, "(*", 2) == 0) {
+        /* Quoting, or an option like (*UCP) that can change what everything else means */
+        return 0;
+    }
+
+    run = ag_malloc(opts.query_len);
+    while (q < end) {
+        c = *q++;
+        if (depth > 0) {
+            /* Groups are skipped, as they can have alternatives, or be optional */
+            if (c == '\\' && q < end) {
+                q++;
+            } else if (c == '[') {
+                q = skip_class(q, end);
+            } else if (c == '(' && end - q >= 2 && q[0] == '?' && q[1] == '#') {
+                q = memchr(q, ')', end - q);
+                q = q ? q + 1 : end;
+            } else if (c == '(') {
+                depth++;
+            } else if (c == ')') {
+                depth--;
+            }
+            continue;
+        }
+        switch (c) {
+            case '\\':
+                if (q == end) {
+                    goto give_up;
+                }
+                c = *q++;
+                if (!isalnum((unsigned char)c)) {
+                    run[run_len++] = c;
+                } else if (escaped_char(c)) {
+                    run[run_len++] = escaped_char(c);
+                } else if (strchr("AbBdDGhHKRsSvVwWXzZ", c)) {
+                    /* A class or an assertion */
+                    add_trigrams(run, run_len, trigrams_out, &trigrams_len);
+                    run_len = 0;
+                } else {
+                    /* Something with more to it, like \x41 or \p{L} */
+                    goto give_up;
+                }
+                break;
+            case '(':
+                add_trigrams(run, run_len, trigrams_out, &trigrams_len);
+                run_len = 0;
+                if (end - q >= 2 && q[0] == '?' && q[1] == '#') {
+                    q = memchr(q, ')', end - q);
+                    q = q ? q + 1 : end;
+                    break;
+                }
+                if (q < end && *q == '?') {
+                    for (after = q + 1; after < end && (isalpha((unsigned char)*after) || *after == '-' || *after == '^');
+                         after++) {
+                        if (*after == 'x') {
+                            /* Extended: whitespace and # don't mean what they say any more */
+                            goto give_up;
+                        }
+                    }
+                }
+                depth++;
+                break;
+            case ')':
+            case '|':
+                goto give_up;
+            case '[':
+                add_trigrams(run, run_len, trigrams_out, &trigrams_len);
+                run_len = 0;
+                q = skip_class(q, end);
+                break;
+            case '.':
+            case '^':
+            case '$':
+                add_trigrams(run, run_len, trigrams_out, &trigrams_len);
+                run_len = 0;
+                break;
+            case '{':
+                if (!is_quantifier(q, end, &after)) {
+                    run[run_len++] = c;
+                    break;
+                }
+                q = after;
+                /* FALLTHROUGH */
+            case '*':
+            case '?':
+                /* What came before might not be there at all */
+                if (run_len > 0) {
+                    run_len--;
+                }
+                /* FALLTHROUGH */
+            case '+':
+                add_trigrams(run, run_len, trigrams_out, &trigrams_len);
+                run_len = 0;
+                break;
+            default:
+                run[run_len++] = c;
+                break;
+        }
+    }
+    add_trigrams(run, run_len, trigrams_out, &trigrams_len);
+    free(run);
+    return trigrams_len;
+
+give_up:
+    free(run);
+    return 0;
+}
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    uint32_t left; /* file numbers */
+    uint32_t id;   /* the last one */
+} postings_iter_t;
+
+static void postings_start(postings_iter_t *it, const index_trigram_t *t) {
+    it->p = postings + t->off;
+    it->end = postings + (t + 1 < trigrams + header->trigrams_len ? t[1].off : postings_len);
+    it->left = t->count;
+    it->id = 0;
+}
+
+/* Get the next file number into it->id. Returns 1 if there was one, 0 if there are no more, and
+ * -1 if the index is corrupt. */
+static int postings_next(postings_iter_t *it, uint32_t count) {
+    uint64_t v = 0;
+    int shift = 0;
+
+    if (it->left == 0) {
+        return 0;
+    }
+    do {
+        if (it->p == it->end || shift > 28) {
+            return -1;
+        }
+        v |= (uint64_t)(*it->p & 0x7f) << shift;
+        shift += 7;
+    } while (*it->p++ & 0x80);
+    if (it->left-- != count) {
+        /* The first is as it is, the rest are differences */
+        if (v == 0) {
+            return -1;
+        }
+        v += it->id;
+    }
+    if (v >= header->files_len) {
+        return -1;
+    }
+    it->id = v;
+    return 1;
+}
+
+static int compare_trigrams(const void *a, const void *b) {
+    return compare_u32(&((const index_trigram_t *)a)->trigram, &((const index_trigram_t *)b)->trigram);
+}
+
+static int compare_counts(const void *a, const void *b) {
+    return compare_u32(&(*(const index_trigram_t *const *)a)->count, &(*(const index_trigram_t *const *)b)->count);
+}
+
+/* Keep the file numbers in ids[0..ids_len) that t has. Returns how many are left, or -1 if the
+ * index is corrupt. */
+static ssize_t intersect(const index_trigram_t *t, uint32_t *ids, size_t ids_len) {
+    postings_iter_t it;
+    size_t i = 0, kept = 0;
+    int rv = 0;
+
+    postings_start(&it, t);
+    while (i < ids_len && (rv = postings_next(&it, t->count)) == 1) {
+        while (i < ids_len && ids[i] < it.id) {
+            i++;
+        }
+        if (i < ids_len && ids[i] == it.id) {
+            ids[kept++] = ids[i++];
+        }
+    }
+    return rv == -1 ? -1 : (ssize_t)kept;
+}
+
+/* Mark the files that have all of query_trigrams[0..len) as candidates. Returns FALSE if the
+ * index is corrupt. */
+static int find_candidates(const uint32_t *query_trigrams, size_t len) {
+    const index_trigram_t **found;
+    index_trigram_t key;
+    postings_iter_t it;
+    uint32_t *ids = NULL;
+    size_t i, found_len = 0, ids_len = 0;
+    ssize_t kept;
+    int rv = TRUE;
+
+    candidates = ag_calloc(header->files_len / 8 + 1, 1);
+    found = ag_malloc(len * sizeof(index_trigram_t *));
+    for (i = 0; i < len; i++) {
+        key.trigram = query_trigrams[i];
+        found[found_len] = bsearch(&key, trigrams, header->trigrams_len, sizeof(index_trigram_t), compare_trigrams);
+        if (found[found_len] == NULL) {
+            log_debug("No indexed file has all of the query");
+            goto done;
+        }
+        found_len++;
+    }
+
+    qsort(found, found_len, sizeof(index_trigram_t *), compare_counts);
+    ids = ag_malloc((found[0]->count + 1) * sizeof(uint32_t));
+    postings_start(&it, found[0]);
+    while ((rv = postings_next(&it, found[0]->count)) == 1) {
+        ids[ids_len++] = it.id;
+    }
+    if (rv == -1 || ids_len != found[0]->count) {
+        rv = FALSE;
+        goto done;
+    }
+    rv = TRUE;
+    for (i = 1; i < found_len && i < INDEX_QUERY_TRIGRAMS && ids_len > 0; i++) {
+        kept = intersect(found[i], ids, ids_len);
+        if (kept < 0) {
+            rv = FALSE;
+            goto done;
+        }
+        ids_len = kept;
+    }
+    for (i = 0; i < ids_len; i++) {
+        candidates[ids[i] >> 3] |= 1 << (ids[i] & 7);
+    }
+    log_debug("%zu of the %u indexed files might match", ids_len, header->files_len);
+
+done:
+    free(ids);
+    free(found);
+    return rv;
+}
+
+void index_init(const char *path) {
+    uint32_t *query;
+    size_t query_len, i, len = 0;
+
+    if (opts.index_build) {
+        /* Coarse timestamps can put a write a little before the clock, so allow a second */
+        build_started = (int64_t)time(NULL) - 1;
+        return;
+    }
+    if (opts.invert_match || opts.print_nonmatching_files || opts.print_all_paths || opts.passthrough) {
+        log_debug("Not using the index: files that don't match are needed too");
+        return;
+    }
+
+    query = ag_malloc((opts.query_len + 1) * sizeof(uint32_t));
+    query_len = query_trigrams(query);
+    if (query_len == 0) {
+        log_debug("Nothing in the query to look up in the index");
+        free(query);
+        return;
+    }
+    qsort(query, query_len, sizeof(uint32_t), compare_u32);
+    for (i = 0; i < query_len; i++) {
+        if (len == 0 || query[i] != query[len - 1]) {
+            query[len++] = query[i];
+        }
+    }
+
+    if (index_load(path) && !find_candidates(query, len)) {
+        log_warn("The index %s is corrupt. Searching every file.", path);
+        unload();
+    }
+    free(query);
+}
+
+/* The number of the file at path in the index, or -1 if it's not in it */
+static int64_t find_file(const char *path) {
+    size_t lo = 0, hi = header->files_len, mid;
+    uint32_t id;
+    int cmp;
+
+    path = normalize_path(path);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        id = by_path[mid];
+        if (id >= header->files_len || files[id].path_off >= paths_len) {
+            return -1;
+        }
+        cmp = strcmp(path, paths + files[id].path_off);
+        if (cmp == 0) {
+            return id;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+/* The number of the file at path in the index if it doesn't have all the trigrams, or -1 */
+static int64_t find_skippable(const char *path) {
+    int64_t id;
+
+    if (candidates == NULL) {
+        return -1;
+    }
+    id = find_file(path);
+    return id >= 0 && !(candidates[id >> 3] & (1 << (id & 7))) ? id : -1;
+}
+
+int index_may_skip(const char *path) {
+    return find_skippable(path) >= 0;
+}
+
+int index_skips(const char *path, const struct stat *st) {
+    const index_file_t *f;
+    int64_t id;
+
+    if (have_index_st && st->st_dev == index_dev && st->st_ino == index_ino) {
+        log_debug("Skipping %s: it's the index", path);
+        return TRUE;
+    }
+    id = find_skippable(path);
+    if (id < 0) {
+        return FALSE;
+    }
+    f = &files[id];
+    if ((uint64_t)st->st_size != f->size || st->st_mtime != f->mtime_sec || mtime_nsec(st) != f->mtime_nsec ||
+        st->st_mtime >= header->built) {
+        log_debug("%s might have changed since it was indexed", path);
+        if (opts.stats) {
+            __sync_fetch_and_add(&stats.files_index_stale, 1);
+        }
+        return FALSE;
+    }
+    log_debug("Skipping %s: the index says it doesn't match", path);
+    if (opts.stats) {
+        __sync_fetch_and_add(&stats.files_index_skipped, 1);
+    }
+    return TRUE;
+}
+
+void index_free_buffers(void) {
+    free(file_trigrams);
+    free(file_seen);
+    file_trigrams = NULL;
+    file_trigrams_size = 0;
+    file_seen = NULL;
+}
+
+void index_cleanup(void) {
+    unload();
+    free_build();
+}
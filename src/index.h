@@ -0,0 +1,24 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* Get ready to build the index (--index-build), or load it and look up the query in it
+ * (--index), before the search starts. If the index can't be used, everything is searched. */
+void index_init(const char *path);
+/* Add a file the walk found, with its contents, to the index being built */
+void index_add_file(const char *path, const char *buf, size_t len);
+/* Write the index of the files that have been added to path */
+void index_write(const char *path);
+/* Whether the file at path can be skipped without looking at it: it's in the index, and doesn't
+ * have everything the query needs. It might have changed since, though: see index_skips(). */
+int index_may_skip(const char *path);
+/* Whether the file at path, with st from stat(), can be skipped: it's the index itself, or it
+ * can't match the query and hasn't changed since it was indexed */
+int index_skips(const char *path, const struct stat *st);
+/* Free this thread's buffers */
+void index_free_buffers(void);
+void index_cleanup(void);
+
+#endif
@@ -0,0 +1,478 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "index.h"
+#include "io_threads.h"
+#include "log.h"
+#include "options.h"
+#include "prefetch.h"
+#include "uring.h"
+#include "util.h"
+#include "work_queue.h"
+
+#ifdef USE_IO_URING
+#include <sys/sysmacros.h>
+#endif
+
+/*
+ * With --io-threads, opening and reading files is split off from searching them.
+ *
+ * Normally each worker opens, reads (or maps) and searches a file before moving on to the next,
+ * so a worker that's waiting on a slow read, e.g. from NFS, can't search anything meanwhile.
+ * Adding workers to cover the latency means more threads competing for the CPU once the files do
+ * arrive. Instead, a pool of I/O threads takes files off the work queue and loads them, and the
+ * workers (one per core, as usual) only search what's been loaded. There can be many more I/O
+ * threads than cores, since they spend nearly all their time waiting.
+ *
+ * Loaded files wait in a bounded queue, so the I/O threads can't get arbitrarily far ahead of the
+ * matchers and pile up file contents in memory.
+ *
+ * With --io-uring, each I/O thread loads a batch of files at a time through io_uring instead: it
+ * submits an openat and a statx for every file in the batch at once, then reads all the small
+ * regular files into buffers from a shared pool, and closes them along with the next batch. For
+ * lots of small files, that's a few system calls per batch instead of half a dozen per file.
+ * Anything else (big files, pipes, /proc, errors) gets loaded the usual way, which takes care of
+ * reporting it.
+ */
+
+static pthread_t *threads = NULL;
+static work_queue_worker_t *thread_args = NULL;
+static int threads_len = 0;
+static int threads_running = 0;
+
+static ready_file_t *ready = NULL;
+static size_t ready_size = 0;
+static size_t ready_head = 0;
+static size_t ready_len = 0;
+
+static pthread_mutex_t ready_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ready_not_full = PTHREAD_COND_INITIALIZER;
+
+static void ready_push(const ready_file_t *rf) {
+    pthread_mutex_lock(&ready_mtx);
+    while (ready_len == ready_size) {
+        pthread_cond_wait(&ready_not_full, &ready_mtx);
+    }
+    ready[(ready_head + ready_len) % ready_size] = *rf;
+    ready_len++;
+    pthread_cond_signal(&ready_not_empty);
+    pthread_mutex_unlock(&ready_mtx);
+}
+
+int io_ready_pop(ready_file_t *out) {
+    pthread_mutex_lock(&ready_mtx);
+    while (ready_len == 0) {
+        if (threads_running == 0) {
+            pthread_mutex_unlock(&ready_mtx);
+            return FALSE;
+        }
+        pthread_cond_wait(&ready_not_empty, &ready_mtx);
+    }
+    *out = ready[ready_head];
+    ready_head = (ready_head + 1) % ready_size;
+    ready_len--;
+    pthread_cond_signal(&ready_not_full);
+    pthread_mutex_unlock(&ready_mtx);
+    return TRUE;
+}
+
+#ifdef USE_IO_URING
+/* Files up to this size are read into a buffer from the pool */
+#define IO_URING_BUF_SIZE (64 * 1024)
+/* Most files loaded at once by each I/O thread */
+#define IO_URING_BATCH 32
+
+/* What each completion is for, in the low bits of its user_data. The file's index in the batch
+ * is in the rest. */
+#define URING_OPEN 0
+#define URING_STATX 1
+#define URING_READ 2
+#define URING_CLOSE 3
+
+static char *pool = NULL;
+static unsigned pool_len = 0;
+static unsigned *pool_free = NULL;
+static unsigned pool_free_len = 0;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_returned = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+    ready_file_t rf;
+    struct statx stx;
+    int fd;
+    int stx_res;
+    int read_res;
+    unsigned buf;
+} uring_file_t;
+
+/* Take up to max buffers from the pool, waiting until there's at least one */
+static unsigned pool_take(unsigned *bufs, unsigned max) {
+    unsigned n = 0;
+
+    pthread_mutex_lock(&pool_mtx);
+    while (pool_free_len == 0) {
+        pthread_cond_wait(&pool_returned, &pool_mtx);
+    }
+    while (n < max && pool_free_len > 0) {
+        bufs[n++] = pool_free[--pool_free_len];
+    }
+    pthread_mutex_unlock(&pool_mtx);
+    return n;
+}
+
+static void pool_give(unsigned buf) {
+    pthread_mutex_lock(&pool_mtx);
+    pool_free[pool_free_len++] = buf;
+    pthread_cond_signal(&pool_returned);
+    pthread_mutex_unlock(&pool_mtx);
+}
+
+void io_pool_release(char *buf) {
+    pool_give((unsigned)((buf - pool) / IO_URING_BUF_SIZE));
+}
+
+/* Submit what's queued and wait for wait_nr completions. Returns FALSE if the ring has stopped
+ * working, in which case the files are loaded the usual way from then on. */
+static int uring_wait(uring_t *ring, unsigned wait_nr) {
+    int rv = uring_submit(ring, wait_nr);
+
+    if (rv < 0) {
+        log_err("io_uring failed: %s. Loading files the usual way.", strerror(-rv));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Submit what's queued, then wait for expected completions (not counting closes, which can come
+ * in at any point) and record their results. Returns FALSE if the ring has stopped working. */
+static int uring_reap(uring_t *ring, uring_file_t *files, unsigned expected, unsigned *closes) {
+    struct io_uring_cqe *cqe;
+
+    if (!uring_wait(ring, expected)) {
+        return FALSE;
+    }
+    while (expected > 0 || *closes > 0) {
+        unsigned long long tag;
+        if ((cqe = uring_peek_cqe(ring)) == NULL) {
+            if (expected == 0) {
+                /* Closes can finish later */
+                break;
+            }
+            if (!uring_wait(ring, 1)) {
+                return FALSE;
+            }
+            continue;
+        }
+        tag = cqe->user_data;
+        switch (tag & 3) {
+            case URING_OPEN:
+                files[tag >> 2].fd = cqe->res;
+                expected--;
+                break;
+            case URING_STATX:
+                files[tag >> 2].stx_res = cqe->res;
+                expected--;
+                break;
+            case URING_READ:
+                files[tag >> 2].read_res = cqe->res;
+                expected--;
+                break;
+            case URING_CLOSE:
+                (*closes)--;
+                break;
+        }
+        uring_cqe_seen(ring);
+    }
+    return TRUE;
+}
+
+/* Can a file be read with io_uring, as opposed to needing search_file_load()'s special cases? */
+static int uring_readable(const uring_file_t *f) {
+    if (f->fd < 0 || f->stx_res < 0) {
+        return FALSE;
+    }
+    if (!S_ISREG(f->stx.stx_mode) || f->stx.stx_size == 0 || f->stx.stx_size > IO_URING_BUF_SIZE) {
+        return FALSE;
+    }
+    if (opts.stdout_inode != 0 && opts.stdout_inode == f->stx.stx_ino) {
+        return FALSE;
+    }
+    if (!opts.cache_pollution) {
+        /* The file is closed as soon as it's read, before it could be dropped from the cache */
+        return FALSE;
+    }
+#ifdef OS_LINUX
+    {
+        dev_t dev = makedev(f->stx.stx_dev_major, f->stx.stx_dev_minor);
+        if ((proc_dev && dev == proc_dev) || (sys_dev && dev == sys_dev)) {
+            return FALSE;
+        }
+    }
+#endif
+    return TRUE;
+}
+
+static void uring_close(uring_t *ring, int fd, unsigned *closes) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = URING_CLOSE;
+    (*closes)++;
+}
+
+static void uring_loop(const work_queue_worker_t *worker, uring_t *ring, int fixed_bufs) {
+    uring_file_t files[IO_URING_BATCH];
+    work_item_t items[IO_URING_BATCH];
+    unsigned bufs[IO_URING_BATCH];
+    char *path = NULL;
+    size_t path_size = 0;
+    unsigned closes = 0;
+    unsigned bufs_len, items_len, opens, reads, i;
+    int ring_ok = TRUE;
+
+    while (ring_ok) {
+        bufs_len = pool_take(bufs, IO_URING_BATCH);
+        items_len = work_queue_pop(worker, items, bufs_len);
+        for (i = items_len; i < bufs_len; i++) {
+            pool_give(bufs[i]);
+        }
+        if (items_len == 0) {
+            break;
+        }
+
+        /* Open and statx the whole batch at once, along with closing the last one's files. The
+         * ring has room for all of that. */
+        opens = 0;
+        for (i = 0; i < items_len; i++) {
+            uring_file_t *f = &files[i];
+            struct io_uring_sqe *sqe;
+
+            f->rf.path = ag_strdup(work_item_path(&items[i], &path, &path_size));
+            f->rf.seq = items[i].seq;
+            work_dir_release(items[i].dir);
+            f->fd = f->stx_res = f->read_res = -1;
+            f->buf = bufs[i];
+            if (opts.index_path && index_may_skip(f->rf.path)) {
+                /* Most likely skipped: load_file() makes sure it hasn't changed */
+                continue;
+            }
+
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)f->rf.path;
+            sqe->open_flags = O_RDONLY;
+            sqe->user_data = (i << 2) | URING_OPEN;
+
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)f->rf.path;
+            sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE;
+            sqe->off = (unsigned long)&f->stx;
+            sqe->user_data = (i << 2) | URING_STATX;
+            opens++;
+        }
+        ring_ok = uring_reap(ring, files, opens * 2, &closes);
+
+        /* Read the small regular files */
+        reads = 0;
+        for (i = 0; ring_ok && i < items_len; i++) {
+            uring_file_t *f = &files[i];
+            struct io_uring_sqe *sqe;
+
+            if (!uring_readable(f)) {
+                continue;
+            }
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = f->fd;
+            sqe->addr = (unsigned long)(pool + (size_t)f->buf * IO_URING_BUF_SIZE);
+            sqe->len = (unsigned)f->stx.stx_size;
+            sqe->off = 0;
+            sqe->buf_index = fixed_bufs ? f->buf : 0;
+            sqe->user_data = (i << 2) | URING_READ;
+            reads++;
+        }
+        if (ring_ok) {
+            ring_ok = uring_reap(ring, files, reads, &closes);
+        }
+
+        for (i = 0; i < items_len; i++) {
+            uring_file_t *f = &files[i];
+            if (f->fd >= 0 && ring_ok) {
+                uring_close(ring, f->fd, &closes);
+            } else if (f->fd >= 0) {
+                close(f->fd);
+            }
+            if (f->read_res >= 0 && (unsigned long long)f->read_res == f->stx.stx_size) {
+                f->rf.file.path = f->rf.path;
+                f->rf.file.contents = FILE_POOLED;
+                f->rf.file.fd = -1;
+                f->rf.file.cached = -1;
+                f->rf.file.buf = pool + (size_t)f->buf * IO_URING_BUF_SIZE;
+                f->rf.file.len = f->read_res;
+                if (opts.stats) {
+                    __sync_fetch_and_add(&stats.files_read, 1);
+                }
+            } else {
+                /* Let the usual code deal with it, errors and all */
+                pool_give(f->buf);
+                search_file_load(f->rf.path, &f->rf.file);
+            }
+            ready_push(&f->rf);
+        }
+    }
+    /* Wait for the last batch's files to be closed. If the ring stopped working, io_thread()
+     * loads the rest of the files. */
+    if (ring_ok) {
+        ring_ok = uring_reap(ring, files, 0, &closes);
+    }
+    while (ring_ok && closes > 0) {
+        ring_ok = uring_wait(ring, 1) && uring_reap(ring, files, 0, &closes);
+    }
+    free(path);
+}
+
+/* Set up io_uring for an I/O thread. Returns FALSE if it can't be used. */
+static int uring_start(uring_t *ring, int *fixed_bufs) {
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_READ_FIXED,
+                               IORING_OP_CLOSE };
+    int rv = uring_init(ring, IO_URING_BATCH * 4, ops, sizeof(ops) / sizeof(ops[0]));
+
+    if (rv != 0) {
+        log_debug("Can't use io_uring (%s). Loading files the usual way.", strerror(rv));
+        return FALSE;
+    }
+    /* Registered buffers save mapping them for every read, but count against RLIMIT_MEMLOCK on
+     * some kernels. They're not essential. */
+    rv = uring_register_buffers(ring, pool, IO_URING_BUF_SIZE, pool_len);
+    if (rv != 0) {
+        log_debug("Can't register io_uring buffers (%s)", strerror(rv));
+    }
+    *fixed_bufs = rv == 0;
+    return TRUE;
+}
+#else
+void io_pool_release(char *buf) {
+    (void)buf;
+}
+#endif
+
+static void *io_thread(void *arg) {
+    const work_queue_worker_t *worker = arg;
+    work_item_t items[WORK_QUEUE_POP_MAX];
+    size_t items_len, i;
+    char *path = NULL;
+    size_t path_size = 0;
+    prefetch_timer_t timer;
+
+    log_debug("I/O thread %i started", worker->id);
+#ifdef USE_IO_URING
+    if (opts.io_uring) {
+        uring_t ring;
+        int fixed_bufs;
+        if (uring_start(&ring, &fixed_bufs)) {
+            uring_loop(worker, &ring, fixed_bufs);
+            uring_free(&ring);
+        }
+    }
+#endif
+    while ((items_len = work_queue_pop(worker, items, WORK_QUEUE_POP_MAX)) > 0) {
+        for (i = 0; i < items_len; i++) {
+            ready_file_t rf;
+            rf.path = ag_strdup(work_item_path(&items[i], &path, &path_size));
+            rf.seq = items[i].seq;
+            work_dir_release(items[i].dir);
+            prefetch_timer_start(&timer);
+            search_file_load(rf.path, &rf.file);
+            prefetch_timer_stop(&timer);
+            ready_push(&rf);
+        }
+    }
+    free(path);
+
+    pthread_mutex_lock(&ready_mtx);
+    if (--threads_running == 0) {
+        /* Let the matchers know there's nothing more coming */
+        pthread_cond_broadcast(&ready_not_empty);
+    }
+    pthread_mutex_unlock(&ready_mtx);
+    log_debug("I/O thread %i finished.", worker->id);
+    return NULL;
+}
+
+void io_threads_start(int io_threads) {
+    int i, rv;
+
+    threads_len = io_threads;
+    threads = ag_calloc(threads_len, sizeof(pthread_t));
+    thread_args = ag_calloc(threads_len, sizeof(work_queue_worker_t));
+    ready_size = (size_t)threads_len * IO_READY_PER_THREAD;
+    ready = ag_malloc(ready_size * sizeof(ready_file_t));
+    ready_head = ready_len = 0;
+    threads_running = threads_len;
+
+#ifdef USE_IO_URING
+    if (opts.io_uring) {
+        /* Enough buffers for every thread to have a batch in flight and another waiting */
+        pool_len = (unsigned)threads_len * IO_URING_BATCH * 2;
+        pool = ag_malloc((size_t)pool_len * IO_URING_BUF_SIZE);
+        pool_free = ag_malloc(pool_len * sizeof(unsigned));
+        for (pool_free_len = 0; pool_free_len < pool_len; pool_free_len++) {
+            pool_free[pool_free_len] = pool_len - 1 - pool_free_len;
+        }
+    }
+#else
+    if (opts.io_uring) {
+        log_debug("No io_uring support. Loading files the usual way.");
+    }
+#endif
+
+    log_debug("Using %i I/O threads", threads_len);
+    for (i = 0; i < threads_len; i++) {
+        thread_args[i].id = i;
+        thread_args[i].shard = 0;
+        rv = pthread_create(&threads[i], NULL, &io_thread, &thread_args[i]);
+        if (rv != 0) {
+            die("Error in pthread_create(): %s", strerror(rv));
+        }
+    }
+}
+
+void io_threads_finish(void) {
+    int i;
+
+    for (i = 0; i < threads_len; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            die("pthread_join failed!");
+        }
+    }
+    free(threads);
+    free(thread_args);
+    free(ready);
+#ifdef USE_IO_URING
+    free(pool);
+    free(pool_free);
+    pool = NULL;
+    pool_free = NULL;
+    pool_len = pool_free_len = 0;
+#endif
+    threads = NULL;
+    thread_args = NULL;
+    ready = NULL;
+    threads_len = 0;
+}
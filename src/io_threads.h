@@ -0,0 +1,29 @@
+#ifndef IO_THREADS_H
+#define IO_THREADS_H
+
+#include <stddef.h>
+
+#include "search.h"
+
+/* Most loaded files waiting for a matcher, per I/O thread */
+#define IO_READY_PER_THREAD 4
+
+/* A file an I/O thread has loaded */
+typedef struct {
+    loaded_file_t file;
+    char *path; /* file.path points to this, which the matcher frees */
+    size_t seq;
+} ready_file_t;
+
+/* Start io_threads threads taking files off the work queue and loading them for the matchers */
+void io_threads_start(int io_threads);
+/* Wait for a loaded file. Returns FALSE once the I/O threads have finished and all the files
+ * they loaded have been taken. */
+int io_ready_pop(ready_file_t *out);
+/* Give back the buffer of a FILE_POOLED file */
+void io_pool_release(char *buf);
+/* Wait for the I/O threads to finish, once the workers have (they finish once the I/O threads
+ * run out of files) */
+void io_threads_finish(void);
+
+#endif
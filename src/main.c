@@ -1,5 +1,4 @@
 #include <ctype.h>
-#include <sched.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,35 +12,44 @@
 
 #include <pcre2.h>
 
-#ifdef HAVE_SYS_CPUSET_H
-#include <sys/cpuset.h>
-#endif
-
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
 
-#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__FreeBSD__)
-#include <pthread_np.h>
-#endif
-
+#include "cpus.h"
+#include "index.h"
+#include "io_threads.h"
 #include "log.h"
 #include "options.h"
+#include "prefetch.h"
 #include "search.h"
+#include "server.h"
 #include "util.h"
+#include "watch.h"
+#include "workers.h"
 
-typedef struct {
-    pthread_t thread;
-    int id;
-} worker_t;
+static void free_args(char **base_paths, char **paths) {
+    int i;
+
+    for (i = 0; paths[i] != NULL; i++) {
+        free(paths[i]);
+        free(base_paths[i]);
+    }
+    free(base_paths);
+    free(paths);
+    for (i = 0; i < opts.agrc_argc; i++) {
+        free(opts.agrc_argv[i]);
+    }
+    free(opts.agrc_full_argv);
+}
 
 int main(int argc, char **argv) {
     char **base_paths = NULL;
     char **paths = NULL;
     int i;
     uint32_t pcre_opts = PCRE2_MULTILINE;
-    worker_t *workers = NULL;
     int workers_len;
+    int max_workers;
     int num_cores;
 
 #ifdef HAVE_PLEDGE
@@ -52,27 +60,43 @@ int main(int argc, char **argv) {
 
     set_log_level(LOG_LEVEL_WARN);
 
-    work_queue = NULL;
-    work_queue_tail = NULL;
+    /* With --connect, the server runs the search */
+    i = server_client(argc, argv);
+    if (i >= 0) {
+        return i;
+    }
+
     root_ignores = init_ignore(NULL, "", 0);
     out_fd = stdout;
 
     parse_options(argc, argv, &base_paths, &paths);
+    if (opts.server) {
+        /* Only returns in a child process, to run a client's search */
+        server_run(base_paths, paths, &argc, &argv);
+        free_args(base_paths, paths);
+        cleanup_options();
+        root_ignores = init_ignore(NULL, "", 0);
+        parse_options(argc, argv, &base_paths, &paths);
+        if (opts.server || opts.watch) {
+            die("--server and --watch can't be used with --connect.");
+        }
+    }
     log_debug("PCRE Version: %s", ag_pcre2_version());
     if (opts.stats) {
         memset(&stats, 0, sizeof(stats));
         gettimeofday(&(stats.time_start), NULL);
     }
 
-#ifdef _WIN32
-    {
-        SYSTEM_INFO si;
-        GetSystemInfo(&si);
-        num_cores = si.dwNumberOfProcessors;
+    num_cores = cpus_usable();
+    if (opts.io_uring && !opts.io_threads) {
+        /* One thread can keep plenty of I/O in flight with io_uring */
+        opts.io_threads = 1;
+    }
+    if (opts.prefetch && !opts.cache_pollution) {
+        /* Files would be in the page cache by the time they're searched, so they'd be left there */
+        log_warn("--prefetch does nothing with --no-cache-pollution");
+        opts.prefetch = FALSE;
     }
-#else
-    num_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
-#endif
 
     workers_len = num_cores < 8 ? num_cores : 8;
     if (opts.literal) {
@@ -84,12 +108,18 @@ int main(int argc, char **argv) {
     if (workers_len < 1) {
         workers_len = 1;
     }
+    max_workers = workers_len;
+    if (!opts.workers && opts.adaptive_workers && !opts.io_threads) {
+        /* More workers than cores can help when they spend most of their time waiting on I/O */
+        max_workers = num_cores * 2;
+    }
 
     log_debug("Using %i workers", workers_len);
-    done_adding_files = FALSE;
-    workers = ag_calloc(workers_len, sizeof(worker_t));
-    if (pthread_cond_init(&files_ready, NULL)) {
-        die("pthread_cond_init failed!");
+    if (opts.io_threads) {
+        /* The I/O threads take files off the queue, and hand them to the workers once loaded */
+        work_queue_init(opts.io_threads, opts.queue_limit, 1);
+    } else {
+        work_queue_init(workers_len, opts.queue_limit, opts.use_thread_affinity ? cpus_nodes(max_workers) : 1);
     }
     if (pthread_mutex_init(&print_mtx, NULL)) {
         die("pthread_mutex_init failed!");
@@ -97,14 +127,16 @@ int main(int argc, char **argv) {
     if (opts.stats && pthread_mutex_init(&stats_mtx, NULL)) {
         die("pthread_mutex_init failed!");
     }
-    if (pthread_mutex_init(&work_queue_mtx, NULL)) {
-        die("pthread_mutex_init failed!");
-    }
 
     if (opts.casing == CASE_SMART) {
         opts.casing = is_lowercase(opts.query) ? CASE_INSENSITIVE : CASE_SENSITIVE;
     }
 
+    if (opts.index_path) {
+        /* Before -w wraps the query in a group */
+        index_init(opts.index_path);
+    }
+
     if (opts.literal) {
         if (opts.casing == CASE_INSENSITIVE) {
             /* Search routine needs the query to be lowercase */
@@ -134,6 +166,10 @@ int main(int argc, char **argv) {
             opts.query_len = strlen(opts.query);
         }
         opts.re = ag_pcre2_compile(opts.query, pcre_opts, opts.use_jit);
+        if (opts.multiline && opts.use_jit) {
+            /* Multiline matches in streams are found with partial matching */
+            pcre2_jit_compile(opts.re, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_HARD);
+        }
     }
 
 #ifdef OS_LINUX
@@ -157,34 +193,12 @@ int main(int argc, char **argv) {
     if (opts.search_stream) {
         search_stream(stdin, "");
     } else {
-        for (i = 0; i < workers_len; i++) {
-            workers[i].id = i;
-            int rv = pthread_create(&(workers[i].thread), NULL, &search_file_worker, &(workers[i].id));
-            if (rv != 0) {
-                die("Error in pthread_create(): %s", strerror(rv));
-            }
-#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && (defined(USE_CPU_SET) || defined(HAVE_SYS_CPUSET_H))
-            if (opts.use_thread_affinity) {
-#if defined(HAVE_CPU_SET_T) || defined(__midipix__)
-                cpu_set_t cpu_set;
-#elif defined(HAVE_CPU_SET)
-                cpuset_t cpu_set;
-#endif
-                CPU_ZERO(&cpu_set);
-                CPU_SET(i % num_cores, &cpu_set);
-                rv = pthread_setaffinity_np(workers[i].thread, sizeof(cpu_set), &cpu_set);
-                if (rv) {
-                    log_err("Error in pthread_setaffinity_np(): %s", strerror(rv));
-                    log_err("Performance may be affected. Use --noaffinity to suppress this message.");
-                } else {
-                    log_debug("Thread %i set to CPU %i", i, i);
-                }
-            } else {
-                log_debug("Thread affinity disabled.");
-            }
-#else
-            log_debug("No CPU affinity support.");
-#endif
+        if (opts.io_threads) {
+            io_threads_start(opts.io_threads);
+        }
+        workers_start(workers_len, max_workers, num_cores);
+        if (opts.prefetch) {
+            prefetch_start(opts.prefetch_depth);
         }
 
 #ifdef HAVE_PLEDGE
@@ -192,33 +206,51 @@ int main(int argc, char **argv) {
             die("pledge: %s", strerror(errno));
         }
 #endif
-        for (i = 0; paths[i] != NULL; i++) {
-            log_debug("searching path %s for %s", paths[i], opts.query);
-            symhash = NULL;
-            ignores *ig = init_ignore(root_ignores, "", 0);
-            struct stat s = { .st_dev = 0 };
+        if (opts.watch) {
+            watch_init();
+        }
+        if (opts.files_from) {
+            search_file_list(opts.files_from);
+        } else if (server_list_matches(paths)) {
+            server_search_list();
+        } else {
+            for (i = 0; paths[i] != NULL; i++) {
+                log_debug("searching path %s for %s", paths[i], opts.query);
+                symhash = NULL;
+                ignores *ig = init_ignore(root_ignores, "", 0);
+                struct stat s = { .st_dev = 0 };
 #ifndef _WIN32
-            /* The device is ignored if opts.one_dev is false, so it's fine
-             * to leave it at the default 0
-             */
-            if (opts.one_dev && lstat(paths[i], &s) == -1) {
-                log_err("Failed to get device information for path %s. Skipping...", paths[i]);
-            }
+                /* The device is ignored if opts.one_dev is false, so it's fine
+                 * to leave it at the default 0
+                 */
+                if (opts.one_dev && lstat(paths[i], &s) == -1) {
+                    log_err("Failed to get device information for path %s. Skipping...", paths[i]);
+                }
 #endif
-            search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
-            cleanup_ignore(ig);
-        }
-        pthread_mutex_lock(&work_queue_mtx);
-        done_adding_files = TRUE;
-        pthread_cond_broadcast(&files_ready);
-        pthread_mutex_unlock(&work_queue_mtx);
-        for (i = 0; i < workers_len; i++) {
-            if (pthread_join(workers[i].thread, NULL)) {
-                die("pthread_join failed!");
+                if (!opts.git_index || !search_git_index(ig, base_paths[i], paths[i], s.st_dev)) {
+                    search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
+                }
+                cleanup_ignore(ig);
             }
         }
+        done_adding_files();
+        workers_finish();
+        if (opts.io_threads) {
+            io_threads_finish();
+        }
+        prefetch_finish();
+        if (opts.index_build) {
+            index_write(opts.index_path);
+        }
+        if (opts.watch) {
+            watch_run();
+            watch_cleanup();
+        }
     }
 
+    print_free_buffer();
+    search_free_buffer();
+
     if (opts.stats) {
         gettimeofday(&(stats.time_end), NULL);
         double time_diff = ((long)stats.time_end.tv_sec * 1000000 + stats.time_end.tv_usec) -
@@ -235,6 +267,28 @@ int main(int argc, char **argv) {
         fprintf(stderr, "%zu files contained matches\n", stats.total_file_matches);
         fprintf(stderr, "%zu files searched\n", stats.total_files);
         fprintf(stderr, "%zu bytes searched%s\n", stats.total_bytes, friendly_bytes);
+        if (!opts.search_stream) {
+            fprintf(stderr, "%zu files read, %zu mapped\n", stats.files_read, stats.files_mapped);
+            if (!opts.cache_pollution) {
+                fprintf(stderr, "%zu bytes read from files, %zu left in the page cache\n",
+                        stats.cache_bytes_read, stats.cache_bytes_retained);
+            }
+            if (opts.direct_min) {
+                fprintf(stderr, "%zu bytes read with direct I/O\n", stats.direct_bytes);
+            }
+            if (opts.populate_min) {
+                fprintf(stderr, "%zu files pre-faulted, %zu page faults avoided\n",
+                        stats.files_populated, stats.faults_avoided);
+            }
+            if (opts.index_build) {
+                fprintf(stderr, "%zu files indexed\n", stats.files_indexed);
+            } else if (opts.index_path) {
+                fprintf(stderr, "%zu files skipped with the index, %zu changed since it was built\n",
+                        stats.files_index_skipped, stats.files_index_stale);
+            }
+            workers_print_stats();
+            prefetch_print_stats();
+        }
         fprintf(stderr, "%f seconds\n", time_diff);
         pthread_mutex_destroy(&stats_mtx);
     }
@@ -243,21 +297,13 @@ int main(int argc, char **argv) {
         pclose(out_fd);
     }
     cleanup_options();
-    pthread_cond_destroy(&files_ready);
-    pthread_mutex_destroy(&work_queue_mtx);
+    work_queue_cleanup();
+    print_reorder_cleanup();
     pthread_mutex_destroy(&print_mtx);
     cleanup_ignore(root_ignores);
-    free(workers);
-    for (i = 0; paths[i] != NULL; i++) {
-        free(paths[i]);
-        free(base_paths[i]);
-    }
-    free(base_paths);
-    free(paths);
-    for (i = 0; i < opts.agrc_argc; i++) {
-        free(opts.agrc_argv[i]);
-    }
-    free(opts.agrc_full_argv);
+    free_args(base_paths, paths);
+    server_cleanup();
+    index_cleanup();
     if (find_skip_lookup) {
         free(find_skip_lookup);
     }
@@ -10,6 +10,7 @@
 
 #include "config.h"
 #include "ignore.h"
+#include "ignore_cache.h"
 #include "lang.h"
 #include "log.h"
 #include "options.h"
@@ -102,29 +103,92 @@ Output Options:\n\
 Search Options:\n\
   -a --all-types          Search all files (doesn't include hidden files\n\
                           or patterns from ignore files)\n\
+     --[no]adaptive-workers\n\
+                          Add or park workers as the search goes, depending\n\
+                          on how much they help (Enabled unless --workers\n\
+                          or --io-threads is given)\n\
+     --[no]cache-pollution\n\
+                          Leave files in the page cache after searching them\n\
+                          (Enabled by default). With --nocache-pollution,\n\
+                          files that weren't cached already are dropped\n\
+     --connect SOCKET     Have the server on SOCKET (see --server) run the\n\
+                          search. Searches here if there's no server\n\
   -D --debug              Ridiculous debugging (probably not useful)\n\
      --depth NUM          Search up to NUM directories deep (Default: 25)\n\
+     --direct             Read files of at least --direct-min bytes with\n\
+                          direct I/O, bypassing the page cache\n\
+     --direct-min SIZE    With --direct or --nocache-pollution, read files of\n\
+                          at least SIZE bytes with direct I/O (Default: 0,\n\
+                          never, or 1048576 with --direct)\n\
+     --dispatch ORDER     Order to search files in: readdir, inode, or extent\n\
+                          (physical location on disk). Reordering is done in\n\
+                          batches of --dispatch-window files (Default: readdir)\n\
+     --dispatch-window NUM\n\
+                          Number of files to reorder at once (Default: 4096)\n\
   -E --extension          Search only files with this extension\n\
+     --files-from FILE    Search the files listed in FILE (or stdin, for -),\n\
+                          one per line, or NUL-terminated with -0\n\
   -f --follow             Follow symlinks\n\
   -F --fixed-strings      Alias for --literal for compatibility with grep\n\
   -G --file-search-regex  PATTERN\n\
                           Search only files matching this pattern\n\
+     --[no]git-index      In git repositories, search the files in the index\n\
+                          instead of reading directories\n\
+     --git-untracked      Like --git-index, but also search untracked files\n\
   -j --just-filename      Search only the file name, not the full path, when using\n\
                           a file search regex (such as with -G or -E)\n\
      --hidden             Search hidden files (obeys .*ignore files)\n\
+     --huge-pages         With --populate-min, read those files into buffers\n\
+                          backed by transparent huge pages (Linux)\n\
   -i --ignore-case        Match case insensitively\n\
      --ignore PATTERN     Ignore files/directories matching PATTERN\n\
                           (literal file/directory names also allowed)\n\
      --ignore-dir NAME    Alias for --ignore for compatibility with ack.\n\
+     --ignore-cache[=DIR] Cache parsed ignore files in DIR between runs\n\
+                          (Default: $XDG_CACHE_HOME/ag/ignore)\n\
+     --index[=FILE]       Only search the files that the index in FILE\n\
+                          (Default: .agindex) says might match, and those\n\
+                          that have changed since it was built\n\
+     --index-build[=FILE] Read the files in PATHs and write an index of them\n\
+                          to FILE (Default: .agindex) for --index\n\
+     --io-threads NUM     Open and read files in NUM threads of their own, so\n\
+                          that workers only search. Helps on high-latency\n\
+                          filesystems such as NFS (Default: 0, workers read\n\
+                          their own files)\n\
+     --io-uring           Have the I/O threads open and read small files in\n\
+                          batches with io_uring, where available (Linux)\n\
   -m --max-count NUM      Skip the rest of a file after NUM matches (Default: 10,000)\n\
+     --max-match-span SIZE\n\
+                          With --multiline, the most bytes a match in a stream\n\
+                          can span (Default: 1048576)\n\
      --one-device         Don't follow links to other devices.\n\
   -p --path-to-ignore STRING\n\
                           Use .ignore file at STRING\n\
+     --placement POLICY   Which CPUs to pin workers to with --affinity:\n\
+                          spread (over cores, caches and NUMA nodes),\n\
+                          compact (sharing an L3 cache) or cores (one per\n\
+                          physical core, no SMT siblings) (Default: spread)\n\
+     --populate-min SIZE  Fault in all the pages of files of at least SIZE\n\
+                          bytes before searching them (Linux; not with\n\
+                          --nommap) (Default: 0, never)\n\
+     --prefetch[=DEPTH]   Have the kernel start reading files up to DEPTH\n\
+                          files before the workers get to them. Without\n\
+                          DEPTH, look further ahead while the workers are\n\
+                          waiting on reads. Helps most with a cold cache\n\
   -Q --literal            Don't parse PATTERN as a regular expression\n\
+     --queue-limit NUM    Stop looking for more files while NUM files are\n\
+                          waiting to be searched. 0 means no limit\n\
+                          (Default: 65536)\n\
   -s --case-sensitive     Match case sensitively\n\
   -S --smart-case         Match case insensitively unless PATTERN contains\n\
                           uppercase characters (Enabled by default)\n\
      --search-binary      Search binary files for matches\n\
+     --server SOCKET      Find the files in PATHs, then keep the list up to\n\
+                          date and run searches from --connect on SOCKET\n\
+                          without walking again (Linux)\n\
+     --sort ORDER         Order to print files in: none (as they're finished)\n\
+                          or path (as they're found, with each directory\n\
+                          sorted by name). (Default: none)\n\
   -t --all-text           Search all text files (doesn't include hidden files)\n\
      --as-text            Process binary files as if they were text\n\
   -u --unrestricted       Search all files (ignore .ignore, .gitignore, etc.;\n\
@@ -132,6 +196,8 @@ Search Options:\n\
   -U --skip-vcs-ignores   Ignore VCS ignore files\n\
                           (.gitignore, .hgignore; still obey .ignore)\n\
   -v --invert-match\n\
+     --watch              After searching, keep watching for files that are\n\
+                          written or created and search them too (Linux)\n\
   -w --word-regexp        Only match whole words\n\
   -W --width NUM          Truncate match lines after NUM characters\n\
   -X --invert-file-search-regex PATTERN\n\
@@ -195,13 +261,24 @@ void init_options(void) {
     opts.color_win_ansi = FALSE;
     opts.max_matches_per_file = 0;
     opts.max_search_depth = DEFAULT_MAX_SEARCH_DEPTH;
+    opts.dispatch_order = DISPATCH_READDIR;
+    opts.dispatch_window = DEFAULT_DISPATCH_WINDOW;
+    opts.queue_limit = DEFAULT_QUEUE_LIMIT;
+    opts.sort_order = SORT_NONE;
 #if defined(__APPLE__) || defined(__MACH__)
     /* mamp() is slower than normal read() on macos. default to off */
     opts.mmap = FALSE;
 #else
     opts.mmap = TRUE;
 #endif
+    opts.mmap_min = DEFAULT_MMAP_MIN;
+    opts.cache_pollution = TRUE;
+    opts.direct = FALSE;
+    opts.direct_min = 0;
+    opts.populate_min = 0;
+    opts.huge_pages = FALSE;
     opts.multiline = FALSE;
+    opts.max_match_span = DEFAULT_MAX_MATCH_SPAN;
     opts.width = 0;
     opts.path_sep = '\n';
     opts.print_break = TRUE;
@@ -213,6 +290,12 @@ void init_options(void) {
     opts.color_match = ag_strdup(color_match);
     opts.color_line_number = ag_strdup(color_line_number);
     opts.use_thread_affinity = TRUE;
+    opts.io_threads = 0;
+    opts.io_uring = FALSE;
+    opts.prefetch = FALSE;
+    opts.prefetch_depth = 0;
+    opts.placement = PLACEMENT_SPREAD;
+    opts.adaptive_workers = TRUE;
     opts.invert_file_search_regex = FALSE;
     opts.search_as_text = FALSE;
     opts.line_delim = '\n';
@@ -229,6 +312,10 @@ void cleanup_options(void) {
     CHECK_AND_FREE(opts.color_match);
     CHECK_AND_FREE(opts.color_line_number);
     CHECK_AND_FREE(opts.query);
+    CHECK_AND_FREE(opts.ignore_cache_dir);
+    CHECK_AND_FREE(opts.files_from);
+    CHECK_AND_FREE(opts.server);
+    CHECK_AND_FREE(opts.index_path);
 
     // Note, ag_pcre_free_* will do NULL checks and set the pointer to NULL after freeing
     ag_pcre2_free(&opts.re);
@@ -282,6 +369,18 @@ static void get_opts_from_file(const char *path, int *argc_out, char ***argv_out
     *argv_out = list;
 }
 
+/* Start getopt over from the beginning of argv, forgetting where it got to in the last argv it
+ * was given (a server's child parses its client's arguments after its own). */
+static void reset_getopt(void) {
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+    optreset = 1;
+    optind = 1;
+#else
+    /* glibc and musl reinitialize everything when optind is 0 */
+    optind = 0;
+#endif
+}
+
 void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     int ch;
     size_t i;
@@ -317,6 +416,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     const option_t base_longopts[] = {
         { "ackmate", no_argument, &opts.ackmate, 1 },
         { "ackmate-dir-filter", required_argument, NULL, 0 },
+        { "adaptive-workers", no_argument, &opts.adaptive_workers, 1 },
         { "affinity", no_argument, &opts.use_thread_affinity, 1 },
         { "after", optional_argument, NULL, 'A' },
         { "agrc", required_argument, NULL, 0 },
@@ -332,27 +432,42 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "color-path", required_argument, NULL, 0 },
         { "color-win-ansi", no_argument, &opts.color_win_ansi, TRUE },
         { "column", no_argument, &opts.column, 1 },
+        { "cache-pollution", no_argument, &opts.cache_pollution, TRUE },
+        { "connect", required_argument, NULL, 0 },
         { "context", optional_argument, NULL, 'C' },
         { "count", no_argument, NULL, 'c' },
         { "debug", no_argument, NULL, 'D' },
         { "depth", required_argument, NULL, 0 },
+        { "direct", no_argument, &opts.direct, TRUE },
+        { "direct-min", required_argument, NULL, 0 },
+        { "dispatch", required_argument, NULL, 0 },
+        { "dispatch-window", required_argument, NULL, 0 },
         { "extension", required_argument, NULL, 'E' },
         { "filename", no_argument, NULL, 0 },
         { "filename-pattern", required_argument, NULL, 'g' },
         { "file-search-regex", required_argument, NULL, 'G' },
+        { "files-from", required_argument, NULL, 0 },
         { "files-with-matches", no_argument, NULL, 'l' },
         { "files-without-matches", no_argument, NULL, 'L' },
         { "fixed-strings", no_argument, NULL, 'F' },
         { "follow", no_argument, &opts.follow_symlinks, 1 },
+        { "git-index", no_argument, &opts.git_index, TRUE },
+        { "git-untracked", no_argument, &opts.git_untracked, TRUE },
         { "group", no_argument, &group, 1 },
         { "heading", no_argument, &opts.print_path, PATH_PRINT_TOP },
         { "help", no_argument, NULL, 'h' },
         { "help-types", no_argument, &list_file_types, 1 },
         { "hidden", no_argument, &opts.search_hidden_files, 1 },
+        { "huge-pages", no_argument, &opts.huge_pages, TRUE },
         { "ignore", required_argument, NULL, 'I' },
+        { "ignore-cache", optional_argument, NULL, 0 },
         { "ignore-case", no_argument, NULL, 'i' },
         { "ignore-dir", required_argument, NULL, 0 },
+        { "index", optional_argument, NULL, 0 },
+        { "index-build", optional_argument, NULL, 0 },
         { "invert-match", no_argument, NULL, 'v' },
+        { "io-threads", required_argument, NULL, 0 },
+        { "io-uring", no_argument, &opts.io_uring, TRUE },
         { "just-filename", no_argument, NULL, 'j' },
         /* deprecated for --numbers. Remove eventually. */
         { "line-numbers", no_argument, &opts.print_line_numbers, 2 },
@@ -360,25 +475,37 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "literal", no_argument, NULL, 'Q' },
         { "match", no_argument, &useless, 0 },
         { "max-count", required_argument, NULL, 'm' },
+        { "max-match-span", required_argument, NULL, 0 },
         { "mmap", no_argument, &opts.mmap, TRUE },
+        { "mmap-min", required_argument, NULL, 0 },
         { "multiline", no_argument, &opts.multiline, TRUE },
         /* Accept both --no-* and --no* forms for convenience/BC */
+        { "no-adaptive-workers", no_argument, &opts.adaptive_workers, 0 },
+        { "noadaptive-workers", no_argument, &opts.adaptive_workers, 0 },
         { "no-affinity", no_argument, &opts.use_thread_affinity, 0 },
         { "noaffinity", no_argument, &opts.use_thread_affinity, 0 },
         { "no-agrc", no_argument, NULL, 0 },
         { "noagrc", no_argument, NULL, 0 },
         { "no-break", no_argument, &opts.print_break, 0 },
         { "nobreak", no_argument, &opts.print_break, 0 },
+        { "no-cache-pollution", no_argument, &opts.cache_pollution, FALSE },
+        { "nocache-pollution", no_argument, &opts.cache_pollution, FALSE },
         { "no-color", no_argument, &opts.color, 0 },
         { "nocolor", no_argument, &opts.color, 0 },
         { "no-filename", no_argument, NULL, 0 },
         { "nofilename", no_argument, NULL, 0 },
         { "no-follow", no_argument, &opts.follow_symlinks, 0 },
         { "nofollow", no_argument, &opts.follow_symlinks, 0 },
+        { "no-git-index", no_argument, &opts.git_index, FALSE },
+        { "nogit-index", no_argument, &opts.git_index, FALSE },
         { "no-group", no_argument, &group, 0 },
         { "nogroup", no_argument, &group, 0 },
         { "no-heading", no_argument, &opts.print_path, PATH_PRINT_EACH_LINE },
         { "noheading", no_argument, &opts.print_path, PATH_PRINT_EACH_LINE },
+        { "no-huge-pages", no_argument, &opts.huge_pages, FALSE },
+        { "nohuge-pages", no_argument, &opts.huge_pages, FALSE },
+        { "no-ignore-cache", no_argument, NULL, 0 },
+        { "noignore-cache", no_argument, NULL, 0 },
         { "no-mmap", no_argument, &opts.mmap, FALSE },
         { "nommap", no_argument, &opts.mmap, FALSE },
         { "no-multiline", no_argument, &opts.multiline, FALSE },
@@ -398,22 +525,29 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "passthrough", no_argument, &opts.passthrough, 1 },
         { "passthru", no_argument, &opts.passthrough, 1 },
         { "path-to-ignore", required_argument, NULL, 'p' },
+        { "placement", required_argument, NULL, 0 },
+        { "populate-min", required_argument, NULL, 0 },
+        { "prefetch", optional_argument, NULL, 0 },
         { "print0", no_argument, NULL, '0' },
         { "print-all-files", no_argument, NULL, 0 },
         { "print-long-lines", no_argument, &opts.print_long_lines, 1 },
+        { "queue-limit", required_argument, NULL, 0 },
         { "recurse", no_argument, NULL, 'r' },
         { "search-binary", no_argument, &opts.search_binary_files, 1 },
         { "search-files", no_argument, &opts.search_stream, 0 },
         { "null-lines", no_argument, NULL, 'Z' },
         { "search-zip", no_argument, &opts.search_zip_files, 1 },
+        { "server", required_argument, NULL, 0 },
         { "silent", no_argument, NULL, 'q' },
         { "skip-vcs-ignores", no_argument, NULL, 'U' },
         { "smart-case", no_argument, NULL, 'S' },
+        { "sort", required_argument, NULL, 0 },
         { "stats", no_argument, &opts.stats, 1 },
         { "stats-only", no_argument, NULL, 0 },
         { "unrestricted", no_argument, NULL, 'u' },
         { "version", no_argument, &version, 1 },
         { "vimgrep", no_argument, &opts.vimgrep, 1 },
+        { "watch", no_argument, NULL, 0 },
         { "width", required_argument, NULL, 'W' },
         { "word-regexp", no_argument, NULL, 'w' },
         { "workers", required_argument, NULL, 0 },
@@ -468,6 +602,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     // Note, the optstr here must match the optstr used for main argument parsing
     // set opterr to 0 to disable getopt from printing duplicate error messages on this first pass
     opterr = 0;
+    reset_getopt();
     while ((ch = getopt_long(argc, argv, optstring, longopts, &opt_index)) != -1) {
         if (ch == 'D') {
             // enable debugging early to allow for debug messages during agrc parsing
@@ -537,7 +672,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
     char *file_search_regex = NULL;
     // reset after getopt_long call above
-    optind = 1;
+    reset_getopt();
     opterr = 1;
     while ((ch = getopt_long(argc, argv, optstring, longopts, &opt_index)) != -1) {
         switch (ch) {
@@ -729,16 +864,72 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                 if (strcmp(longopts[opt_index].name, "ackmate-dir-filter") == 0) {
                     opts.ackmate_dir_filter = ag_pcre2_compile(optarg, 0, opts.use_jit);
                     break;
+                } else if (strcmp(longopts[opt_index].name, "connect") == 0) {
+                    /* main() hands the search to the server. If it got here, there isn't one. */
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "depth") == 0) {
                     opts.max_search_depth = atoi(optarg);
                     break;
+                } else if (strcmp(longopts[opt_index].name, "dispatch") == 0) {
+                    if (strcmp(optarg, "readdir") == 0) {
+                        opts.dispatch_order = DISPATCH_READDIR;
+                    } else if (strcmp(optarg, "inode") == 0) {
+                        opts.dispatch_order = DISPATCH_INODE;
+                    } else if (strcmp(optarg, "extent") == 0) {
+#ifdef HAVE_LINUX_FIEMAP_H
+                        opts.dispatch_order = DISPATCH_EXTENT;
+#else
+                        log_warn("FIEMAP isn't supported on this platform. Using --dispatch=inode");
+                        opts.dispatch_order = DISPATCH_INODE;
+#endif
+                    } else {
+                        die("Invalid dispatch order: %s (expected readdir, inode, or extent)", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "dispatch-window") == 0) {
+                    errno = 0;
+                    opts.dispatch_window = strtoul(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE || opts.dispatch_window == 0) {
+                        die("Invalid dispatch window: %s", optarg);
+                    }
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "filename") == 0) {
                     opts.print_path = PATH_PRINT_DEFAULT;
                     opts.print_line_numbers = TRUE;
                     break;
+                } else if (strcmp(longopts[opt_index].name, "files-from") == 0) {
+                    free(opts.files_from);
+                    opts.files_from = ag_strdup(optarg);
+                    /* Even if it's stdin, that's the list and not something to search */
+                    opts.search_stream = 0;
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "ignore-dir") == 0) {
                     add_ignore_pattern(root_ignores, optarg);
                     break;
+                } else if (strcmp(longopts[opt_index].name, "ignore-cache") == 0) {
+                    free(opts.ignore_cache_dir);
+                    opts.ignore_cache_dir = optarg ? ag_strdup(optarg) : ignore_cache_default_dir();
+                    if (opts.ignore_cache_dir == NULL) {
+                        log_warn("No HOME or XDG_CACHE_HOME, not using ignore cache");
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "index") == 0) {
+                    free(opts.index_path);
+                    opts.index_path = ag_strdup(optarg ? optarg : DEFAULT_INDEX_PATH);
+                    opts.index_build = FALSE;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "index-build") == 0) {
+                    free(opts.index_path);
+                    opts.index_path = ag_strdup(optarg ? optarg : DEFAULT_INDEX_PATH);
+                    opts.index_build = TRUE;
+                    /* Files are read to be indexed, not searched */
+                    opts.search_stream = 0;
+                    needs_query = accepts_query = 0;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "no-ignore-cache") == 0 ||
+                           strcmp(longopts[opt_index].name, "noignore-cache") == 0) {
+                    CHECK_AND_FREE(opts.ignore_cache_dir);
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "no-filename") == 0 ||
                            strcmp(longopts[opt_index].name, "nofilename") == 0) {
                     opts.print_path = PATH_PRINT_NOTHING;
@@ -752,6 +943,94 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                 } else if (strcmp(longopts[opt_index].name, "print-all-files") == 0) {
                     opts.print_all_paths = TRUE;
                     break;
+                } else if (strcmp(longopts[opt_index].name, "queue-limit") == 0) {
+                    /* Not strtoul(), which takes -1 as a very big limit */
+                    long limit;
+                    errno = 0;
+                    limit = strtol(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE || limit < 0) {
+                        die("Invalid queue limit: %s", optarg);
+                    }
+                    opts.queue_limit = (size_t)limit;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "io-threads") == 0) {
+                    opts.io_threads = atoi(optarg);
+                    if (opts.io_threads < 0) {
+                        die("Invalid number of I/O threads: %s", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "direct-min") == 0) {
+                    errno = 0;
+                    opts.direct_min = strtoul(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE) {
+                        die("Invalid direct I/O size: %s", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "max-match-span") == 0) {
+                    errno = 0;
+                    opts.max_match_span = strtoul(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE) {
+                        die("Invalid match span: %s", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "mmap-min") == 0) {
+                    errno = 0;
+                    opts.mmap_min = strtoul(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE) {
+                        die("Invalid mmap size: %s", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "placement") == 0) {
+                    if (strcmp(optarg, "spread") == 0) {
+                        opts.placement = PLACEMENT_SPREAD;
+                    } else if (strcmp(optarg, "compact") == 0) {
+                        opts.placement = PLACEMENT_COMPACT;
+                    } else if (strcmp(optarg, "cores") == 0) {
+                        opts.placement = PLACEMENT_CORES;
+                    } else {
+                        die("Invalid placement: %s (expected spread, compact or cores)", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "populate-min") == 0) {
+                    errno = 0;
+                    opts.populate_min = strtoul(optarg, &num_end, 10);
+                    if (num_end == optarg || *num_end != '\0' || errno == ERANGE) {
+                        die("Invalid populate size: %s", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "prefetch") == 0) {
+                    opts.prefetch = TRUE;
+                    opts.prefetch_depth = 0;
+                    if (optarg) {
+                        errno = 0;
+                        opts.prefetch_depth = strtoul(optarg, &num_end, 10);
+                        if (num_end == optarg || *num_end != '\0' || errno == ERANGE || opts.prefetch_depth == 0) {
+                            die("Invalid prefetch depth: %s", optarg);
+                        }
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "server") == 0) {
+                    free(opts.server);
+                    opts.server = ag_strdup(optarg);
+                    /* The server keeps its list of files up to date by watching them */
+                    opts.watch = TRUE;
+                    opts.search_stream = 0;
+                    needs_query = accepts_query = 0;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "sort") == 0) {
+                    if (strcmp(optarg, "none") == 0) {
+                        opts.sort_order = SORT_NONE;
+                    } else if (strcmp(optarg, "path") == 0) {
+                        opts.sort_order = SORT_PATH;
+                    } else {
+                        die("Invalid sort order: %s (expected none or path)", optarg);
+                    }
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "watch") == 0) {
+                    opts.watch = TRUE;
+                    /* Watching needs directories, even if stdin is a pipe */
+                    opts.search_stream = 0;
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "workers") == 0) {
                     opts.workers = atoi(optarg);
                     break;
@@ -886,6 +1165,30 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         exit(1);
     }
 
+    if (opts.git_untracked) {
+        opts.git_index = TRUE;
+    }
+
+    if (opts.watch && opts.files_from) {
+        die("%s can't be used with --files-from.", opts.server ? "--server" : "--watch");
+    }
+    if (opts.index_build && opts.watch) {
+        die("--index-build can't be used with %s.", opts.server ? "--server" : "--watch");
+    }
+    if (opts.watch && opts.git_index) {
+        log_warn("%s reads directories to watch them. Not using the git index.", opts.server ? "--server" : "--watch");
+        opts.git_index = FALSE;
+        opts.git_untracked = FALSE;
+    }
+
+    if (opts.direct && opts.direct_min == 0) {
+        opts.direct_min = DEFAULT_DIRECT_MIN;
+    }
+
+    if (opts.ignore_cache_dir && !ignore_cache_init(opts.ignore_cache_dir)) {
+        CHECK_AND_FREE(opts.ignore_cache_dir);
+    }
+
     if (home_dir && !opts.search_all_files) {
         log_debug("Found user's home dir: %s", home_dir);
         ignore_file_path = join_paths(home_dir, ".agignore");
@@ -1007,6 +1310,9 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 #ifdef PATH_MAX
     char *tmp = NULL;
 #endif
+    if (argc > 0 && opts.files_from) {
+        die("--files-from can't be used with paths to search.");
+    }
     if (argc > 0) {
         *paths = ag_calloc(sizeof(char *), argc + 1);
         *base_paths = ag_calloc(sizeof(char *), argc + 1);
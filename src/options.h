@@ -14,6 +14,13 @@
 #define DEFAULT_CONTEXT_LEN 2
 #define DEFAULT_MAX_SEARCH_DEPTH 25
 #define DEFAULT_PAGER "less"
+#define DEFAULT_DISPATCH_WINDOW 4096
+#define DEFAULT_QUEUE_LIMIT 65536
+#define DEFAULT_MMAP_MIN (64 * 1024)
+/* --direct-min for --direct when it's not given */
+#define DEFAULT_DIRECT_MIN (1024 * 1024)
+#define DEFAULT_MAX_MATCH_SPAN (1024 * 1024)
+#define DEFAULT_INDEX_PATH ".agindex"
 enum case_behavior {
     CASE_DEFAULT, /* Changes to CASE_SMART at the end of option parsing */
     CASE_SENSITIVE,
@@ -30,6 +37,23 @@ enum path_print_behavior {
     PATH_PRINT_NOTHING
 };
 
+enum dispatch_order {
+    DISPATCH_READDIR, /* queue files in the order they're found */
+    DISPATCH_INODE,
+    DISPATCH_EXTENT /* physical location on disk, falling back to inode order */
+};
+
+enum cpu_placement {
+    PLACEMENT_SPREAD, /* across cores, caches and NUMA nodes */
+    PLACEMENT_COMPACT, /* fill one L3 cache at a time */
+    PLACEMENT_CORES /* one worker per physical core */
+};
+
+enum sort_order {
+    SORT_NONE, /* print files as they're finished */
+    SORT_PATH
+};
+
 typedef struct {
     int ackmate;
     pcre2_code *ackmate_dir_filter;
@@ -45,6 +69,11 @@ typedef struct {
     int invert_file_search_regex;
     bool file_search_regex_just_filename;
     pcre2_code *filetype_regex;
+    char *ignore_cache_dir; /* NULL unless --ignore-cache */
+    char *files_from;       /* --files-from list of files to search ("-" for stdin), or NULL */
+    char *server;           /* --server socket to wait for searches on, or NULL */
+    char *index_path;       /* --index or --index-build file, or NULL */
+    int index_build;
     int color;
     char *color_line_number;
     char *color_match;
@@ -52,7 +81,11 @@ typedef struct {
     int color_win_ansi;
     int column;
     int context;
+    enum dispatch_order dispatch_order;
+    size_t dispatch_window;
     int follow_symlinks;
+    int git_index;
+    int git_untracked;
     int invert_match;
     int line_delim;
     int literal;
@@ -61,7 +94,14 @@ typedef struct {
     size_t max_matches_per_file;
     int max_search_depth;
     int mmap;
+    size_t mmap_min;
+    int cache_pollution;
+    int direct;
+    size_t direct_min; /* with --direct or --no-cache-pollution, read files this big with O_DIRECT. 0 for never */
+    size_t populate_min; /* pre-fault files this big. 0 for never */
+    int huge_pages;
     int multiline;
+    size_t max_match_span; /* longest multiline match to wait for in a stream */
     int one_dev;
     int only_matching;
     char path_sep;
@@ -90,14 +130,23 @@ typedef struct {
     char *query;
     int query_len;
     char *pager;
+    size_t queue_limit;
+    enum sort_order sort_order;
     int paths_len;
     int parallel;
+    enum cpu_placement placement;
     bool use_jit;
     int use_thread_affinity;
     int vimgrep;
+    int watch; /* keep searching files as they change, with --watch */
     size_t width;
     int word_regexp;
     int workers;
+    int adaptive_workers;
+    int io_threads;
+    int io_uring;
+    int prefetch;
+    size_t prefetch_depth; /* 0 to tune it as the search goes */
 } cli_options;
 
 /* global options. parse_options gives it sane values, everything else reads from it */
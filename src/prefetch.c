@@ -0,0 +1,186 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "log.h"
+#include "options.h"
+#include "prefetch.h"
+#include "util.h"
+#include "work_queue.h"
+
+/*
+ * A cold-cache search spends most of its time with workers waiting on reads, one file at a time
+ * each, and only the file that's being searched gets read ahead (by MADV_SEQUENTIAL). The
+ * prefetcher walks the work queue ahead of the workers, and for each file it comes to, asks the
+ * kernel to start reading it into the page cache with posix_fadvise(POSIX_FADV_WILLNEED). That
+ * returns once the reads have been queued, so the device gets plenty of requests at once, and by
+ * the time a worker gets to the file it's already in memory.
+ *
+ * How far ahead is enough depends on how fast the device is compared to the workers. Unless it's
+ * given a fixed depth, the prefetcher watches how long the workers spend blocked while loading
+ * and searching files (the wall clock time less the CPU time, which is mostly waiting for reads).
+ * If that's more than PREFETCH_SLOW_NS per file, it's not far enough ahead, so it doubles the
+ * lookahead. If the workers hardly wait at all, it backs off a little at a time, so as not to
+ * fill the page cache with files long before they're needed.
+ */
+
+/* Time spent blocked per file above which the workers are waiting on the disk */
+#define PREFETCH_SLOW_NS 100000
+/* Files to time between adjustments */
+#define PREFETCH_SAMPLE 64
+
+static pthread_t thread;
+static int running = FALSE;
+static int tuning = FALSE;
+static size_t depth = 0;
+
+/* Totals from prefetch_timer_stop(), taken and reset by the prefetcher */
+static long long blocked_ns = 0;
+static long long timed_files = 0;
+
+static struct {
+    size_t prefetched;
+    size_t min_depth;
+    size_t max_depth;
+} prefetch_stats;
+
+static long long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void prefetch_timer_start(prefetch_timer_t *timer) {
+    if (!tuning) {
+        return;
+    }
+    timer->wall_ns = clock_ns(CLOCK_MONOTONIC);
+    timer->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void prefetch_timer_stop(const prefetch_timer_t *timer) {
+    long long blocked;
+
+    if (!tuning) {
+        return;
+    }
+    blocked = (clock_ns(CLOCK_MONOTONIC) - timer->wall_ns) - (clock_ns(CLOCK_THREAD_CPUTIME_ID) - timer->cpu_ns);
+    __sync_fetch_and_add(&blocked_ns, blocked > 0 ? blocked : 0);
+    __sync_fetch_and_add(&timed_files, 1);
+}
+
+static void adjust_depth(void) {
+    long long files = timed_files;
+    long long per_file;
+    size_t old_depth = depth;
+
+    if (files < PREFETCH_SAMPLE) {
+        return;
+    }
+    per_file = __sync_fetch_and_and(&blocked_ns, 0) / __sync_fetch_and_sub(&timed_files, files);
+    if (per_file > PREFETCH_SLOW_NS) {
+        depth = depth * 2 < PREFETCH_MAX_DEPTH ? depth * 2 : PREFETCH_MAX_DEPTH;
+    } else if (per_file < PREFETCH_SLOW_NS / 10) {
+        depth -= depth / 8;
+        if (depth < PREFETCH_MIN_DEPTH) {
+            depth = PREFETCH_MIN_DEPTH;
+        }
+    }
+    if (depth != old_depth) {
+        log_debug("Workers blocked for %lld us per file. Prefetching %zu files ahead.", per_file / 1000, depth);
+    }
+    if (depth < prefetch_stats.min_depth) {
+        prefetch_stats.min_depth = depth;
+    }
+    if (depth > prefetch_stats.max_depth) {
+        prefetch_stats.max_depth = depth;
+    }
+}
+
+static void prefetch_file(const char *path) {
+#ifdef HAVE_POSIX_FADVISE
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        /* The worker will report it */
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+static void *prefetch_thread(void *unused) {
+    work_item_t item;
+    char *path = NULL;
+    size_t path_size = 0;
+
+    (void)unused;
+    while (work_queue_prefetch_next(&item, depth)) {
+        prefetch_file(work_item_path(&item, &path, &path_size));
+        work_dir_release(item.dir);
+        prefetch_stats.prefetched++;
+        if (tuning) {
+            adjust_depth();
+        }
+    }
+    free(path);
+    return NULL;
+}
+
+void prefetch_start(size_t fixed_depth) {
+    int rv;
+
+#ifndef HAVE_POSIX_FADVISE
+    log_debug("No posix_fadvise(), so no prefetching");
+    return;
+#endif
+    tuning = fixed_depth == 0;
+    depth = tuning ? PREFETCH_START_DEPTH : fixed_depth;
+    memset(&prefetch_stats, 0, sizeof(prefetch_stats));
+    prefetch_stats.min_depth = prefetch_stats.max_depth = depth;
+    blocked_ns = timed_files = 0;
+
+    log_debug("Prefetching %zu files ahead%s", depth, tuning ? " to begin with" : "");
+    rv = pthread_create(&thread, NULL, &prefetch_thread, NULL);
+    if (rv != 0) {
+        die("Error in pthread_create(): %s", strerror(rv));
+    }
+    running = TRUE;
+}
+
+void prefetch_finish(void) {
+    if (!running) {
+        return;
+    }
+    if (pthread_join(thread, NULL)) {
+        die("pthread_join failed!");
+    }
+    running = FALSE;
+    tuning = FALSE;
+}
+
+void prefetch_print_stats(void) {
+    if (depth == 0) {
+        /* It never started */
+        return;
+    }
+    if (prefetch_stats.min_depth == prefetch_stats.max_depth) {
+        fprintf(stderr, "%zu files prefetched, %zu ahead\n", prefetch_stats.prefetched, prefetch_stats.max_depth);
+    } else {
+        fprintf(stderr, "%zu files prefetched, %zu to %zu ahead\n", prefetch_stats.prefetched,
+                prefetch_stats.min_depth, prefetch_stats.max_depth);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h>
+
+/* Lookahead when it's tuned as the search goes */
+#define PREFETCH_MIN_DEPTH 16
+#define PREFETCH_START_DEPTH 64
+#define PREFETCH_MAX_DEPTH 4096
+
+/* Start a thread that asks the kernel to read files ahead of the workers. It stays depth files
+ * ahead of them, or if depth is 0, as far ahead as it takes to keep them from waiting on I/O. */
+void prefetch_start(size_t depth);
+/* Wait for the prefetcher to finish, once done_adding_files() has been called */
+void prefetch_finish(void);
+/* For --stats */
+void prefetch_print_stats(void);
+
+/* Time loading a file, so the prefetcher can tell how long the workers spend waiting for the disk.
+ * These do nothing unless the prefetcher is tuning its lookahead. */
+typedef struct {
+    long long wall_ns;
+    long long cpu_ns;
+} prefetch_timer_t;
+
+void prefetch_timer_start(prefetch_timer_t *timer);
+void prefetch_timer_stop(const prefetch_timer_t *timer);
+
+#endif
@@ -10,9 +10,6 @@
 #include "print.h"
 #include "search.h"
 #include "util.h"
-#ifdef _WIN32
-#define fprintf(...) fprintf_w32(__VA_ARGS__)
-#endif
 
 static int first_file_match = 1;
 
@@ -23,6 +20,7 @@ static const char *truncate_marker = " [...]";
 static __thread struct print_context {
     size_t line;
     char **context_prev_lines;
+    size_t *context_prev_sizes; /* of the buffers in context_prev_lines, which are reused */
     size_t prev_line;
     size_t last_prev_line;
     size_t prev_line_offset;
@@ -33,11 +31,288 @@ static __thread struct print_context {
     int printing_a_match;
 } print_context;
 
+/* Output is rendered into a per-thread buffer without holding any locks, then written out in one
+ * go under print_mtx by print_flush(). If a single file's output gets too big to buffer, the
+ * whole lines in it so far are written out, taking print_mtx just for that. Other files' output
+ * can then come between those pieces (but not within a line), rather than waiting on a file
+ * that could take a long time to finish, like a pipe. With --sort=path, a file only spills once
+ * every file ahead of it has been printed, and the ones after it wait their turn as usual. */
+#define PRINT_BUFFER_MAX (1024 * 1024)
+
+static __thread struct print_buffer {
+    char *data;
+    size_t len;
+    size_t size;
+    int separator;   /* print_file_separator() was called with nothing buffered */
+    int fflush;      /* flush out_fd after writing */
+    int ordered;     /* between print_begin_file() and print_end_file() */
+    size_t seq;      /* if ordered, the file's place in the output */
+    size_t spill_at; /* if ordered, how big the buffer can get before trying to spill it */
+} out_buf;
+
+/*
+ * With --sort=path, each file gets a sequence number in the order it was found. Output for a file
+ * that finishes before all the files ahead of it is parked here until they've been printed.
+ * Slots are indexed by seq modulo reorder_size, starting from reorder_next, the next file to be
+ * printed. All of this is protected by print_mtx.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    int separator;
+    int fflush;
+    int done;
+} reorder_slot_t;
+
+static reorder_slot_t *reorder_slots = NULL;
+static size_t reorder_size = 0;
+static size_t reorder_next = 0;
+static int reorder_waiting = FALSE;
+static pthread_cond_t reorder_advanced = PTHREAD_COND_INITIALIZER;
+
+static void write_block(const char *data, size_t len, int separator) {
+    if (separator) {
+        if (first_file_match == 0 && opts.print_break) {
+            fputc('\n', out_fd);
+        }
+        first_file_match = 0;
+    }
+#ifdef _WIN32
+    {
+        /* Colors are handled by fprintf_w32, which has a limited buffer. Feed it a line at a time. */
+        size_t pos = 0;
+        while (pos < len) {
+            const char *nl = memchr(data + pos, '\n', len - pos);
+            size_t n = nl ? (size_t)(nl - (data + pos)) + 1 : len - pos;
+            if (n > 8192) {
+                n = 8192;
+            }
+            fprintf_w32(out_fd, "%.*s", (int)n, data + pos);
+            pos += n;
+        }
+    }
+#else
+    fwrite(data, 1, len, out_fd);
+#endif
+}
+
+static void out_write_locked(void) {
+    write_block(out_buf.data, out_buf.len, out_buf.separator);
+    out_buf.separator = FALSE;
+    out_buf.len = 0;
+}
+
+/* Write out the buffer up to the end of its last line, keeping the rest */
+static void out_spill_locked(void) {
+    size_t len = out_buf.len;
+
+    while (len > 0 && out_buf.data[len - 1] != '\n') {
+        len--;
+    }
+    if (len == 0) {
+        /* One very long line */
+        len = out_buf.len;
+    }
+    write_block(out_buf.data, len, out_buf.separator);
+    out_buf.separator = FALSE;
+    memmove(out_buf.data, out_buf.data + len, out_buf.len - len);
+    out_buf.len -= len;
+}
+
+static void out_reserve(size_t n) {
+    if (out_buf.len + n > out_buf.size) {
+        size_t new_size = out_buf.size ? out_buf.size * 2 : 4096;
+        while (new_size < out_buf.len + n) {
+            new_size *= 2;
+        }
+        out_buf.data = ag_realloc(out_buf.data, new_size);
+        out_buf.size = new_size;
+    }
+}
+
+static void out_check_size(void) {
+    if (out_buf.len < PRINT_BUFFER_MAX) {
+        return;
+    }
+    if (out_buf.ordered && out_buf.len < out_buf.spill_at) {
+        return;
+    }
+    pthread_mutex_lock(&print_mtx);
+    if (out_buf.ordered && out_buf.seq != reorder_next) {
+        /* Files ahead of this one haven't been printed yet, so it has to stay buffered */
+        pthread_mutex_unlock(&print_mtx);
+        out_buf.spill_at = out_buf.len * 2;
+        return;
+    }
+    out_spill_locked();
+    pthread_mutex_unlock(&print_mtx);
+}
+
+static void out_write(const char *data, size_t n) {
+    out_reserve(n);
+    memcpy(out_buf.data + out_buf.len, data, n);
+    out_buf.len += n;
+    out_check_size();
+}
+
+static void out_putc(char c) {
+    out_reserve(1);
+    out_buf.data[out_buf.len++] = c;
+    out_check_size();
+}
+
+static void out_puts(const char *str) {
+    out_write(str, strlen(str));
+}
+
+static void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void out_printf(const char *fmt, ...) {
+    va_list args;
+    int n;
+
+    out_reserve(256);
+    va_start(args, fmt);
+    n = vsnprintf(out_buf.data + out_buf.len, out_buf.size - out_buf.len, fmt, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n >= out_buf.size - out_buf.len) {
+        out_reserve(n + 1);
+        va_start(args, fmt);
+        vsnprintf(out_buf.data + out_buf.len, out_buf.size - out_buf.len, fmt, args);
+        va_end(args);
+    }
+    out_buf.len += n;
+    out_check_size();
+}
+
+void print_flush(void) {
+    if (out_buf.len == 0 && !out_buf.separator) {
+        return;
+    }
+    if (out_buf.ordered) {
+        /* Wait for print_end_file() */
+        return;
+    }
+    pthread_mutex_lock(&print_mtx);
+    out_write_locked();
+    if (out_buf.fflush) {
+        fflush(out_fd);
+        out_buf.fflush = FALSE;
+    }
+    pthread_mutex_unlock(&print_mtx);
+}
+
+void print_free_buffer(void) {
+    print_flush();
+    free(out_buf.data);
+    out_buf.data = NULL;
+    out_buf.size = 0;
+}
+
+void print_begin_file(size_t seq) {
+    print_flush();
+    out_buf.ordered = TRUE;
+    out_buf.seq = seq;
+    out_buf.spill_at = PRINT_BUFFER_MAX;
+}
+
+static reorder_slot_t *reorder_slot(size_t seq) {
+    if (seq - reorder_next >= reorder_size) {
+        size_t new_size = reorder_size ? reorder_size * 2 : 1024;
+        reorder_slot_t *new_slots;
+        size_t i;
+
+        while (seq - reorder_next >= new_size) {
+            new_size *= 2;
+        }
+        new_slots = ag_calloc(new_size, sizeof(reorder_slot_t));
+        for (i = 0; i < reorder_size; i++) {
+            new_slots[(reorder_next + i) % new_size] = reorder_slots[(reorder_next + i) % reorder_size];
+        }
+        free(reorder_slots);
+        reorder_slots = new_slots;
+        reorder_size = new_size;
+    }
+    return &reorder_slots[seq % reorder_size];
+}
+
+void print_end_file(void) {
+    reorder_slot_t *slot;
+
+    pthread_mutex_lock(&print_mtx);
+    out_buf.ordered = FALSE;
+
+    if (out_buf.seq != reorder_next) {
+        slot = reorder_slot(out_buf.seq);
+        if (out_buf.len > 0) {
+            slot->data = ag_malloc(out_buf.len);
+            memcpy(slot->data, out_buf.data, out_buf.len);
+        }
+        slot->len = out_buf.len;
+        slot->separator = out_buf.separator;
+        slot->fflush = out_buf.fflush;
+        slot->done = TRUE;
+        out_buf.len = 0;
+        out_buf.separator = FALSE;
+        out_buf.fflush = FALSE;
+        pthread_mutex_unlock(&print_mtx);
+        return;
+    }
+
+    /* This file is next, so print it along with any files after it that were waiting on it */
+    out_write_locked();
+    if (out_buf.fflush) {
+        fflush(out_fd);
+        out_buf.fflush = FALSE;
+    }
+    reorder_next++;
+    while (reorder_size > 0 && reorder_slots[reorder_next % reorder_size].done) {
+        slot = &reorder_slots[reorder_next % reorder_size];
+        write_block(slot->data, slot->len, slot->separator);
+        if (slot->fflush) {
+            fflush(out_fd);
+        }
+        free(slot->data);
+        memset(slot, 0, sizeof(reorder_slot_t));
+        reorder_next++;
+    }
+    if (reorder_waiting) {
+        pthread_cond_signal(&reorder_advanced);
+    }
+    pthread_mutex_unlock(&print_mtx);
+}
+
+void print_wait_for_files(size_t seq, size_t limit) {
+    pthread_mutex_lock(&print_mtx);
+    if (seq - reorder_next > limit) {
+        while (seq - reorder_next > limit / 2) {
+            reorder_waiting = TRUE;
+            pthread_cond_wait(&reorder_advanced, &print_mtx);
+        }
+        reorder_waiting = FALSE;
+    }
+    pthread_mutex_unlock(&print_mtx);
+}
+
+void print_reorder_cleanup(void) {
+    size_t i;
+    for (i = 0; i < reorder_size; i++) {
+        free(reorder_slots[i].data);
+    }
+    free(reorder_slots);
+    reorder_slots = NULL;
+    reorder_size = 0;
+    reorder_next = 0;
+}
+
 void print_init_context(void) {
     if (print_context.context_prev_lines != NULL) {
         return;
     }
     print_context.context_prev_lines = ag_calloc(sizeof(char *), (opts.before + 1));
+    print_context.context_prev_sizes = ag_calloc(sizeof(size_t), (opts.before + 1));
     print_context.line = 1;
     print_context.prev_line = 0;
     print_context.last_prev_line = 0;
@@ -62,20 +337,40 @@ void print_cleanup_context(void) {
         }
     }
     free(print_context.context_prev_lines);
+    free(print_context.context_prev_sizes);
     print_context.context_prev_lines = NULL;
+    print_context.context_prev_sizes = NULL;
 }
 
 void print_context_append(const char *line, size_t len) {
+    char **prev;
+    size_t *size;
+    const char *nul;
+
     if (opts.before == 0) {
         return;
     }
-    if (print_context.context_prev_lines[print_context.last_prev_line] != NULL) {
-        free(print_context.context_prev_lines[print_context.last_prev_line]);
+    prev = &print_context.context_prev_lines[print_context.last_prev_line];
+    size = &print_context.context_prev_sizes[print_context.last_prev_line];
+    /* Lines are printed as strings, so they end at a NUL */
+    nul = memchr(line, '\0', len);
+    if (nul != NULL) {
+        len = nul - line;
+    }
+    if (len + 1 > *size) {
+        *size = len + 1 > *size * 2 ? len + 1 : *size * 2;
+        free(*prev);
+        *prev = ag_malloc(*size);
     }
-    print_context.context_prev_lines[print_context.last_prev_line] = ag_strndup(line, len);
+    memcpy(*prev, line, len);
+    (*prev)[len] = '\0';
     print_context.last_prev_line = (print_context.last_prev_line + 1) % opts.before;
 }
 
+void print_passthrough(const char *buf, size_t n) {
+    out_write(buf, n);
+}
+
 void print_trailing_context(const char *path, const char *buf, size_t n) {
     char sep = '-';
 
@@ -90,8 +385,8 @@ void print_trailing_context(const char *path, const char *buf, size_t n) {
         }
         print_line_number(print_context.line, sep);
 
-        fwrite(buf, 1, n, out_fd);
-        fputc('\n', out_fd);
+        out_write(buf, n);
+        out_putc('\n');
     }
 
     print_context.line++;
@@ -107,9 +402,9 @@ void print_path_match(const char *_path, const char sep, size_t *match_ovec) {
     const char *path = normalize_path(_path);
 
     if (opts.ackmate) {
-        fprintf(out_fd, ":%s%c", path, sep);
+        out_printf(":%s%c", path, sep);
     } else if (opts.vimgrep) {
-        fprintf(out_fd, "%s%c", path, sep);
+        out_printf("%s%c", path, sep);
     } else {
         if (opts.color) {
             if (match_ovec) {
@@ -132,13 +427,13 @@ void print_path_match(const char *_path, const char sep, size_t *match_ovec) {
                 const char *match_start = path + ovec0;
                 int match_len = ovec1 - ovec0;
                 const char *postmatch_start = match_start + match_len;
-                fprintf(out_fd, "%.*s%s%.*s%s%s%c", prematch_len, path, opts.color_match,
+                out_printf("%.*s%s%.*s%s%s%c", prematch_len, path, opts.color_match,
                         match_len, match_start, color_reset, postmatch_start, sep);
             } else {
-                fprintf(out_fd, "%s%s%s%c", opts.color_path, path, color_reset, sep);
+                out_printf("%s%s%s%c", opts.color_path, path, color_reset, sep);
             }
         } else {
-            fprintf(out_fd, "%s%c", path, sep);
+            out_printf("%s%c", path, sep);
         }
     }
 }
@@ -148,9 +443,9 @@ void print_path_count(const char *path, const char sep, const size_t count) {
         print_path(path, ':');
     }
     if (opts.color) {
-        fprintf(out_fd, "%s%lu%s%c", opts.color_line_number, (unsigned long)count, color_reset, sep);
+        out_printf("%s%lu%s%c", opts.color_line_number, (unsigned long)count, color_reset, sep);
     } else {
-        fprintf(out_fd, "%lu%c", (unsigned long)count, sep);
+        out_printf("%lu%c", (unsigned long)count, sep);
     }
 }
 
@@ -160,13 +455,13 @@ void print_line(const char *buf, size_t buf_pos, size_t prev_line_offset) {
         write_chars = opts.width;
     }
 
-    fwrite(buf + prev_line_offset, 1, write_chars, out_fd);
+    out_write(buf + prev_line_offset, write_chars);
 }
 
 void print_binary_file_matches(const char *path) {
     path = normalize_path(path);
     print_file_separator();
-    fprintf(out_fd, "Binary file %s matches.\n", path);
+    out_printf("Binary file %s matches.\n", path);
 }
 
 void print_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len) {
@@ -201,7 +496,7 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
             print_context.in_a_match = TRUE;
             /* We found the start of a match */
             if (cur_match > 0 && blanks_between_matches && print_context.lines_since_last_match > (opts.before + opts.after + 1)) {
-                fprintf(out_fd, "--\n");
+                out_puts("--\n");
             }
 
             if (print_context.lines_since_last_match > 0 && opts.before > 0) {
@@ -221,7 +516,7 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                             print_path(path, ':');
                         }
                         print_line_number(print_context.line - (opts.before - j), sep);
-                        fprintf(out_fd, "%s\n", print_context.context_prev_lines[print_context.prev_line]);
+                        out_printf("%s\n", print_context.context_prev_lines[print_context.prev_line]);
                     }
                 }
             }
@@ -250,10 +545,10 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                     print_line_number(print_context.line, ';');
                     for (; print_context.last_printed_match < cur_match; print_context.last_printed_match++) {
                         size_t start = matches[print_context.last_printed_match].start - print_context.line_preceding_current_match_offset;
-                        fprintf(out_fd, "%zu %zu",
+                        out_printf("%zu %zu",
                                 start,
                                 matches[print_context.last_printed_match].end - matches[print_context.last_printed_match].start);
-                        print_context.last_printed_match == cur_match - 1 ? fputc(':', out_fd) : fputc(',', out_fd);
+                        out_putc(print_context.last_printed_match == cur_match - 1 ? ':' : ',');
                     }
                     print_line(buf, i, print_context.prev_line_offset);
                 } else if (opts.vimgrep) {
@@ -271,28 +566,28 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                     }
 
                     if (print_context.printing_a_match && opts.color) {
-                        fprintf(out_fd, "%s", opts.color_match);
+                        out_puts(opts.color_match);
                     }
                     for (j = print_context.prev_line_offset; j <= i; j++) {
                         /* close highlight of match term */
                         if (print_context.last_printed_match < matches_len && j == matches[print_context.last_printed_match].end) {
                             if (opts.color) {
-                                fprintf(out_fd, "%s", color_reset);
+                                out_puts(color_reset);
                             }
                             print_context.printing_a_match = FALSE;
                             print_context.last_printed_match++;
                             printed_match = TRUE;
                             if (opts.only_matching) {
-                                fputc('\n', out_fd);
+                                out_putc('\n');
                             }
                         }
                         /* skip remaining characters if truncation width exceeded, needs to be done
                          * before highlight opening */
                         if (j < buf_len && opts.width > 0 && j - print_context.prev_line_offset >= opts.width) {
                             if (j < i) {
-                                fputs(truncate_marker, out_fd);
+                                out_puts(truncate_marker);
                             }
-                            fputc('\n', out_fd);
+                            out_putc('\n');
 
                             /* prevent any more characters or highlights */
                             j = i;
@@ -310,7 +605,7 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                                 }
                             }
                             if (opts.color) {
-                                fprintf(out_fd, "%s", opts.color_match);
+                                out_puts(opts.color_match);
                             }
                             print_context.printing_a_match = TRUE;
                         }
@@ -319,13 +614,13 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                             /* if only_matching is set, print only matches and newlines */
                             if (!opts.only_matching || print_context.printing_a_match) {
                                 if (opts.width == 0 || j - print_context.prev_line_offset < opts.width) {
-                                    fputc(buf[j] ? buf[j] : '\n', out_fd);
+                                    out_putc(buf[j] ? buf[j] : '\n');
                                 }
                             }
                         }
                     }
                     if (print_context.printing_a_match && opts.color) {
-                        fprintf(out_fd, "%s", color_reset);
+                        out_puts(color_reset);
                     }
                 }
             }
@@ -345,13 +640,13 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
 
             /* File doesn't end with a newline. Print one so the output is pretty. */
             if (i == buf_len && buf[i - 1] != opts.line_delim) {
-                fputc('\n', out_fd);
+                out_putc('\n');
             }
         }
     }
     /* Flush output if stdout is not a tty */
     if (opts.stdout_inode) {
-        fflush(out_fd);
+        out_buf.fflush = TRUE;
     }
 }
 
@@ -360,9 +655,9 @@ void print_line_number(size_t line, const char sep) {
         return;
     }
     if (opts.color) {
-        fprintf(out_fd, "%s%lu%s%c", opts.color_line_number, (unsigned long)line, color_reset, sep);
+        out_printf("%s%lu%s%c", opts.color_line_number, (unsigned long)line, color_reset, sep);
     } else {
-        fprintf(out_fd, "%lu%c", (unsigned long)line, sep);
+        out_printf("%lu%c", (unsigned long)line, sep);
     }
 }
 
@@ -372,14 +667,17 @@ void print_column_number(const match_t matches[], size_t last_printed_match,
     if (prev_line_offset <= matches[last_printed_match].start) {
         column = (matches[last_printed_match].start - prev_line_offset) + 1;
     }
-    fprintf(out_fd, "%lu%c", (unsigned long)column, sep);
+    out_printf("%lu%c", (unsigned long)column, sep);
 }
 
 void print_file_separator(void) {
-    if (first_file_match == 0 && opts.print_break) {
-        fprintf(out_fd, "\n");
+    /* Whether this is the first file can only be known once the output is written. If there's
+     * already output buffered, then it isn't. */
+    if (out_buf.len == 0) {
+        out_buf.separator = TRUE;
+    } else if (opts.print_break) {
+        out_putc('\n');
     }
-    first_file_match = 0;
 }
 
 const char *normalize_path(const char *path) {
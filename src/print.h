@@ -3,10 +3,20 @@
 
 #include "util.h"
 
+void print_flush(void);
+void print_free_buffer(void);
+/* With --sort=path, output between these is held back until the files before seq are printed */
+void print_begin_file(size_t seq);
+void print_end_file(void);
+/* Wait while more than limit of the files before seq haven't been printed yet */
+void print_wait_for_files(size_t seq, size_t limit);
+void print_reorder_cleanup(void);
 void print_init_context(void);
 void print_cleanup_context(void);
 void print_context_append(const char *line, size_t len);
 void print_trailing_context(const char *path, const char *buf, size_t n);
+/* With --passthrough, print a line that didn't match as it is */
+void print_passthrough(const char *buf, size_t n);
 void print_path_match(const char *path, const char sep, size_t *match_ovec);
 static inline void print_path(const char *path, const char sep) {
     print_path_match(path, sep, NULL);
@@ -4,60 +4,88 @@
 #include "scandir.h"
 #include "util.h"
 
+/* Entries are copied into one block, after the array of pointers to them, so that a directory
+ * costs a couple of allocations rather than one per entry, and the list is freed with free(). */
+#define ENTRY_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
 int ag_scandir(const char *dirname,
                struct dirent ***namelist,
                filter_fp filter,
                void *baton) {
     DIR *dirp = NULL;
-    struct dirent **names = NULL;
-    struct dirent *entry, *d;
-    int names_len = 32;
+    char *data = NULL;
+    size_t data_len = 0;
+    size_t data_size = 4096;
+    size_t *offsets = NULL;
+    size_t offsets_len = 32;
+    size_t ptrs_size;
+    struct dirent **names;
+    struct dirent *entry;
     int results_len = 0;
+    int i;
 
     dirp = opendir(dirname);
     if (dirp == NULL) {
         goto fail;
     }
 
-    names = malloc(sizeof(struct dirent *) * names_len);
-    if (names == NULL) {
+    data = malloc(data_size);
+    offsets = malloc(sizeof(size_t) * offsets_len);
+    if (data == NULL || offsets == NULL) {
         goto fail;
     }
 
     while ((entry = readdir(dirp)) != NULL) {
+#if defined(__MINGW32__) || defined(__CYGWIN__)
+        size_t entry_len = sizeof(struct dirent);
+#else
+        size_t entry_len = entry->d_reclen;
+#endif
         if ((*filter)(dirname, entry, baton) == FALSE) {
             continue;
         }
-        if (results_len >= names_len) {
-            struct dirent **tmp_names = names;
-            names_len *= 2;
-            names = realloc(names, sizeof(struct dirent *) * names_len);
-            if (names == NULL) {
-                free(tmp_names);
+        if ((size_t)results_len >= offsets_len) {
+            size_t *tmp_offsets = offsets;
+            offsets_len *= 2;
+            offsets = realloc(offsets, sizeof(size_t) * offsets_len);
+            if (offsets == NULL) {
+                free(tmp_offsets);
                 goto fail;
             }
         }
-
-#if defined(__MINGW32__) || defined(__CYGWIN__)
-        d = malloc(sizeof(struct dirent));
-#else
-        d = malloc(entry->d_reclen);
-#endif
-
-        if (d == NULL) {
-            goto fail;
+        if (data_len + ENTRY_ALIGN(entry_len) > data_size) {
+            char *tmp_data = data;
+            data_size *= 2;
+            data = realloc(data, data_size);
+            if (data == NULL) {
+                free(tmp_data);
+                goto fail;
+            }
         }
-#if defined(__MINGW32__) || defined(__CYGWIN__)
-        memcpy(d, entry, sizeof(struct dirent));
-#else
-        memcpy(d, entry, entry->d_reclen);
-#endif
 
-        names[results_len] = d;
+        memcpy(data + data_len, entry, entry_len);
+        offsets[results_len] = data_len;
+        data_len += ENTRY_ALIGN(entry_len);
         results_len++;
     }
 
     closedir(dirp);
+    dirp = NULL;
+
+    /* Make room for the pointers in front of the entries, plus a NULL to end them */
+    ptrs_size = ENTRY_ALIGN(sizeof(struct dirent *) * (results_len + 1));
+    names = realloc(data, ptrs_size + data_len);
+    if (names == NULL) {
+        goto fail;
+    }
+    data = (char *)names;
+    memmove(data + ptrs_size, data, data_len);
+    for (i = 0; i < results_len; i++) {
+        names[i] = (struct dirent *)(void *)(data + ptrs_size + offsets[i]);
+    }
+    names[results_len] = NULL;
+    free(offsets);
+
     *namelist = names;
     return results_len;
 
@@ -65,13 +93,7 @@ fail:
     if (dirp) {
         closedir(dirp);
     }
-
-    if (names != NULL) {
-        int i;
-        for (i = 0; i < results_len; i++) {
-            free(names[i]);
-        }
-        free(names);
-    }
+    free(data);
+    free(offsets);
     return -1;
 }
@@ -1,18 +1,24 @@
 #include "search.h"
 #include "print.h"
+#include "direct_io.h"
+#include "git_index.h"
+#include "index.h"
+#include "io_threads.h"
+#include "prefetch.h"
 #include "scandir.h"
+#include "server.h"
+#include "watch.h"
 #include <stdbool.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/resource.h>
+#endif
 
 // globals
 size_t alpha_skip_lookup[256] = { 0 };
 size_t *find_skip_lookup = { 0 };
 uint8_t h_table[H_SIZE] __attribute__((aligned(64))) = { 0 };
-work_queue_t *work_queue = NULL;
-work_queue_t *work_queue_tail = NULL;
-int done_adding_files = 0;
-pthread_cond_t files_ready = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t work_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
 symdir_t *symhash = NULL;
 
 #ifdef OS_LINUX
@@ -23,23 +29,17 @@ dev_t sys_dev = 0;
 #define is_sysfile(_statbuf) (sys_dev && (sys_dev == _statbuf.st_dev))
 #endif
 
+/* Size (and alignment) of a transparent huge page, on x86-64 and most arm64 kernels */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/* How much of a file is read at a time into a huge-page buffer */
+#define POPULATE_CHUNK (8 * 1024 * 1024)
 
-/* Returns: -1 if skipped, otherwise # of matches */
-ssize_t search_buf(const char *buf, const size_t buf_len,
-                   const char *dir_full_path) {
-    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
+/* Find up to max_matches matches in buf (or all of them if it's 0), and put them in *matches_out,
+ * which is allocated if *matches_size_out is more than 0. Regexes only match within lines unless
+ * multiline is set. */
+static size_t find_matches(const char *buf, const size_t buf_len, const char *dir_full_path,
+                           int multiline, size_t max_matches, match_t **matches_out, size_t *matches_size_out) {
     size_t buf_offset = 0;
-
-    if (opts.search_as_text || opts.search_stream) {
-        binary = 0;
-    } else if (!opts.search_binary_files && opts.mmap) { /* if not using mmap, binary files have already been skipped */
-        binary = is_binary((const void *)buf, buf_len);
-        if (binary) {
-            log_debug("File %s is binary. Skipping...", dir_full_path);
-            return -1;
-        }
-    }
-
     pcre2_match_data *mdata = NULL;
     size_t matches_len = 0;
     match_t *matches;
@@ -116,7 +116,7 @@ ssize_t search_buf(const char *buf, const size_t buf_len,
             matches_len++;
             match_ptr += opts.query_len;
 
-            if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+            if (max_matches > 0 && matches_len >= max_matches) {
                 log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
                 break;
             }
@@ -128,7 +128,7 @@ ssize_t search_buf(const char *buf, const size_t buf_len,
             log_err("Failed to allocated pcre match_data for %s! Skipping this file", dir_full_path);
             goto multiline_done;
         }
-        if (opts.multiline) {
+        if (multiline) {
             while (buf_offset < buf_len &&
                    (ag_pcre2_match(opts.re, buf, buf_len, buf_offset, 0, mdata)) >= 0) {
                 offset_vector = pcre2_get_ovector_pointer(mdata);
@@ -145,7 +145,7 @@ ssize_t search_buf(const char *buf, const size_t buf_len,
                 matches[matches_len].end = offset_vector[1];
                 matches_len++;
 
-                if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+                if (max_matches > 0 && matches_len >= max_matches) {
                     log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
                     break;
                 }
@@ -180,7 +180,7 @@ ssize_t search_buf(const char *buf, const size_t buf_len,
                     matches[matches_len].end = offset_vector[1] + buf_offset;
                     matches_len++;
 
-                    if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+                    if (max_matches > 0 && matches_len >= max_matches) {
                         log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
                         goto multiline_done;
                     }
@@ -195,26 +195,18 @@ multiline_done:
         pcre2_match_data_free(mdata);
     }
 
-    if (opts.invert_match) {
-        matches_len = invert_matches(buf, buf_len, matches, matches_len);
-    }
-
-    if (opts.stats) {
-        pthread_mutex_lock(&stats_mtx);
-        stats.total_bytes += buf_len;
-        stats.total_files++;
-        stats.total_matches += matches_len;
-        if (matches_len > 0) {
-            stats.total_file_matches++;
-        }
-        pthread_mutex_unlock(&stats_mtx);
-    }
+    *matches_out = matches;
+    *matches_size_out = matches_size;
+    return matches_len;
+}
 
+/* Print what matched in buf, or whatever else the options call for when nothing did */
+static void print_matches(const char *buf, const size_t buf_len, const char *dir_full_path,
+                          const match_t *matches, size_t matches_len, int binary) {
     if (!opts.print_nonmatching_files && (matches_len > 0 || opts.print_all_paths)) {
         if (binary == -1 && !opts.print_filename_only) {
             binary = is_binary((const void *)buf, buf_len);
         }
-        pthread_mutex_lock(&print_mtx);
         if (opts.print_filename_only) {
             if (opts.print_count) {
                 print_path_count(dir_full_path, opts.path_sep, (size_t)matches_len);
@@ -226,10 +218,13 @@ multiline_done:
         } else {
             print_file_matches(dir_full_path, buf, buf_len, matches, matches_len);
         }
-        pthread_mutex_unlock(&print_mtx);
+        if (!opts.search_stream) {
+            /* Streams are written out a block at a time */
+            print_flush();
+        }
         opts.match_found = 1;
     } else if (opts.search_stream && opts.passthrough) {
-        fprintf(out_fd, "%s", buf);
+        print_passthrough(buf, buf_len);
     } else {
         log_debug("No match in %s", dir_full_path);
     }
@@ -237,6 +232,43 @@ multiline_done:
     if (matches_len == 0 && opts.search_stream) {
         print_context_append(buf, buf_len - 1);
     }
+}
+
+/* Returns: -1 if skipped, otherwise # of matches */
+ssize_t search_buf(const char *buf, const size_t buf_len,
+                   const char *dir_full_path) {
+    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
+    size_t matches_len;
+    match_t *matches;
+    size_t matches_size;
+
+    if (opts.search_as_text || opts.search_stream) {
+        binary = 0;
+    } else if (!opts.search_binary_files) {
+        binary = is_binary((const void *)buf, buf_len);
+        if (binary) {
+            log_debug("File %s is binary. Skipping...", dir_full_path);
+            return -1;
+        }
+    }
+
+    matches_len = find_matches(buf, buf_len, dir_full_path, opts.multiline, opts.max_matches_per_file, &matches, &matches_size);
+    if (opts.invert_match) {
+        matches_len = invert_matches(buf, buf_len, matches, matches_len);
+    }
+
+    if (opts.stats) {
+        pthread_mutex_lock(&stats_mtx);
+        stats.total_bytes += buf_len;
+        stats.total_files++;
+        stats.total_matches += matches_len;
+        if (matches_len > 0) {
+            stats.total_file_matches++;
+        }
+        pthread_mutex_unlock(&stats_mtx);
+    }
+
+    print_matches(buf, buf_len, dir_full_path, matches, matches_len, binary);
 
     if (matches_size > 0) {
         free(matches);
@@ -246,75 +278,462 @@ multiline_done:
     return (ssize_t)matches_len;
 }
 
+/* Streams are read this much at a time, or more when a line doesn't fit */
+#define STREAM_BLOCK_SIZE (128 * 1024)
+/* Output is written once no more input has turned up for this long, so that matches from
+ * something like tail -F show up right away without writing every line as it's found */
+#define STREAM_FLUSH_MS 50
+
+/* Search a line of a stream as if it were a buffer of its own, given the matches in it */
+static ssize_t search_stream_line(const char *line, size_t line_len, const char *path,
+                                  match_t *matches, size_t matches_len) {
+    int binary = -1;
+
+    if (opts.search_as_text || opts.search_stream) {
+        binary = 0;
+    } else if (!opts.search_binary_files) {
+        binary = is_binary((const void *)line, line_len);
+        if (binary) {
+            log_debug("File %s is binary. Skipping...", path);
+            return -1;
+        }
+    }
+    if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+        /* Keep the message in order with the lines before it */
+        print_flush();
+        log_err("Too many matches in %s. Skipping the rest of this file.", path);
+        matches_len = opts.max_matches_per_file;
+    }
+    if (opts.invert_match) {
+        matches_len = invert_matches(line, line_len, matches, matches_len);
+    }
+    print_matches(line, line_len, path, matches, matches_len, binary);
+    return matches_len;
+}
+
+static size_t line_start_of(const char *buf, size_t pos) {
+    while (pos > 0 && buf[pos - 1] != opts.line_delim) {
+        pos--;
+    }
+    return pos;
+}
+
+/* With --multiline, a match in a stream can carry on past what's been read so far. This finds
+ * the matches in buf, using partial matching to spot one that might go on past the end. If there
+ * is one, *buf_len is cut back to the start of its line (and of any match that runs into that
+ * line), so that the rest is kept and searched again once there's more of the stream. A match
+ * that's still going after --max-match-span bytes is given up on, so that the window of the
+ * stream that's kept stays bounded. */
+static size_t find_window_matches(const char *buf, size_t *buf_len, int eof, const char *path,
+                                  match_t **matches_out, size_t *matches_size_out) {
+    pcre2_match_data *mdata;
+    match_t *matches = NULL;
+    size_t matches_size = 0;
+    size_t matches_len = 0;
+    size_t len = *buf_len;
+    size_t offset = 0;
+    size_t pending = len;
+    int gave_up = FALSE;
+
+    mdata = pcre2_match_data_create(1, NULL);
+    if (mdata == NULL) {
+        die("Failed to allocate pcre match_data for %s", path);
+    }
+    while (offset < len) {
+        size_t *offset_vector;
+        const char *delim;
+        int rv = ag_pcre2_match(opts.re, buf, len, offset, eof ? 0 : PCRE2_PARTIAL_HARD, mdata);
+        offset_vector = pcre2_get_ovector_pointer(mdata);
+        if (rv == PCRE2_ERROR_PARTIAL) {
+            if (len - offset_vector[0] <= opts.max_match_span) {
+                pending = offset_vector[0];
+                break;
+            }
+            log_debug("Match at offset %zu in %s is longer than %zu bytes. Giving up on it.",
+                      offset_vector[0], path, opts.max_match_span);
+            /* Each try scans to the end of the window, so don't try again from every byte of a
+             * long run that partly matches. Carry on from the next line, and if a match has to
+             * be given up on again, from the end of the window. */
+            delim = memchr(buf + offset_vector[0], opts.line_delim, len - offset_vector[0]);
+            offset = delim && !gave_up ? (size_t)(delim - buf) + 1 : len;
+            gave_up = TRUE;
+            continue;
+        }
+        if (rv < 0) {
+            break;
+        }
+        log_debug("Regex match found. File %s, offset %zu bytes.", path, offset_vector[0]);
+        realloc_matches(&matches, &matches_size, matches_len);
+        matches[matches_len].start = offset_vector[0];
+        matches[matches_len].end = offset_vector[1];
+        matches_len++;
+        offset = offset_vector[1];
+        if (offset_vector[0] == offset_vector[1]) {
+            ++offset;
+        }
+    }
+    pcre2_match_data_free(mdata);
+
+    if (pending < len) {
+        size_t cut = line_start_of(buf, pending);
+        while (matches_len > 0 && matches[matches_len - 1].end > cut) {
+            matches_len--;
+            cut = line_start_of(buf, matches[matches_len].start);
+        }
+        *buf_len = cut;
+    }
+    *matches_out = matches;
+    *matches_size_out = matches_size;
+    return matches_len;
+}
+
+/* Search the lines in buf, which ends at the end of a line unless it's the end of the stream.
+ * Matching is done on the whole block at once, then lines are printed one at a time, with line
+ * numbers and context carried over from the block before. Returns how much of buf was searched;
+ * the rest is part of a multiline match that needs more of the stream. */
+static size_t search_stream_block(const char *buf, size_t buf_len, int eof, const char *path,
+                                  match_t **line_matches, size_t *line_matches_size,
+                                  ssize_t *matches_count) {
+    match_t *matches;
+    size_t matches_size;
+    size_t matches_len;
+    size_t cur = 0;
+    size_t line_start = 0;
+    size_t found = 0;
+
+    if (opts.multiline && !opts.literal && !(opts.query_len == 1 && opts.query[0] == '.')) {
+        matches_len = find_window_matches(buf, &buf_len, eof, path, &matches, &matches_size);
+    } else {
+        /* --max-count applies to each line, as if it were a file of its own */
+        matches_len = find_matches(buf, buf_len, path, FALSE, 0, &matches, &matches_size);
+    }
+
+    while (line_start < buf_len) {
+        const char *line = buf + line_start;
+        const char *delim = memchr(line, opts.line_delim, buf_len - line_start);
+        size_t line_len = delim ? (size_t)(delim - line) + 1 : buf_len - line_start;
+        size_t line_end = line_start + line_len;
+        size_t n = 0;
+        ssize_t result;
+
+        /* Matches of '.' cover the whole block, and multiline ones several lines. They're cut
+         * down to each line. */
+        while (cur < matches_len && matches[cur].start < line_end) {
+            realloc_matches(line_matches, line_matches_size, n + 1);
+            (*line_matches)[n].start = (matches[cur].start > line_start ? matches[cur].start : line_start) - line_start;
+            (*line_matches)[n].end = (matches[cur].end < line_end ? matches[cur].end : line_end) - line_start;
+            n++;
+            if (matches[cur].end > line_end) {
+                break;
+            }
+            cur++;
+        }
+
+        /* With room for inverting them */
+        realloc_matches(line_matches, line_matches_size, n + 1);
+        result = search_stream_line(line, line_len, path, *line_matches, n);
+        if (result > 0) {
+            if (*matches_count == -1) {
+                *matches_count = 0;
+            }
+            *matches_count += result;
+            found += result;
+        } else if (*matches_count <= 0 && result == -1) {
+            *matches_count = -1;
+        }
+        print_trailing_context(path, line, delim ? line_len - 1 : line_len);
+        line_start = line_end;
+    }
+
+    if (matches_size > 0) {
+        free(matches);
+    }
+    if (opts.stats) {
+        pthread_mutex_lock(&stats_mtx);
+        stats.total_bytes += buf_len;
+        stats.total_matches += found;
+        pthread_mutex_unlock(&stats_mtx);
+    }
+    return buf_len;
+}
+
+/* Wait for more of a stream, writing out what's been found so far if it's slow to come */
+static void wait_for_stream(int fd) {
+#ifdef _WIN32
+    (void)fd;
+    print_flush();
+    fflush(out_fd);
+#else
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, STREAM_FLUSH_MS) == 0) {
+        print_flush();
+        fflush(out_fd);
+    }
+#endif
+}
+
 /* Return value: -1 if skipped, otherwise # of matches */
-/* TODO: this will only match single lines. multi-line regexes silently don't match */
 ssize_t search_stream(FILE *stream, const char *path) {
-    char *line = NULL;
+    int fd = fileno(stream);
+    char *buf;
+    size_t buf_size = STREAM_BLOCK_SIZE;
+    size_t buf_len = 0;
+    size_t whole = 0; /* length of the whole lines at the start of buf */
+    match_t *line_matches = NULL;
+    size_t line_matches_size = 0;
     ssize_t matches_count = 0;
-    ssize_t line_len = 0;
-    size_t line_cap = 0;
-    size_t i;
+    int eof = FALSE;
 
     print_init_context();
+    buf = ag_malloc(buf_size);
 
-    for (i = 1; (line_len = getdelim(&line, &line_cap, opts.line_delim, stream)) > 0; i++) {
-        ssize_t result;
-        result = search_buf(line, line_len, path);
-        if (result > 0) {
-            if (matches_count == -1) {
-                matches_count = 0;
+    while (!eof) {
+        ssize_t bytes_read;
+
+        if (buf_len == buf_size) {
+            /* A line that doesn't fit */
+            buf_size *= 2;
+            buf = ag_realloc(buf, buf_size);
+        }
+        wait_for_stream(fd);
+        bytes_read = read(fd, buf + buf_len, buf_size - buf_len);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_err("Error reading %s: %s", path[0] ? path : "stdin", strerror(errno));
+            bytes_read = 0;
+        }
+        if (bytes_read == 0) {
+            /* Whatever's left is the last line, without a delimiter */
+            eof = TRUE;
+            whole = buf_len;
+        } else {
+            /* Search up to the last whole line. The rest waits for the next read. */
+            size_t old_len = buf_len;
+            size_t end;
+            buf_len += bytes_read;
+            for (end = buf_len; end > old_len && buf[end - 1] != opts.line_delim; end--) {
             }
-            matches_count += result;
-        } else if (matches_count <= 0 && result == -1) {
-            matches_count = -1;
+            if (end > old_len) {
+                whole = end;
+            }
+        }
+        if (whole > 0) {
+            size_t searched = search_stream_block(buf, whole, eof, path, &line_matches, &line_matches_size, &matches_count);
+            memmove(buf, buf + searched, buf_len - searched);
+            buf_len -= searched;
+            whole -= searched;
         }
-        if (line[line_len - 1] == opts.line_delim) {
-            line_len--;
+    }
+    print_flush();
+
+    if (opts.stats) {
+        pthread_mutex_lock(&stats_mtx);
+        stats.total_files++;
+        if (matches_count > 0) {
+            stats.total_file_matches++;
         }
-        print_trailing_context(path, line, line_len);
+        pthread_mutex_unlock(&stats_mtx);
     }
 
-    free(line);
+    free(buf);
+    free(line_matches);
     print_cleanup_context();
     return matches_count;
 }
 
-void search_file(const char *file_full_path) {
+/* Files smaller than --mmap-min are read() rather than mapped, since for them setting up and
+ * tearing down a mapping costs more than copying. Each thread reads into a buffer it keeps from
+ * one file to the next, up to this size. Bigger files get a buffer of their own. */
+#define READ_BUFFER_MAX (4 * 1024 * 1024)
+
+static __thread char *read_buf = NULL;
+static __thread size_t read_buf_size = 0;
+
+/* How much of a file is in the page cache, as far as mincore() can tell */
+static off_t cached_bytes(int fd, off_t len) {
+#if defined(HAVE_MINCORE) && !defined(_WIN32)
+    unsigned char vec[256];
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t span, off;
+    off_t cached = 0;
+    char *map;
+
+    if (len == 0 || page_size <= 0) {
+        return 0;
+    }
+    map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    span = (off_t)sizeof(vec) * page_size;
+    for (off = 0; off < len; off += span) {
+        size_t chunk = ag_min(len - off, span);
+        size_t pages = (chunk + page_size - 1) / page_size;
+        size_t i;
+        if (mincore(map + off, chunk, (void *)vec) != 0) {
+            break;
+        }
+        for (i = 0; i < pages; i++) {
+            if (vec[i] & 1) {
+                cached += page_size;
+            }
+        }
+    }
+    munmap(map, len);
+    return cached < len ? cached : len;
+#else
+    (void)fd;
+    (void)len;
+    return 0;
+#endif
+}
+
+/* With --no-cache-pollution, drop a file that's been searched from the page cache. Files that
+ * were partly cached already are left alone, since something else is probably using them. */
+static void drop_from_cache(const loaded_file_t *f) {
+    if (f->cached == 0) {
+#ifdef HAVE_POSIX_FADVISE
+        posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+    if (opts.stats) {
+        /* Dirty pages, or ones someone else has mapped, can't be dropped */
+        __sync_fetch_and_add(&stats.cache_bytes_read, f->len);
+        __sync_fetch_and_add(&stats.cache_bytes_retained, f->cached == 1 ? f->len : cached_bytes(f->fd, f->len));
+    }
+}
+
+#if defined(OS_LINUX) && defined(MAP_POPULATE)
+/* Page faults this thread has taken so far, or -1 if that can't be told */
+static long thread_faults(void) {
+#ifdef RUSAGE_THREAD
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+        return usage.ru_minflt + usage.ru_majflt;
+    }
+#endif
+    return -1;
+}
+
+/* Load a file of at least --populate-min bytes with its pages faulted in up front, rather than
+ * one fault at a time while it's searched. With --huge-pages, it's read in big chunks into a
+ * buffer backed by transparent huge pages, which takes a fault per huge page rather than per
+ * page, and fewer TLB misses to search. Otherwise (or if it's smaller than a huge page) it's
+ * mapped with MAP_POPULATE, which faults in the whole mapping in one system call. Sets f->contents, or returns NULL if neither worked. */
+static char *load_populated(int fd, off_t len, loaded_file_t *f) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    long faults = thread_faults();
+    char *buf = NULL;
+
+#ifdef MADV_HUGEPAGE
+    if (opts.huge_pages && len >= HUGE_PAGE_SIZE) {
+        void *mem = NULL;
+        off_t off = 0;
+        if (posix_memalign(&mem, HUGE_PAGE_SIZE, len) != 0) {
+            die("Memory allocation failed.");
+        }
+        madvise(mem, len, MADV_HUGEPAGE);
+#ifdef HAVE_POSIX_FADVISE
+        posix_fadvise(fd, 0, len, POSIX_FADV_SEQUENTIAL);
+#endif
+        while (off < len) {
+            ssize_t r = pread(fd, (char *)mem + off, ag_min(len - off, POPULATE_CHUNK), off);
+            if (r <= 0) {
+                break;
+            }
+            off += r;
+        }
+        if (off == len) {
+            buf = mem;
+            f->contents = FILE_ALLOCATED;
+            if (faults != -1 && page_size > 0) {
+                /* Reading into a buffer of small pages takes a fault for each of them */
+                faults = len / page_size - (thread_faults() - faults);
+            }
+        } else {
+            free(mem);
+        }
+    }
+#endif
+    if (buf == NULL) {
+        buf = mmap(0, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            return NULL;
+        }
+        f->contents = FILE_MAPPED;
+        if (faults != -1) {
+            /* Each fault populating the mapping took is one searching it won't */
+            faults = thread_faults() - faults;
+        }
+    }
+    if (opts.stats) {
+        __sync_fetch_and_add(&stats.files_populated, 1);
+        if (faults > 0) {
+            __sync_fetch_and_add(&stats.faults_avoided, faults);
+        }
+    }
+    return buf;
+}
+#endif
+
+/* Open file_full_path and read or map its contents into *f, or mark it skipped. If reuse_buffer
+ * is set, the file can be read into the thread's buffer, so it must be searched on this thread
+ * before the next one is loaded. If pooled is set, it can be read into one of the thread's
+ * buffers for direct I/O, so it must be searched on this thread. */
+static void load_file(const char *file_full_path, loaded_file_t *f, int reuse_buffer, int pooled) {
     int fd = -1;
     off_t f_len = 0;
     char *buf = NULL;
     struct stat statbuf;
     int rv = 0;
-    int matches_count = -1;
-    FILE *fp = NULL;
+
+    f->path = file_full_path;
+    f->contents = FILE_SKIPPED;
+    f->fd = -1;
+    f->buf = NULL;
+    f->len = 0;
+    f->cached = -1;
 
     rv = stat(file_full_path, &statbuf);
     if (rv != 0) {
+        int stat_errno = errno;
         rv = lstat(file_full_path, &statbuf);
-        if (S_ISLNK(statbuf.st_mode)) {
+        if (rv != 0 && stat_errno == ENOENT) {
+            /* e.g. a file in the git index that has been deleted from the work tree */
+            log_debug("Skipping %s: file doesn't exist", file_full_path);
+        } else if (S_ISLNK(statbuf.st_mode)) {
             log_debug("Skipping %s: broken symlink", file_full_path);
         } else {
             log_err("Skipping %s: Error fstat()ing file.", file_full_path);
         }
-        goto cleanup;
+        return;
     }
 
     if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
         log_debug("Skipping %s: stdout is redirected to it", file_full_path);
-        goto cleanup;
+        return;
     }
 
     // handling only regular files and FIFOs
     if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
         log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
-        goto cleanup;
+        return;
+    }
+
+    if (opts.index_path && index_skips(file_full_path, &statbuf)) {
+        return;
     }
 
     fd = open(file_full_path, O_RDONLY);
     if (fd < 0) {
         /* XXXX: strerror is not thread-safe */
         log_err("Skipping %s: Error opening file: %s", file_full_path, strerror(errno));
-        goto cleanup;
+        return;
     }
 
     // repeating stat check with file handle to prevent TOCTOU issue
@@ -326,28 +745,25 @@ void search_file(const char *file_full_path) {
         } else {
             log_err("Skipping %s: Error fstat()ing file.", file_full_path);
         }
-        goto cleanup;
+        goto fail;
     }
 
     if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
         log_debug("Skipping %s: stdout is redirected to it", file_full_path);
-        goto cleanup;
+        goto fail;
     }
 
     // handling only regular files and FIFOs
     if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
         log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
-        goto cleanup;
+        goto fail;
     }
 
-    print_init_context();
-
     if (statbuf.st_mode & S_IFIFO) {
-        log_debug("%s is a named pipe. stream searching", file_full_path);
-        fp = fdopen(fd, "r");
-        matches_count = search_stream(fp, file_full_path);
-        fclose(fp);
-        goto cleanup;
+        /* Nothing to load ahead of time. It's read as it's searched. */
+        f->contents = FILE_STREAM;
+        f->fd = fd;
+        return;
     }
 
     f_len = statbuf.st_size;
@@ -358,17 +774,39 @@ void search_file(const char *file_full_path) {
     if (f_len == 0) {
 #endif
         if (opts.query[0] == '.' && opts.query_len == 1 && !opts.literal && opts.search_all_files) {
-            matches_count = search_buf(buf, f_len, file_full_path);
+            f->contents = FILE_EMPTY;
         } else {
             log_debug("Skipping %s: file is empty.", file_full_path);
         }
-        goto cleanup;
+        goto fail;
     }
 
     if (!opts.literal && f_len > INT_MAX) {
         log_err("Skipping %s: pcre_exec() can't handle files larger than %i bytes.", file_full_path, INT_MAX);
-        goto cleanup;
+        goto fail;
+    }
+
+#ifdef OS_LINUX
+    if (!is_procfile(statbuf) && !is_sysfile(statbuf)) {
+#else
+    {
+#endif
+        if (!opts.cache_pollution) {
+            f->cached = cached_bytes(fd, f_len) > 0;
+        }
+        /* With --direct, whether it's cached or not. Otherwise only if it's not. */
+        if (opts.direct_min && (size_t)f_len >= opts.direct_min && (opts.direct || f->cached == 0) &&
+            direct_load(fd, f_len, f, pooled)) {
+            buf = f->buf;
+        }
+    }
+
+#if defined(OS_LINUX) && defined(MAP_POPULATE)
+    /* Only where the file would have been mapped anyway: --nommap reads everything */
+    if (buf == NULL && opts.mmap && opts.populate_min && (size_t)f_len >= opts.populate_min && !is_sysfile(statbuf)) {
+        buf = load_populated(fd, f_len, f);
     }
+#endif
 
 #ifdef _WIN32
     {
@@ -386,12 +824,15 @@ void search_file(const char *file_full_path) {
             NULL, GetLastError(), 0, (void *)&buf, 0, NULL);
         log_err("File %s failed to load: %s.", file_full_path, buf);
         LocalFree((void *)buf);
-        goto cleanup;
+        goto fail;
     }
+    f->contents = FILE_MAPPED;
 #else
 
 #ifdef OS_LINUX
-    if (is_procfile(statbuf)) {
+    if (buf != NULL) {
+        /* Read with direct I/O, or pre-faulted */
+    } else if (is_procfile(statbuf)) {
         // /proc files can't be mmap'd and show up as zero-length. Sometimes we can lseek them to get the size and sometimes we can't
         ssize_t bytes_read = 0;
         f_len = lseek(fd, 0, SEEK_END);
@@ -422,6 +863,7 @@ void search_file(const char *file_full_path) {
         }
         log_debug("%s: read %zu", file_full_path, bytes_read);
         f_len = (off_t)bytes_read;
+        f->contents = FILE_ALLOCATED;
     } else if (is_sysfile(statbuf)) {
         // /sys files can't be mmap'd, and reading them might return less than the expected amount
         buf = ag_malloc(f_len);
@@ -430,127 +872,303 @@ void search_file(const char *file_full_path) {
             die("Unable to read %s", file_full_path);
         }
         f_len = (off_t)bytes_read; // update file size with the actual amount we read
-    } else if (opts.mmap) {
+        f->contents = FILE_ALLOCATED;
+    } else if (opts.mmap && (size_t)f_len >= opts.mmap_min) {
 #else
-    if (opts.mmap) {
+    if (buf != NULL) {
+        /* Read with direct I/O */
+    } else if (opts.mmap && (size_t)f_len >= opts.mmap_min) {
 #endif // OS_LINUX
         buf = mmap(0, f_len, PROT_READ, MAP_PRIVATE, fd, 0);
         if (buf == MAP_FAILED) {
             log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
-            goto cleanup;
+            goto fail;
         }
 #if HAVE_MADVISE
         madvise(buf, f_len, MADV_SEQUENTIAL);
 #elif HAVE_POSIX_FADVISE
         posix_fadvise(fd, 0, f_len, POSIX_MADV_SEQUENTIAL);
 #endif
+        if (opts.io_threads) {
+            /* Fault the pages in now, so that it's the I/O thread that waits for the disk rather
+             * than the matcher that searches the file */
+            volatile char sink;
+            off_t off;
+            for (off = 0; off < f_len; off += 4096) {
+                sink = buf[off];
+            }
+            (void)sink;
+        }
+        f->contents = FILE_MAPPED;
     } else {
-        buf = ag_malloc(f_len);
+        if (reuse_buffer && f_len <= READ_BUFFER_MAX) {
+            if ((size_t)f_len > read_buf_size) {
+                read_buf_size = read_buf_size * 2 > (size_t)f_len ? read_buf_size * 2 : (size_t)f_len;
+                if (read_buf_size > READ_BUFFER_MAX) {
+                    read_buf_size = READ_BUFFER_MAX;
+                }
+                free(read_buf);
+                read_buf = ag_malloc(read_buf_size);
+            }
+            buf = read_buf;
+            f->contents = FILE_BUFFERED;
+        } else {
+            buf = ag_malloc(f_len);
+            f->contents = FILE_ALLOCATED;
+        }
 
         ssize_t bytes_read = 0;
 
-        if (!opts.search_binary_files) {
+        if (!opts.search_binary_files && !opts.search_as_text) {
             bytes_read = read(fd, buf, ag_min(f_len, 512));
             if (bytes_read < 0) {
-                die("Failed to read %s: %s", file_full_path, strerror(errno));
+                log_err("Skipping %s: Error reading file: %s", file_full_path, strerror(errno));
+                goto fail_read;
             }
             // Optimization: If skipping binary files, don't read the whole buffer before checking if binary or not.
             if (is_binary(buf, bytes_read)) {
                 log_debug("File %s is binary. Skipping...", file_full_path);
-                goto cleanup;
+                goto fail_read;
             }
         }
 
         while (bytes_read < f_len) {
-            ssize_t r = read(fd, buf + bytes_read, f_len);
-            if (r < 0)
+            ssize_t r = read(fd, buf + bytes_read, f_len - bytes_read);
+            if (r < 0) {
+                log_err("Skipping %s: Error reading file: %s", file_full_path, strerror(errno));
+                goto fail_read;
+            }
+            if (r == 0) {
                 break;
+            }
             bytes_read += r;
         }
         if (bytes_read != f_len) {
-            die("File %s read(): expected to read %zu bytes but read %zu", file_full_path, (size_t)f_len, bytes_read);
+            /* It got shorter since fstat(). Anything added to it since is left for next time. */
+            log_debug("%s: expected to read %zu bytes but read %zu", file_full_path, (size_t)f_len, bytes_read);
+            f_len = bytes_read;
         }
     }
 #endif
 
-    if (opts.search_zip_files) {
-        log_debug("check if %s is compressed", file_full_path);
-        ag_compression_type zip_type = is_zipped(buf, f_len);
-        if (zip_type != AG_NO_COMPRESSION) {
-            size_t _buf_len = f_len;
-            char *_buf = decompress(zip_type, buf, f_len, file_full_path, &_buf_len);
-            if (_buf == NULL || _buf_len == 0) {
-                log_err("Cannot decompress zipped file %s", file_full_path);
-                goto cleanup;
-            }
-            matches_count = search_buf(_buf, _buf_len, file_full_path);
-            free(_buf);
-            goto cleanup;
-        }
+    f->buf = buf;
+    f->len = f_len;
+    f->fd = fd;
+    if (opts.stats) {
+        __sync_fetch_and_add(f->contents == FILE_MAPPED ? &stats.files_mapped : &stats.files_read, 1);
     }
+    return;
+
+#ifndef _WIN32
+fail_read:
+    if (f->contents == FILE_ALLOCATED) {
+        free(buf);
+    }
+    f->contents = FILE_SKIPPED;
+#endif
+fail:
+    close(fd);
+}
+
+void search_file_load(const char *file_full_path, loaded_file_t *f) {
+    load_file(file_full_path, f, FALSE, FALSE);
+}
+
+/* Search a file that's been through search_file_load() */
+void search_loaded_file(loaded_file_t *f) {
+    const char *file_full_path = f->path;
+    int matches_count = -1;
 
-    matches_count = search_buf(buf, f_len, file_full_path);
+    if (f->contents != FILE_SKIPPED) {
+        print_init_context();
+    }
 
-cleanup:
+    switch (f->contents) {
+        case FILE_SKIPPED:
+            break;
+        case FILE_EMPTY:
+            if (!opts.index_build) {
+                matches_count = search_buf(NULL, 0, file_full_path);
+            }
+            break;
+        case FILE_STREAM: {
+            if (opts.index_build) {
+                /* Not indexed, so always searched */
+                break;
+            }
+            FILE *fp;
+            log_debug("%s is a named pipe. stream searching", file_full_path);
+            fp = fdopen(f->fd, "r");
+            matches_count = search_stream(fp, file_full_path);
+            fclose(fp);
+            f->fd = -1;
+            break;
+        }
+        case FILE_DIRECT:
+            if (!direct_wait(f)) {
+                log_err("File %s failed to load.", file_full_path);
+                break;
+            }
+            /* FALLTHROUGH */
+        case FILE_MAPPED:
+        case FILE_ALLOCATED:
+        case FILE_BUFFERED:
+        case FILE_POOLED:
+            if (opts.index_build) {
+                index_add_file(file_full_path, f->buf, f->len);
+                break;
+            }
+            if (opts.search_zip_files) {
+                log_debug("check if %s is compressed", file_full_path);
+                ag_compression_type zip_type = is_zipped(f->buf, f->len);
+                if (zip_type != AG_NO_COMPRESSION) {
+                    size_t _buf_len = f->len;
+                    char *_buf = decompress(zip_type, f->buf, f->len, file_full_path, &_buf_len);
+                    if (_buf == NULL || _buf_len == 0) {
+                        log_err("Cannot decompress zipped file %s", file_full_path);
+                        break;
+                    }
+                    matches_count = search_buf(_buf, _buf_len, file_full_path);
+                    free(_buf);
+                    break;
+                }
+            }
+            matches_count = search_buf(f->buf, f->len, file_full_path);
+            break;
+    }
 
     if (opts.print_nonmatching_files && matches_count == 0) {
-        pthread_mutex_lock(&print_mtx);
         print_path(file_full_path, opts.path_sep);
-        pthread_mutex_unlock(&print_mtx);
+        print_flush();
         opts.match_found = 1;
     }
 
     print_cleanup_context();
-    if (buf != NULL) {
+}
+
+/* Unmap or free what search_file_load() loaded */
+void search_file_release(loaded_file_t *f) {
+    int drop = f->cached != -1 && f->fd != -1 &&
+               (f->contents == FILE_MAPPED || f->contents == FILE_ALLOCATED || f->contents == FILE_BUFFERED ||
+                f->contents == FILE_DIRECT);
+
+    if (f->contents == FILE_MAPPED) {
 #ifdef _WIN32
-        UnmapViewOfFile(buf);
+        UnmapViewOfFile(f->buf);
 #else
-#ifdef OS_LINUX
-        if (is_procfile(statbuf) || is_sysfile(statbuf)) {
-            free(buf);
-        } else if (opts.mmap) {
-#else
-        if (opts.mmap) {
-#endif
-            if (buf != MAP_FAILED) {
-                munmap(buf, f_len);
-            }
-        } else {
-            free(buf);
-        }
+        munmap(f->buf, f->len);
 #endif
+    } else if (f->contents == FILE_ALLOCATED) {
+        free(f->buf);
+    } else if (f->contents == FILE_POOLED) {
+        io_pool_release(f->buf);
+    } else if (f->contents == FILE_DIRECT) {
+        direct_release(f);
     }
-    if (fd != -1) {
-        close(fd);
+    f->buf = NULL;
+    if (drop) {
+        /* Now that it's unmapped */
+        drop_from_cache(f);
+    }
+    if (f->fd != -1) {
+        close(f->fd);
+        f->fd = -1;
     }
 }
 
-void *search_file_worker(void *i) {
-    work_queue_t *queue_item;
-    int worker_id = *(int *)i;
+void search_file(const char *file_full_path) {
+    loaded_file_t f;
 
-    log_debug("Worker %i started", worker_id);
-    while (TRUE) {
-        pthread_mutex_lock(&work_queue_mtx);
-        while (work_queue == NULL) {
-            if (done_adding_files) {
-                pthread_mutex_unlock(&work_queue_mtx);
-                log_debug("Worker %i finished.", worker_id);
-                pthread_exit(NULL);
-            }
-            pthread_cond_wait(&files_ready, &work_queue_mtx);
+    load_file(file_full_path, &f, TRUE, TRUE);
+    search_loaded_file(&f);
+    search_file_release(&f);
+}
+
+void search_free_buffer(void) {
+    free(read_buf);
+    read_buf = NULL;
+    read_buf_size = 0;
+    direct_free_buffers();
+    index_free_buffers();
+}
+
+/* Search a batch of files with --direct, starting to read each one before searching the one
+ * before it, so that the reads go on while it's searched */
+static void search_files_ahead(const work_item_t *items, size_t items_len, char **paths, size_t *path_sizes) {
+    loaded_file_t cur, next;
+    prefetch_timer_t timer;
+    size_t j;
+
+    load_file(work_item_path(&items[0], &paths[0], &path_sizes[0]), &next, TRUE, TRUE);
+    for (j = 0; j < items_len; j++) {
+        cur = next;
+        if (j + 1 < items_len) {
+            /* Not into the thread's buffer, which cur might be using */
+            load_file(work_item_path(&items[j + 1], &paths[(j + 1) % 2], &path_sizes[(j + 1) % 2]), &next, FALSE, TRUE);
+        }
+        if (opts.sort_order == SORT_PATH) {
+            print_begin_file(items[j].seq);
         }
-        queue_item = work_queue;
-        work_queue = work_queue->next;
-        if (work_queue == NULL) {
-            work_queue_tail = NULL;
+        prefetch_timer_start(&timer);
+        search_loaded_file(&cur);
+        prefetch_timer_stop(&timer);
+        if (opts.sort_order == SORT_PATH) {
+            print_end_file();
         }
-        pthread_mutex_unlock(&work_queue_mtx);
+        search_file_release(&cur);
+        work_dir_release(items[j].dir);
+    }
+}
 
-        search_file(queue_item->path);
-        free(queue_item->path);
-        free(queue_item);
+void *search_file_worker(void *i) {
+    work_item_t items[WORK_QUEUE_POP_MAX];
+    size_t items_len, j;
+    char *paths[2] = { NULL, NULL };
+    size_t path_sizes[2] = { 0, 0 };
+    const work_queue_worker_t *worker = i;
+    prefetch_timer_t timer;
+
+    log_debug("Worker %i started", worker->id);
+    if (opts.io_threads) {
+        /* The I/O threads have done the loading, so just search */
+        ready_file_t rf;
+        while (io_ready_pop(&rf)) {
+            if (opts.sort_order == SORT_PATH) {
+                print_begin_file(rf.seq);
+            }
+            search_loaded_file(&rf.file);
+            if (opts.sort_order == SORT_PATH) {
+                print_end_file();
+            }
+            search_file_release(&rf.file);
+            free(rf.path);
+        }
+    } else if (opts.direct) {
+        while ((items_len = work_queue_pop(worker, items, WORK_QUEUE_POP_MAX)) > 0) {
+            search_files_ahead(items, items_len, paths, path_sizes);
+        }
+    } else {
+        while ((items_len = work_queue_pop(worker, items, WORK_QUEUE_POP_MAX)) > 0) {
+            for (j = 0; j < items_len; j++) {
+                if (opts.sort_order == SORT_PATH) {
+                    print_begin_file(items[j].seq);
+                }
+                prefetch_timer_start(&timer);
+                search_file(work_item_path(&items[j], &paths[0], &path_sizes[0]));
+                prefetch_timer_stop(&timer);
+                if (opts.sort_order == SORT_PATH) {
+                    print_end_file();
+                }
+                work_dir_release(items[j].dir);
+            }
+        }
     }
+    free(paths[0]);
+    free(paths[1]);
+    print_free_buffer();
+    search_free_buffer();
+    log_debug("Worker %i finished.", worker->id);
+    return NULL;
 }
 
 static int check_symloop_enter(const char *path, dirkey_t *outkey) {
@@ -608,6 +1226,285 @@ static int check_symloop_leave(dirkey_t *dirkey) {
 #endif
 }
 
+/* path_start is the part of path that isn't in base_path
+ * base_path will have a trailing '/' because we put it there in parse_options
+ */
+static const char *get_path_start(const char *base_path, size_t base_path_len, const char *path) {
+    const char *path_start = path;
+    size_t i;
+    for (i = 0; (i < base_path_len) && (path[i]) && (base_path[i] == path[i]); i++) {
+        path_start = path + i + 1;
+    }
+    return path_start;
+}
+
+/* Files searched from the git index, when the rest of the tree is walked for untracked files */
+typedef struct {
+    char *name; /* relative to the path being searched */
+    UT_hash_handle hh;
+} tracked_file_t;
+
+static tracked_file_t *tracked_files = NULL;
+static size_t tracked_root_len = 0;
+
+static int is_tracked_file(const char *file_full_path) {
+    tracked_file_t *found = NULL;
+    char *name;
+
+    if (tracked_files == NULL || strlen(file_full_path) <= tracked_root_len) {
+        return FALSE;
+    }
+    /* uthash doesn't take const keys, but only reads them */
+    name = (char *)(uintptr_t)(file_full_path + tracked_root_len);
+    HASH_FIND_STR(tracked_files, name, found);
+    return found != NULL;
+}
+
+/* Files waiting to be handed to the workers, sorted into --dispatch order first if need be */
+typedef struct {
+    work_item_t item;
+    uint64_t key;
+} pending_file_t;
+
+/* Number of files found so far, which is the next file's place in --sort=path order */
+static size_t files_found = 0;
+static pending_file_t *pending_files = NULL;
+static work_item_t *pending_items = NULL;
+static size_t pending_files_len = 0;
+static size_t pending_files_size = 0;
+/* Set by done_adding_files(). Files found after that (by --watch) are searched right away. */
+static int queue_closed = FALSE;
+
+static int compare_pending_files(const void *a, const void *b) {
+    uint64_t key_a = ((const pending_file_t *)a)->key;
+    uint64_t key_b = ((const pending_file_t *)b)->key;
+    return key_a < key_b ? -1 : key_a > key_b;
+}
+
+#ifdef HAVE_LINUX_FIEMAP_H
+/* Physical location of the start of a file. Files with no extents (empty, or stored inline in
+ * the inode) sort first, which is fine since reading the inode is all it takes to read them. */
+static uint64_t get_physical_offset(const char *path) {
+    struct {
+        struct fiemap fm;
+        struct fiemap_extent extent;
+    } fiemap;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+    memset(&fiemap, 0, sizeof(fiemap));
+    fiemap.fm.fm_length = FIEMAP_MAX_OFFSET;
+    fiemap.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fiemap.fm) != 0 || fiemap.fm.fm_mapped_extents == 0) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    return fiemap.extent.fe_physical;
+}
+#endif
+
+static void flush_pending_files(void) {
+    size_t i;
+
+    if (pending_files_len == 0) {
+        return;
+    }
+
+    if (opts.dispatch_order != DISPATCH_READDIR) {
+        /* Sort by inode even for extents, so the inodes FIEMAP needs are read in order too */
+        qsort(pending_files, pending_files_len, sizeof(pending_file_t), compare_pending_files);
+#ifdef HAVE_LINUX_FIEMAP_H
+        if (opts.dispatch_order == DISPATCH_EXTENT) {
+            char *path = NULL;
+            size_t path_size = 0;
+            for (i = 0; i < pending_files_len; i++) {
+                pending_files[i].key = get_physical_offset(work_item_path(&pending_files[i].item, &path, &path_size));
+            }
+            free(path);
+            qsort(pending_files, pending_files_len, sizeof(pending_file_t), compare_pending_files);
+        }
+#endif
+        log_debug("Dispatching %zu files", pending_files_len);
+    }
+
+    for (i = 0; i < pending_files_len; i++) {
+        pending_items[i] = pending_files[i].item;
+    }
+    work_queue_push(pending_items, pending_files_len);
+    pending_files_len = 0;
+
+    if (opts.sort_order == SORT_PATH && opts.queue_limit) {
+        /* Don't get so far ahead that the output waiting to be printed piles up */
+        print_wait_for_files(files_found, opts.queue_limit);
+    }
+}
+
+void done_adding_files(void) {
+    flush_pending_files();
+    free(pending_files);
+    free(pending_items);
+    pending_files = NULL;
+    pending_items = NULL;
+    pending_files_size = 0;
+    queue_closed = TRUE;
+    work_queue_done();
+}
+
+/* Search a file on this thread, rather than handing it to the workers */
+static void search_file_now(const char *path) {
+    if (opts.sort_order == SORT_PATH) {
+        print_begin_file(files_found++);
+        search_file(path);
+        print_end_file();
+    } else {
+        search_file(path);
+    }
+}
+
+static int compare_dirents(const void *a, const void *b) {
+    return strcmp((*(const struct dirent *const *)a)->d_name, (*(const struct dirent *const *)b)->d_name);
+}
+
+/* Apply the file name filters (-G, -g, file types) to a file found in the directory files is for,
+ * and add it to the work queue if it should be searched */
+static void queue_file(work_dir_t **files, const struct dirent *d, const char *file_full_path,
+                       pcre2_match_data *mdata) {
+    const char *filename = d->d_name;
+    int rc = 0;
+
+    if (is_tracked_file(file_full_path)) {
+        log_debug("Skipping %s: already searched from the git index", file_full_path);
+        return;
+    }
+
+    if (opts.server) {
+        /* Every file, as each search filters the list by its own -G and file types */
+        server_list_file(file_full_path);
+        return;
+    }
+
+    if (opts.file_search_regex || opts.filetype_regex) {
+        bool filename_matched = true;
+        if (opts.filetype_regex) {
+            rc = ag_pcre2_match(opts.filetype_regex, file_full_path, strlen(file_full_path), 0, 0, mdata);
+            if (rc < 0)
+                filename_matched = false;
+        }
+        if (filename_matched && opts.file_search_regex) {
+            const char *file_search_path = opts.file_search_regex_just_filename ? filename : file_full_path;
+            rc = ag_pcre2_match(opts.file_search_regex, file_search_path, strlen(file_search_path), 0, 0, mdata);
+
+            /* XOR between finding a match and inverting that regex. Either but not both means
+             * to continue searching the file */
+            if (rc < 0)
+                filename_matched = !!(opts.invert_file_search_regex);
+            else
+                filename_matched = !(opts.invert_file_search_regex);
+        }
+
+        if (!filename_matched) { /* no match */
+            log_debug("Skipping %s due to file_search_regex.", file_full_path);
+            return;
+        } else if (opts.match_files) {
+            log_debug("match_files: file_search_regex/filetype_regex matched for %s.", file_full_path);
+            if (!opts.file_search_regex_just_filename) {
+                print_path_match(file_full_path, opts.path_sep, pcre2_get_ovector_pointer(mdata));
+            } else {
+                const size_t *m_ovec = pcre2_get_ovector_pointer(mdata);
+                if (m_ovec) {
+                    size_t offset = (*files)->path_len;
+                    size_t ovec[2] = { m_ovec[0] + offset, m_ovec[1] + offset };
+                    print_path_match(file_full_path, opts.path_sep, ovec);
+                } else {
+                    print_path_match(file_full_path, opts.path_sep, NULL);
+                }
+            }
+            print_flush();
+            opts.match_found = 1;
+            return;
+        }
+    }
+
+    if (queue_closed) {
+        search_file_now(file_full_path);
+        return;
+    }
+    if (pending_files == NULL) {
+        pending_files_size = opts.dispatch_order == DISPATCH_READDIR ? WORK_QUEUE_BATCH : opts.dispatch_window;
+        pending_files = ag_malloc(pending_files_size * sizeof(pending_file_t));
+        pending_items = ag_malloc(pending_files_size * sizeof(work_item_t));
+    }
+#ifdef HAVE_DIRENT_DNAMLEN
+    pending_files[pending_files_len].item = work_dir_add(files, filename, d->d_namlen);
+#else
+    pending_files[pending_files_len].item = work_dir_add(files, filename, strlen(filename));
+#endif
+    pending_files[pending_files_len].item.seq = files_found++;
+    pending_files[pending_files_len].key = d->d_ino;
+    pending_files_len++;
+    log_debug("%s added to work queue", file_full_path);
+    if (pending_files_len == pending_files_size) {
+        flush_pending_files();
+    }
+}
+
+/* Queue a file found in the directory at path, or search a directory found there. dir_full_path is
+ * the entry's full path, and files the block the directory's files are queued in. */
+static void search_dir_entry_at(ignores *ig, const char *base_path, const char *path, const struct dirent *dir,
+                                const char *dir_full_path, work_dir_t **files, pcre2_match_data *mdata,
+                                const int depth, dev_t original_dev) {
+#ifndef _WIN32
+    if (opts.one_dev) {
+        struct stat s;
+        if (lstat(dir_full_path, &s) != 0) {
+            log_err("Failed to get device information for %s. Skipping...", dir->d_name);
+            return;
+        }
+        if (s.st_dev != original_dev) {
+            log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
+            return;
+        }
+    }
+#endif
+
+    /* If a link points to a directory then we need to treat it as a directory. */
+    if (!opts.follow_symlinks && is_symlink(path, dir)) {
+        log_debug("File %s ignored becaused it's a symlink", dir->d_name);
+        return;
+    }
+
+    if (!is_directory(path, dir)) {
+        queue_file(files, dir, dir_full_path, mdata);
+    } else if (opts.recurse_dirs) {
+        if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
+            log_debug("Searching dir %s", dir_full_path);
+            ignores *child_ig;
+#ifdef HAVE_DIRENT_DNAMLEN
+            child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
+#else
+            child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
+#endif
+            search_dir(child_ig, base_path, dir_full_path, depth + 1,
+                       original_dev);
+            cleanup_ignore(child_ig);
+        } else {
+            if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
+                /*
+                 * If the user didn't intentionally specify a particular depth,
+                 * this is a warning...
+                 */
+                log_err("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+            } else {
+                /* ... if they did, let's settle for debug. */
+                log_debug("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+            }
+        }
+    }
+}
+
 /* TODO: Append matches to some data structure instead of just printing them out.
  * Then ag can have sweet summaries of matches/files scanned/time/etc.
  */
@@ -618,10 +1515,12 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     scandir_baton_t scandir_baton;
     int results = 0;
     size_t base_path_len = 0;
-    const char *path_start = path;
+    const char *path_start = NULL;
     pcre2_match_data *mdata = NULL;
 
     char *dir_full_path = NULL;
+    size_t path_len, name_len, names_size = 0, max_name_len = 0;
+    work_dir_t *files = NULL;
     const char *ignore_file = NULL;
     int i;
 
@@ -643,13 +1542,8 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
         dir_full_path = NULL;
     }
 
-    /* path_start is the part of path that isn't in base_path
-     * base_path will have a trailing '/' because we put it there in parse_options
-     */
     base_path_len = base_path ? strlen(base_path) : 0;
-    for (i = 0; ((size_t)i < base_path_len) && (path[i]) && (base_path[i] == path[i]); i++) {
-        path_start = path + i + 1;
-    }
+    path_start = get_path_start(base_path, base_path_len, path);
     log_debug("search_dir: path is '%s', base_path is '%s', path_start is '%s'", path, base_path, path_start);
 
     scandir_baton.ig = ig;
@@ -658,6 +1552,9 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     scandir_baton.path_start = path_start;
 
     results = ag_scandir(path, &dir_list, &filename_filter, &scandir_baton);
+    if (opts.watch && results >= 0) {
+        watch_path(ig, base_path, path, TRUE, depth, original_dev);
+    }
     if (results == 0) {
         log_debug("No results found in directory %s", path);
         goto search_dir_cleanup;
@@ -674,138 +1571,512 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
                     opts.print_line_numbers = FALSE;
                 }
             }
-            search_file(path);
+            if (opts.watch && depth == 0) {
+                watch_path(ig, base_path, path, FALSE, depth, original_dev);
+            }
+            if (opts.server) {
+                server_list_file(path);
+            } else {
+                search_file_now(path);
+            }
         } else {
             log_err("Error opening directory %s: %s", path, strerror(errno));
         }
         goto search_dir_cleanup;
     }
 
+    if (opts.sort_order == SORT_PATH) {
+        qsort(dir_list, results, sizeof(struct dirent *), compare_dirents);
+    }
+
     mdata = pcre2_match_data_create(1, NULL);
-    int rc = 0;
-    work_queue_t *queue_item;
+
+    /* Rather than allocating a path for every entry, build each one in the same buffer, and copy
+     * the names of the files to search into one block for the whole directory */
+    for (i = 0; i < results; i++) {
+        name_len = strlen(dir_list[i]->d_name);
+        names_size += name_len + 1;
+        if (name_len > max_name_len) {
+            max_name_len = name_len;
+        }
+    }
+    files = work_dir_new(path, names_size);
+    path_len = strlen(path);
+    dir_full_path = ag_malloc(path_len + max_name_len + 2);
+    memcpy(dir_full_path, path, path_len);
+    dir_full_path[path_len] = '/';
 
     for (i = 0; i < results; i++) {
-        queue_item = NULL;
         dir = dir_list[i];
-        dir_full_path = join_paths(path, dir->d_name);
+        memcpy(dir_full_path + path_len + 1, dir->d_name, strlen(dir->d_name) + 1);
+        search_dir_entry_at(ig, base_path, path, dir, dir_full_path, &files, mdata, depth, original_dev);
+    }
+
+search_dir_cleanup:
+    if (opts.dispatch_order == DISPATCH_READDIR) {
+        /* Hand over each directory's files as a batch */
+        flush_pending_files();
+    }
+    if (files != NULL) {
+        work_dir_release(files);
+    }
+    free(dir_full_path);
+    if (mdata != NULL) {
+        pcre2_match_data_free(mdata);
+    }
+    check_symloop_leave(&current_dirkey);
+    free(dir_list);
+    dir_list = NULL;
+}
+
+typedef struct {
+    const char *rel; /* path relative to the path being searched, not null-terminated */
+    size_t rel_len;  /* length of rel, including its trailing '/' */
+    char *name;
+    char *path;
+    ignores *ig;
+    int depth;
+    int skip;          /* TRUE if this directory is filtered out */
+    work_dir_t *files; /* names of the files queued from this directory, once there are any */
+} index_dir_t;
+
+#ifndef HAVE_DIRENT_DTYPE
+#define DT_DIR 4
+#define DT_REG 8
+#define DT_LNK 10
+#endif
+
+/* Build a struct dirent for an index entry so that the usual filters can be used on it */
+static int fake_dirent(struct dirent *d, const char *name, size_t name_len, unsigned char type, ino_t ino) {
+    if (name_len >= sizeof(d->d_name)) {
+        return FALSE;
+    }
+    memset(d, 0, offsetof(struct dirent, d_name));
+    d->d_ino = ino;
+    memcpy(d->d_name, name, name_len);
+    d->d_name[name_len] = '\0';
+#ifdef HAVE_DIRENT_DTYPE
+    d->d_type = type;
+#else
+    (void)type;
+#endif
+#ifdef HAVE_DIRENT_DNAMLEN
+    d->d_namlen = name_len;
+#endif
+    return TRUE;
+}
+
+static int index_entry_allowed(const index_dir_t *dir, const struct dirent *d, const char *base_path) {
+    scandir_baton_t scandir_baton;
+
+    scandir_baton.ig = dir->ig;
+    scandir_baton.base_path = base_path;
+    scandir_baton.base_path_len = base_path ? strlen(base_path) : 0;
+    scandir_baton.path_start = get_path_start(base_path, scandir_baton.base_path_len, dir->path);
+    return filename_filter(dir->path, d, &scandir_baton);
+}
+
+/* Decide whether to descend into a directory of the index, and set up its ignores if so */
+static void enter_index_dir(index_dir_t *dir, const index_dir_t *parent, const char *base_path, dev_t original_dev,
+                            int load_ignores) {
+    struct dirent d;
+    size_t name_len = dir->rel_len - (parent->rel_len + 1);
+    const char *name = dir->rel + parent->rel_len;
+    char *ignore_path;
+
+    dir->name = NULL;
+    dir->path = NULL;
+    dir->files = NULL;
+    dir->ig = parent->ig;
+    dir->depth = parent->depth + 1;
+    dir->skip = TRUE;
+
+    if (parent->skip || !opts.recurse_dirs) {
+        return;
+    }
+    if (!fake_dirent(&d, name, name_len, DT_DIR, 0) || !index_entry_allowed(parent, &d, base_path)) {
+        return;
+    }
+    dir->path = join_paths(parent->path, d.d_name);
+    if (!(parent->depth < opts.max_search_depth || opts.max_search_depth == -1)) {
+        if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
+            log_err("Skipping %s. Use the --depth option to search deeper.", dir->path);
+        } else {
+            log_debug("Skipping %s. Use the --depth option to search deeper.", dir->path);
+        }
+        return;
+    }
 #ifndef _WIN32
-        if (opts.one_dev) {
-            struct stat s;
-            if (lstat(dir_full_path, &s) != 0) {
-                log_err("Failed to get device information for %s. Skipping...", dir->d_name);
-                goto cleanup;
-            }
-            if (s.st_dev != original_dev) {
-                log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
-                goto cleanup;
-            }
+    if (opts.one_dev) {
+        /* Only directories can be mount points, so there's no need to check every file */
+        struct stat s;
+        if (lstat(dir->path, &s) != 0) {
+            log_err("Failed to get device information for %s. Skipping...", dir->path);
+            return;
+        }
+        if (s.st_dev != original_dev) {
+            log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->path);
+            return;
         }
+    }
+#else
+    (void)original_dev;
 #endif
 
-        /* If a link points to a directory then we need to treat it as a directory. */
-        if (!opts.follow_symlinks && is_symlink(path, dir)) {
-            log_debug("File %s ignored becaused it's a symlink", dir->d_name);
-            goto cleanup;
+    log_debug("Searching dir %s", dir->path);
+    dir->skip = FALSE;
+    dir->name = ag_strdup(d.d_name);
+    dir->ig = init_ignore(parent->ig, dir->name, name_len);
+    if (load_ignores) {
+        /* Tracked files are never ignored by git, so only .ignore applies */
+        ignore_path = join_paths(dir->path, ignore_pattern_files[0]);
+        load_ignore_patterns(dir->ig, ignore_path);
+        free(ignore_path);
+    }
+}
+
+static void leave_index_dir(index_dir_t *dir) {
+    if (dir->name) {
+        cleanup_ignore(dir->ig);
+    }
+    if (dir->files) {
+        work_dir_release(dir->files);
+    }
+    free(dir->name);
+    free(dir->path);
+}
+
+/* Search the files that git tracks under path, using the index instead of reading directories.
+ * Returns FALSE if path isn't in a git work tree, in which case nothing has been searched. */
+int search_git_index(ignores *ig, const char *base_path, const char *path, dev_t original_dev) {
+    git_index_t *index;
+    struct stat st;
+    char *prefix = NULL;
+    size_t prefix_len;
+    index_dir_t *dirs = NULL;
+    size_t dirs_len = 0, dirs_size = 16;
+    tracked_file_t *tracked = NULL;
+    tracked_file_t *tracked_set = NULL;
+    size_t tracked_len = 0;
+    pcre2_match_data *mdata = NULL;
+    char *ignore_path;
+    char *file_path = NULL;
+    size_t file_path_size = 0;
+    size_t i;
+
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return FALSE;
+    }
+    index = git_index_load(base_path);
+    if (index == NULL) {
+        return FALSE;
+    }
+
+    /* Only entries under the path being searched are of interest */
+    prefix = ag_strdup(base_path + strlen(index->work_tree));
+    prefix_len = strlen(prefix);
+    while (prefix_len > 0 && prefix[prefix_len - 1] == '/') {
+        prefix[--prefix_len] = '\0';
+    }
+    if (prefix_len > 0) {
+        memmove(prefix, prefix + 1, prefix_len);
+        prefix[prefix_len - 1] = '/';
+    }
+    log_debug("search_git_index: path is '%s', work tree is '%s', prefix is '%s'", path, index->work_tree, prefix);
+
+    if (opts.git_untracked) {
+        tracked = ag_malloc((index->entries_len + 1) * sizeof(tracked_file_t));
+        tracked_root_len = strlen(path) + 1;
+    }
+
+    ignore_path = join_paths(path, ignore_pattern_files[0]);
+    load_ignore_patterns(ig, ignore_path);
+    free(ignore_path);
+
+    dirs = ag_malloc(dirs_size * sizeof(index_dir_t));
+    memset(dirs, 0, sizeof(index_dir_t));
+    dirs[0].path = ag_strdup(path);
+    dirs[0].ig = ig;
+    dirs_len = 1;
+    mdata = pcre2_match_data_create(1, NULL);
+
+    for (i = 0; i < index->entries_len; i++) {
+        const git_index_entry_t *entry = &index->entries[i];
+        char *rel;
+        const char *name, *slash;
+        index_dir_t *dir;
+        struct dirent d;
+        unsigned char type;
+
+        if (strncmp(entry->name, prefix, prefix_len) != 0) {
+            continue;
         }
+        rel = entry->name + prefix_len;
 
-        if (!is_directory(path, dir)) {
-            if (opts.file_search_regex || opts.filetype_regex) {
-                bool filename_matched = true;
-                if (opts.filetype_regex) {
-                    rc = ag_pcre2_match(opts.filetype_regex, dir_full_path, strlen(dir_full_path), 0, 0, mdata);
-                    if (rc < 0)
-                        filename_matched = false;
-                }
-                if (filename_matched && opts.file_search_regex) {
-                    const char *file_search_path = opts.file_search_regex_just_filename ? dir->d_name : dir_full_path;
-                    rc = ag_pcre2_match(opts.file_search_regex, file_search_path, strlen(file_search_path), 0, 0, mdata);
-
-                    /* XOR between finding a match and inverting that regex. Either but not both means
-                     * to continue searching the file */
-                    if (rc < 0)
-                        filename_matched = !!(opts.invert_file_search_regex);
-                    else
-                        filename_matched = !(opts.invert_file_search_regex);
-                }
+        /* Entries are sorted, so leave the directories this one isn't in... */
+        while (dirs_len > 1 && strncmp(rel, dirs[dirs_len - 1].rel, dirs[dirs_len - 1].rel_len) != 0) {
+            leave_index_dir(&dirs[--dirs_len]);
+        }
+        /* ...and enter the ones it is in */
+        name = rel + dirs[dirs_len - 1].rel_len;
+        while ((slash = strchr(name, '/')) != NULL) {
+            if (dirs_len == dirs_size) {
+                dirs_size *= 2;
+                dirs = ag_realloc(dirs, dirs_size * sizeof(index_dir_t));
+            }
+            dirs[dirs_len].rel = rel;
+            dirs[dirs_len].rel_len = slash - rel + 1;
+            enter_index_dir(&dirs[dirs_len], &dirs[dirs_len - 1], base_path, original_dev, TRUE);
+            dirs_len++;
+            name = slash + 1;
+        }
+        dir = &dirs[dirs_len - 1];
 
-                if (!filename_matched) { /* no match */
-                    log_debug("Skipping %s due to file_search_regex.", dir_full_path);
-                    goto cleanup;
-                } else if (opts.match_files) {
-                    log_debug("match_files: file_search_regex/filetype_regex matched for %s.", dir_full_path);
-                    pthread_mutex_lock(&print_mtx);
-                    if (!opts.file_search_regex_just_filename) {
-                        print_path_match(dir_full_path, opts.path_sep, pcre2_get_ovector_pointer(mdata));
-                    } else {
-                        const size_t *m_ovec = pcre2_get_ovector_pointer(mdata);
-                        if (m_ovec) {
-                            size_t offset = strlen(path) + 1;
-                            size_t ovec[2] = { m_ovec[0] + offset, m_ovec[1] + offset };
-                            print_path_match(dir_full_path, opts.path_sep, ovec);
-                        } else {
-                            print_path_match(dir_full_path, opts.path_sep, NULL);
-                        }
-                    }
-                    pthread_mutex_unlock(&print_mtx);
-                    opts.match_found = 1;
-                    goto cleanup;
+        switch (entry->mode & GIT_INDEX_TYPE_MASK) {
+            case GIT_INDEX_TYPE_GITLINK:
+                /* Submodules have their own index. Leave them to the untracked walk if there is one. */
+                if (opts.git_untracked) {
+                    continue;
                 }
+                type = DT_DIR;
+                break;
+            case GIT_INDEX_TYPE_SYMLINK:
+                type = DT_LNK;
+                break;
+            default:
+                type = DT_REG;
+                break;
+        }
+        if (tracked) {
+            tracked[tracked_len].name = rel;
+            HASH_ADD_KEYPTR(hh, tracked_set, rel, strlen(rel), &tracked[tracked_len]);
+            tracked_len++;
+        }
+        if (dir->skip || !fake_dirent(&d, name, strlen(name), type, entry->ino)) {
+            continue;
+        }
+
+        if (type == DT_LNK && opts.follow_symlinks && is_directory(dir->path, &d)) {
+            type = DT_DIR;
+        }
+        if (type == DT_DIR) {
+            /* Submodules and (with --follow) symlinks to directories get walked as usual */
+            index_dir_t sub;
+            sub.rel = rel;
+            sub.rel_len = strlen(rel) + 1;
+            enter_index_dir(&sub, dir, base_path, original_dev, FALSE);
+            if (!sub.skip) {
+                search_dir(sub.ig, base_path, sub.path, sub.depth, original_dev);
+            }
+            leave_index_dir(&sub);
+        } else if (index_entry_allowed(dir, &d, base_path)) {
+            size_t needed = strlen(dir->path) + strlen(d.d_name) + 2;
+            if (needed > file_path_size) {
+                file_path_size = needed * 2;
+                file_path = ag_realloc(file_path, file_path_size);
+            }
+            snprintf(file_path, file_path_size, "%s/%s", dir->path, d.d_name);
+            if (dir->files == NULL) {
+                dir->files = work_dir_new(dir->path, 1024);
             }
+            queue_file(&dir->files, &d, file_path, mdata);
+        }
+    }
 
-            queue_item = ag_malloc(sizeof(work_queue_t));
-            queue_item->path = dir_full_path;
-            queue_item->next = NULL;
-            pthread_mutex_lock(&work_queue_mtx);
-            if (work_queue_tail == NULL) {
-                work_queue = queue_item;
-            } else {
-                work_queue_tail->next = queue_item;
-            }
-            work_queue_tail = queue_item;
-            pthread_cond_signal(&files_ready);
-            pthread_mutex_unlock(&work_queue_mtx);
-            log_debug("%s added to work queue", dir_full_path);
-        } else if (opts.recurse_dirs) {
-            if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
-                log_debug("Searching dir %s", dir_full_path);
-                ignores *child_ig;
-#ifdef HAVE_DIRENT_DNAMLEN
-                child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
-#else
-                child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
+    while (dirs_len > 1) {
+        leave_index_dir(&dirs[--dirs_len]);
+    }
+    if (dirs[0].files) {
+        work_dir_release(dirs[0].files);
+    }
+    free(dirs[0].path);
+    free(dirs);
+    free(file_path);
+    pcre2_match_data_free(mdata);
+
+    if (tracked) {
+        /* Everything git doesn't know about yet, obeying the usual ignore files */
+        tracked_files = tracked_set;
+        search_dir(ig, base_path, path, 0, original_dev);
+        HASH_CLEAR(hh, tracked_files);
+        free(tracked);
+    }
+
+    git_index_free(index);
+    free(prefix);
+    return TRUE;
+}
+
+/* Queue one path from a --files-from list. files is the directory of the last one, which is kept
+ * for as long as the paths are in the same directory, as they usually are in the output of find. */
+static void queue_listed_file(work_dir_t **files, char *path, char **file_path, size_t *file_path_size,
+                              pcre2_match_data *mdata) {
+    char *slash = strrchr(path, '/');
+    const char *dir_path = ".";
+    size_t dir_len = 1;
+    const char *name = path;
+    struct dirent d;
+    size_t needed;
+
+    if (*path == '\0') {
+        return;
+    }
+    if (slash) {
+        *slash = '\0';
+        dir_path = path;
+        dir_len = slash - path;
+        name = slash + 1;
+    }
+    if (*name == '\0') {
+        log_debug("Skipping %s: not a file", path);
+    } else if (!fake_dirent(&d, name, strlen(name), DT_UNKNOWN, 0)) {
+        log_err("Skipping %s/%s: file name too long", dir_path, name);
+    } else {
+        if (*files && !((*files)->path_len == dir_len + 1 && memcmp((*files)->data, dir_path, dir_len) == 0)) {
+            work_dir_release(*files);
+            *files = NULL;
+        }
+        if (*files == NULL) {
+            *files = work_dir_new(dir_path, 1024);
+        }
+        needed = dir_len + strlen(name) + 2;
+        if (needed > *file_path_size) {
+            *file_path_size = needed * 2;
+            *file_path = ag_realloc(*file_path, *file_path_size);
+        }
+        snprintf(*file_path, *file_path_size, "%s/%s", dir_path, name);
+        queue_file(files, &d, *file_path, mdata);
+    }
+    if (slash) {
+        *slash = '/';
+    }
+}
+
+/* Search the files listed in list_path ("-" for stdin), one per line, or NUL-terminated with -0.
+ * Files are queued as the list is read, and handed to the workers whenever the list is slow to
+ * come, so a slow producer (find, or git ls-files on a big tree) doesn't hold up the search. */
+void search_file_list(const char *list_path) {
+    int fd = strcmp(list_path, "-") == 0 ? STDIN_FILENO : open(list_path, O_RDONLY);
+    char delim = opts.path_sep == '\0' ? '\0' : '\n';
+    size_t buf_size = STREAM_BLOCK_SIZE;
+    size_t buf_len = 0;
+    char *buf;
+    char *file_path = NULL;
+    size_t file_path_size = 0;
+    work_dir_t *files = NULL;
+    pcre2_match_data *mdata;
+
+    if (fd < 0) {
+        log_err("Error opening file list %s: %s", list_path, strerror(errno));
+        return;
+    }
+    buf = ag_malloc(buf_size);
+    mdata = pcre2_match_data_create(1, NULL);
+
+    for (;;) {
+        size_t start = 0;
+        char *end;
+        ssize_t r;
+#ifndef _WIN32
+        struct pollfd pfd;
 #endif
-                search_dir(child_ig, base_path, dir_full_path, depth + 1,
-                           original_dev);
-                cleanup_ignore(child_ig);
-            } else {
-                if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
-                    /*
-                     * If the user didn't intentionally specify a particular depth,
-                     * this is a warning...
-                     */
-                    log_err("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
-                } else {
-                    /* ... if they did, let's settle for debug. */
-                    log_debug("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
-                }
-            }
+
+        while ((end = memchr(buf + start, delim, buf_len - start)) != NULL) {
+            *end = '\0';
+            queue_listed_file(&files, buf + start, &file_path, &file_path_size, mdata);
+            start = end - buf + 1;
+        }
+        buf_len -= start;
+        memmove(buf, buf + start, buf_len);
+        if (buf_len == buf_size) {
+            buf_size *= 2;
+            buf = ag_realloc(buf, buf_size);
         }
 
-    cleanup:
-        free(dir);
-        dir = NULL;
-        if (queue_item == NULL) {
-            free(dir_full_path);
-            dir_full_path = NULL;
+#ifdef _WIN32
+        flush_pending_files();
+#else
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 0) {
+            /* Let the workers get on with what's been listed so far */
+            flush_pending_files();
         }
+#endif
+        r = read(fd, buf + buf_len, buf_size - buf_len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            log_err("Error reading file list %s: %s", list_path, strerror(errno));
+            break;
+        }
+        if (r == 0) {
+            break;
+        }
+        buf_len += r;
+    }
+    if (buf_len > 0) {
+        /* The last one doesn't have to be terminated */
+        buf[buf_len] = '\0';
+        queue_listed_file(&files, buf, &file_path, &file_path_size, mdata);
     }
 
-search_dir_cleanup:
-    if (mdata != NULL) {
-        pcre2_match_data_free(mdata);
+    if (files) {
+        work_dir_release(files);
     }
-    check_symloop_leave(&current_dirkey);
-    free(dir_list);
-    dir_list = NULL;
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    free(buf);
+    free(file_path);
+    pcre2_match_data_free(mdata);
+}
+
+/* Search the files a server has kept in memory, just as if they were read from a list */
+void search_file_paths(char **paths, size_t paths_len) {
+    char *file_path = NULL;
+    size_t file_path_size = 0;
+    work_dir_t *files = NULL;
+    pcre2_match_data *mdata = pcre2_match_data_create(1, NULL);
+    size_t i;
+
+    for (i = 0; i < paths_len; i++) {
+        queue_listed_file(&files, paths[i], &file_path, &file_path_size, mdata);
+    }
+    if (files) {
+        work_dir_release(files);
+    }
+    free(file_path);
+    pcre2_match_data_free(mdata);
+}
+
+/* Search an entry of a directory that has been searched already, after it's changed (--watch) */
+void search_dir_entry(ignores *ig, const char *base_path, const char *path, const char *name, const int depth,
+                      dev_t original_dev) {
+    scandir_baton_t scandir_baton;
+    struct dirent d;
+    char *dir_full_path;
+    work_dir_t *files;
+    pcre2_match_data *mdata;
+
+    if (!fake_dirent(&d, name, strlen(name), DT_UNKNOWN, 0)) {
+        return;
+    }
+    scandir_baton.ig = ig;
+    scandir_baton.base_path = base_path;
+    scandir_baton.base_path_len = base_path ? strlen(base_path) : 0;
+    scandir_baton.path_start = get_path_start(base_path, scandir_baton.base_path_len, path);
+    if (!filename_filter(path, &d, &scandir_baton)) {
+        log_debug("Skipping %s/%s: it's filtered out", path, name);
+        return;
+    }
+
+    dir_full_path = join_paths(path, name);
+    files = work_dir_new(path, strlen(name) + 1);
+    mdata = pcre2_match_data_create(1, NULL);
+    search_dir_entry_at(ig, base_path, path, &d, dir_full_path, &files, mdata, depth, original_dev);
+    work_dir_release(files);
+    pcre2_match_data_free(mdata);
+    free(dir_full_path);
 }
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +23,12 @@
 #include <pthread.h>
 #endif
 
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
 #include "config.h"
 #include "decompress.h"
 #include "ignore.h"
@@ -30,6 +37,7 @@
 #include "print.h"
 #include "uthash.h"
 #include "util.h"
+#include "work_queue.h"
 
 #include <pcre2.h>
 
@@ -37,18 +45,7 @@ extern size_t alpha_skip_lookup[256];
 extern size_t *find_skip_lookup;
 extern uint8_t h_table[H_SIZE] __attribute__((aligned(64)));
 
-struct work_queue_t {
-    char *path;
-    struct work_queue_t *next;
-};
-typedef struct work_queue_t work_queue_t;
-
-extern work_queue_t *work_queue;
-extern work_queue_t *work_queue_tail;
-extern int done_adding_files;
-extern pthread_cond_t files_ready;
 extern pthread_mutex_t stats_mtx;
-extern pthread_mutex_t work_queue_mtx;
 
 #ifdef OS_LINUX
 extern dev_t proc_dev;
@@ -77,8 +74,48 @@ ssize_t search_buf(const char *buf, const size_t buf_len,
 ssize_t search_stream(FILE *stream, const char *path);
 void search_file(const char *file_full_path);
 
+/* search_file() in stages, so that loading files can be done by different threads than searching
+ * them (see io_threads.h) */
+typedef enum {
+    FILE_SKIPPED, /* nothing to search: the reason has been logged */
+    FILE_EMPTY,   /* empty, but a query of '.' with -a still matches it */
+    FILE_STREAM,  /* a named pipe, read as it's searched */
+    FILE_MAPPED,
+    FILE_ALLOCATED,
+    FILE_BUFFERED, /* read into the thread's buffer by search_file() */
+    FILE_POOLED, /* read into one of the I/O threads' buffers with --io-uring */
+    FILE_DIRECT  /* being read with --direct into one of the thread's buffers, see direct_io.h */
+} file_contents_t;
+
+typedef struct {
+    const char *path;
+    file_contents_t contents;
+    int fd;
+    char *buf;
+    off_t len;
+    int cached; /* with --no-cache-pollution: 1 if some of it was in the page cache already, 0 if
+                   not, -1 if the page cache doesn't come into it */
+} loaded_file_t;
+
+void search_file_load(const char *file_full_path, loaded_file_t *f);
+void search_loaded_file(loaded_file_t *f);
+void search_file_release(loaded_file_t *f);
+/* Free the buffer search_file() reads files into on this thread */
+void search_free_buffer(void);
+
 void *search_file_worker(void *i);
 
 void search_dir(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+/* Search the entry name of a directory search_dir() has already been through, for --watch
+ * (and --server, which lists files rather than searching them) */
+void search_dir_entry(ignores *ig, const char *base_path, const char *path, const char *name, const int depth,
+                      dev_t original_dev);
+/* Queue any files still waiting to be queued, and let the workers finish once they run out */
+void done_adding_files(void);
+int search_git_index(ignores *ig, const char *base_path, const char *path, dev_t original_dev);
+/* Search the files listed in list_path, for --files-from */
+void search_file_list(const char *list_path);
+/* Search the files a server has listed (paths relative to where it was started), for --server */
+void search_file_paths(char **paths, size_t paths_len);
 
 #endif
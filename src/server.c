@@ -0,0 +1,637 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#include "ignore.h"
+#include "log.h"
+#include "options.h"
+#include "search.h"
+#include "server.h"
+#include "util.h"
+#include "uthash.h"
+#include "watch.h"
+
+/*
+ * With --server, ag walks its paths once and keeps the list of files it found, along with the
+ * ignores each directory was read with and an inotify watch on it (see watch.c). Files are added
+ * to the list and dropped from it as they come and go, so the list is always what a fresh walk
+ * would find, without having to do one.
+ *
+ * A client (--connect) sends its arguments and working directory over the socket, along with its
+ * stdin, stdout and stderr. For each search, the server brings its list up to date, and then forks
+ * a child that takes on the client's file descriptors and arguments and carries on as if ag had
+ * just been run with them, except that it searches the list rather than walking. That way every
+ * option works just as it would otherwise, output goes straight to wherever the client's would
+ * have, and nothing a search does can leave the server in a different state for the next one.
+ * The server sends the child's exit status back to the client once it's done. Searches are run
+ * one at a time.
+ *
+ * The list is only used for searches with the same paths, working directory and options that
+ * change which files are found (--hidden, --depth, --ignore and so on) as the server. Others are
+ * still run by the server, but walk the usual way.
+ */
+
+/* Longest request a client can send: its working directory and arguments */
+#define SERVER_MAX_REQUEST (1024 * 1024)
+
+#ifndef _WIN32
+typedef struct {
+    char *path;
+    UT_hash_handle hh;
+} listed_t;
+
+static listed_t *listed = NULL;
+/* The last file added, to tell whether the list is still in order */
+static listed_t *last_listed = NULL;
+static int list_sorted = TRUE;
+
+static int listen_fd = -1;
+static const char *socket_path = NULL;
+static char server_cwd[PATH_MAX];
+static char **server_paths = NULL;
+/* The server's own options and ignores, to tell whether a search can use the list */
+static cli_options server_opts;
+static ignores *server_ignores = NULL;
+/* In a child running a search, the client's working directory and arguments */
+static char *client_cwd = NULL;
+static char **client_args = NULL;
+
+/* The order a walk sorted by name finds files in. A directory's files come right after it, before
+ * anything whose name sorts after the directory's, so '/' sorts before every other character. */
+static int compare_listed(const listed_t *a, const listed_t *b) {
+    const unsigned char *p = (const unsigned char *)a->path;
+    const unsigned char *q = (const unsigned char *)b->path;
+
+    while (*p != '\0' && *p == *q) {
+        p++;
+        q++;
+    }
+    return (*p == '/' ? 1 : *p) - (*q == '/' ? 1 : *q);
+}
+
+/* uthash doesn't take const keys, but only reads them */
+static listed_t *find_listed(const char *path) {
+    char *key = (char *)(uintptr_t)path;
+    listed_t *l;
+
+    HASH_FIND_STR(listed, key, l);
+    return l;
+}
+
+void server_list_file(const char *path) {
+    listed_t *l = find_listed(path);
+
+    if (l != NULL) {
+        return;
+    }
+    l = ag_malloc(sizeof(listed_t));
+    l->path = ag_strdup(path);
+    HASH_ADD_KEYPTR(hh, listed, l->path, strlen(l->path), l);
+    if (last_listed && compare_listed(last_listed, l) > 0) {
+        list_sorted = FALSE;
+    }
+    last_listed = l;
+    log_debug("%s listed", path);
+}
+
+static void unlist(listed_t *l) {
+    log_debug("%s unlisted", l->path);
+    if (l == last_listed) {
+        last_listed = l->hh.prev;
+    }
+    HASH_DEL(listed, l);
+    free(l->path);
+    free(l);
+}
+
+void server_unlist(const char *path, int is_dir) {
+    size_t path_len = strlen(path);
+    listed_t *l, *tmp;
+
+    if (!is_dir) {
+        l = find_listed(path);
+        if (l != NULL) {
+            unlist(l);
+        }
+        return;
+    }
+    HASH_ITER(hh, listed, l, tmp) {
+        if (strncmp(l->path, path, path_len) == 0 && (l->path[path_len] == '\0' || l->path[path_len] == '/')) {
+            unlist(l);
+        }
+    }
+}
+
+static void sort_list(void) {
+    if (list_sorted) {
+        return;
+    }
+    HASH_SRT(hh, listed, compare_listed);
+    last_listed = listed ? ELMT_FROM_HH(listed->hh.tbl, listed->hh.tbl->tail) : NULL;
+    list_sorted = TRUE;
+}
+
+int server_list_matches(char **paths) {
+    size_t i;
+
+    if (client_cwd == NULL) {
+        return FALSE;
+    }
+    if (strcmp(client_cwd, server_cwd) != 0) {
+        log_debug("Searching from %s rather than %s. Not using the server's list.", client_cwd, server_cwd);
+        return FALSE;
+    }
+    for (i = 0; paths[i] != NULL && server_paths[i] != NULL; i++) {
+        if (strcmp(paths[i], server_paths[i]) != 0) {
+            break;
+        }
+    }
+    if (paths[i] != NULL || server_paths[i] != NULL) {
+        log_debug("Searching other paths than the server. Not using its list.");
+        return FALSE;
+    }
+    if (opts.search_hidden_files != server_opts.search_hidden_files ||
+        opts.search_all_files != server_opts.search_all_files ||
+        opts.skip_vcs_ignores != server_opts.skip_vcs_ignores ||
+        opts.path_to_ignore != server_opts.path_to_ignore ||
+        opts.follow_symlinks != server_opts.follow_symlinks ||
+        opts.recurse_dirs != server_opts.recurse_dirs ||
+        opts.max_search_depth != server_opts.max_search_depth ||
+        opts.one_dev != server_opts.one_dev ||
+        opts.ackmate_dir_filter || server_opts.ackmate_dir_filter ||
+        !ignores_equal(root_ignores, server_ignores)) {
+        log_debug("The server finds files with different options. Not using its list.");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void server_search_list(void) {
+    char **paths = ag_malloc((HASH_COUNT(listed) + 1) * sizeof(char *));
+    size_t paths_len = 0;
+    listed_t *l;
+
+    for (l = listed; l != NULL; l = l->hh.next) {
+        paths[paths_len++] = l->path;
+    }
+    log_debug("Searching the %zu files on the server's list", paths_len);
+    search_file_paths(paths, paths_len);
+    free(paths);
+}
+
+static void stop_server(int sig) {
+    (void)sig;
+    unlink(socket_path);
+    _exit(0);
+}
+
+static int new_socket(struct sockaddr_un *addr, const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return fd;
+}
+
+/* Bind fd to the socket file, which only the server's user can connect to, as a search can read
+ * any file the server can */
+static int bind_socket(int fd, const struct sockaddr_un *addr) {
+    mode_t old_umask = umask(0177);
+    int rv = bind(fd, (const struct sockaddr *)addr, sizeof(*addr));
+
+    umask(old_umask);
+    return rv;
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un addr;
+    int fd = new_socket(&addr, path);
+
+    if (fd == -1) {
+        die("Can't create a socket: %s", strerror(errno));
+    }
+    if (bind_socket(fd, &addr) == -1) {
+        if (errno != EADDRINUSE) {
+            die("Can't listen on %s: %s", path, strerror(errno));
+        }
+        /* Left behind by a server that's gone, or is there one? */
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            die("There's already a server on %s.", path);
+        }
+        close(fd);
+        unlink(path);
+        fd = new_socket(&addr, path);
+        if (fd == -1 || bind_socket(fd, &addr) == -1) {
+            die("Can't listen on %s: %s", path, strerror(errno));
+        }
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        die("Can't listen on %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+/* Read a client's request: its stdin, stdout and stderr into fds, and then its working directory
+ * and arguments, each NUL-terminated. Returns NULL if the client didn't send them all. */
+static char *read_request(int conn, int fds[3], size_t *len) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    size_t size = 4096;
+    char *buf = ag_malloc(size);
+    int nfds = 0;
+    ssize_t r;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = size - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    /* Padding can leave room for more fds than asked for. Any past the first three are closed
+     * straight away, so that they don't leak into the server. */
+    for (c = CMSG_FIRSTHDR(&msg); r >= 0 && c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int n = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (i = 0; i < n; i++, nfds++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + sizeof(int) * i, sizeof(int));
+                if (nfds < 3) {
+                    fds[nfds] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    if (r <= 0 || nfds != 3 || (msg.msg_flags & MSG_CTRUNC)) {
+        log_err("Got a search without a client's stdin, stdout and stderr. Ignoring it.");
+        for (i = 0; i < nfds && i < 3; i++) {
+            close(fds[i]);
+        }
+        free(buf);
+        return NULL;
+    }
+
+    *len = r;
+    while ((r = read(conn, buf + *len, size - *len - 1)) != 0) {
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 || size > SERVER_MAX_REQUEST) {
+            log_err("Couldn't read a search from a client: %s", r < 0 ? strerror(errno) : "too long");
+            close(fds[0]);
+            close(fds[1]);
+            close(fds[2]);
+            free(buf);
+            return NULL;
+        }
+        *len += r;
+        if (*len == size - 1) {
+            size *= 2;
+            buf = ag_realloc(buf, size);
+        }
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
+/* Whether the client on conn is running as the same user as the server */
+static int same_user(int conn) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        return FALSE;
+    }
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(conn, &uid, &gid) == -1) {
+        return FALSE;
+    }
+    return uid == geteuid();
+#endif
+}
+
+/* Run a search for the client on conn. Returns TRUE in the child that runs it. */
+static int serve(int conn, int *argc, char ***argv) {
+    int fds[3];
+    size_t len;
+    char *request;
+    int args_len = 0;
+    size_t i;
+    pid_t pid;
+    int status;
+    unsigned char rc = 2;
+
+    if (!same_user(conn)) {
+        log_err("Ignoring a search from another user.");
+        close(conn);
+        return FALSE;
+    }
+    request = read_request(conn, fds, &len);
+    if (request == NULL) {
+        close(conn);
+        return FALSE;
+    }
+    watch_read_changes();
+    watch_handle_changes();
+    sort_list();
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        close(listen_fd);
+        close(conn);
+        for (i = 0; i < 3; i++) {
+            if (dup2(fds[i], (int)i) == -1) {
+                _exit(2);
+            }
+            close(fds[i]);
+        }
+        client_cwd = request;
+        if (chdir(client_cwd) == -1) {
+            die("Can't search from %s: %s", client_cwd, strerror(errno));
+        }
+        client_args = ag_malloc((len + 2) * sizeof(char *));
+        client_args[args_len++] = (*argv)[0];
+        for (i = strlen(request) + 1; i < len; i += strlen(request + i) + 1) {
+            client_args[args_len++] = request + i;
+        }
+        client_args[args_len] = NULL;
+        *argc = args_len;
+        *argv = client_args;
+        return TRUE;
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    if (pid == -1) {
+        log_err("Can't run a search: fork() failed: %s", strerror(errno));
+    } else {
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+        rc = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+    }
+    send(conn, &rc, 1, MSG_NOSIGNAL);
+    close(conn);
+    free(request);
+    return FALSE;
+}
+
+void server_run(char **base_paths, char **paths, int *argc, char ***argv) {
+    struct sockaddr_un addr;
+    struct pollfd pfds[2];
+    size_t paths_len = 0;
+    int conn;
+    int rv;
+    int i;
+
+    socket_path = opts.server;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        die("Socket path %s is too long.", socket_path);
+    }
+    if (getcwd(server_cwd, sizeof(server_cwd)) == NULL) {
+        die("Can't get the current directory: %s", strerror(errno));
+    }
+    while (paths[paths_len] != NULL) {
+        paths_len++;
+    }
+    server_paths = ag_malloc((paths_len + 1) * sizeof(char *));
+    for (i = 0; paths[i] != NULL; i++) {
+        server_paths[i] = ag_strdup(paths[i]);
+    }
+    server_paths[paths_len] = NULL;
+    server_opts = opts;
+    server_ignores = root_ignores;
+
+    listen_fd = open_socket(socket_path);
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    watch_init();
+    for (i = 0; paths[i] != NULL; i++) {
+        ignores *ig = init_ignore(root_ignores, "", 0);
+        struct stat s = { .st_dev = 0 };
+        log_debug("Listing the files in %s", paths[i]);
+        symhash = NULL;
+        if (opts.one_dev && lstat(paths[i], &s) == -1) {
+            log_err("Failed to get device information for path %s. Skipping...", paths[i]);
+        }
+        search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
+        cleanup_ignore(ig);
+    }
+    sort_list();
+    log_debug("Listed %u files. Waiting for searches on %s", HASH_COUNT(listed), socket_path);
+
+    for (;;) {
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = watch_get_fd();
+        pfds[1].events = POLLIN;
+        rv = poll(pfds, 2, watch_has_changes() ? WATCH_SETTLE_MS : -1);
+        if (rv == -1 && errno != EINTR) {
+            die("poll() failed: %s", strerror(errno));
+        }
+        if (rv > 0 && (pfds[1].revents & POLLIN)) {
+            watch_read_changes();
+        } else if (rv == 0) {
+            /* Changes have settled. Don't leave them for the next search. */
+            watch_handle_changes();
+        }
+        if (rv > 0 && (pfds[0].revents & POLLIN)) {
+            conn = accept(listen_fd, NULL, NULL);
+            if (conn != -1 && serve(conn, argc, argv)) {
+                return;
+            }
+        }
+    }
+}
+
+void server_cleanup(void) {
+    free(client_args);
+    free(client_cwd);
+    client_args = NULL;
+    client_cwd = NULL;
+}
+
+/* Send the client's request (see read_request()). Returns how much of it was sent. */
+static size_t send_request(int fd, char *buf, size_t len) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    ssize_t sent;
+    size_t done;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return 0;
+    }
+    for (done = sent; done < len; done += sent) {
+        sent = send(fd, buf + done, len - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            sent = 0;
+        } else if (sent < 0) {
+            return done;
+        }
+    }
+    return shutdown(fd, SHUT_WR) == 0 ? len : 0;
+}
+
+int server_client(int argc, char **argv) {
+    struct sockaddr_un addr;
+    const char *path = NULL;
+    char cwd[PATH_MAX];
+    char *buf;
+    size_t len, size, sent;
+    int skip = 0, skip_len = 0;
+    unsigned char rc;
+    ssize_t r;
+    int fd;
+    int i;
+
+    for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strncmp(argv[i], "--connect=", 10) == 0) {
+            path = argv[i] + 10;
+            skip_len = 1;
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            path = argv[i + 1];
+            skip_len = 2;
+        } else {
+            continue;
+        }
+        skip = i;
+        break;
+    }
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path) || getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+    fd = new_socket(&addr, path);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        /* No server. Search without one. */
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    len = strlen(cwd) + 1;
+    size = len;
+    for (i = 1; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+    buf = ag_malloc(size);
+    memcpy(buf, cwd, len);
+    for (i = 1; i < argc; i++) {
+        if (i < skip || i >= skip + skip_len) {
+            size_t arg_len = strlen(argv[i]) + 1;
+            memcpy(buf + len, argv[i], arg_len);
+            len += arg_len;
+        }
+    }
+    sent = send_request(fd, buf, len);
+    free(buf);
+    if (sent < len) {
+        close(fd);
+        if (sent == 0) {
+            /* The server didn't get any of it */
+            return -1;
+        }
+        log_err("Couldn't send the search to the server on %s: %s", path, strerror(errno));
+        return 2;
+    }
+
+    while ((r = read(fd, &rc, 1)) == -1 && errno == EINTR) {
+    }
+    close(fd);
+    if (r != 1) {
+        log_err("The server on %s went away before the search was done.", path);
+        return 2;
+    }
+    return rc;
+}
+
+#else
+/* No Unix sockets here */
+void server_run(char **base_paths, char **paths, int *argc, char ***argv) {
+    (void)base_paths;
+    (void)paths;
+    (void)argc;
+    (void)argv;
+    die("--server isn't supported on this platform.");
+}
+
+void server_list_file(const char *path) {
+    (void)path;
+}
+
+void server_unlist(const char *path, int is_dir) {
+    (void)path;
+    (void)is_dir;
+}
+
+int server_list_matches(char **paths) {
+    (void)paths;
+    return FALSE;
+}
+
+void server_search_list(void) {
+}
+
+void server_cleanup(void) {
+}
+
+int server_client(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    return -1;
+}
+#endif
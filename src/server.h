@@ -0,0 +1,25 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Run as a server (--server): walk paths, list the files found and keep the list up to date as
+ * things change, and run searches for clients that connect to the socket. Only returns in a child
+ * process for each search, with its stdin, stdout and stderr set to the client's, and argc and
+ * argv set to the client's arguments. */
+void server_run(char **base_paths, char **paths, int *argc, char ***argv);
+/* Add a file the walk has found to the list */
+void server_list_file(const char *path);
+/* Drop path from the list, and with is_dir, everything under it */
+void server_unlist(const char *path, int is_dir);
+/* Whether the server's list has all the files (and only the files) a search of paths with the
+ * options it was given would find, in a child process server_run() has returned in */
+int server_list_matches(char **paths);
+/* Search the files on the server's list */
+void server_search_list(void);
+/* Free the arguments server_run() returned with, once they're no longer needed */
+void server_cleanup(void);
+
+/* If argv has --connect, have the server on that socket run the search. Returns its exit status,
+ * or -1 to search here (there's no --connect, or no server). */
+int server_client(int argc, char **argv);
+
+#endif
@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "util.h"
+
+#ifdef USE_IO_URING
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Check that the kernel knows about all of ops. Old kernels have io_uring but not, say, statx. */
+static int check_ops(uring_t *ring, const int *ops, size_t ops_len) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = ag_calloc(1, probe_size);
+    size_t i;
+    int rv = 0;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        rv = errno;
+    } else {
+        for (i = 0; i < ops_len; i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                rv = EOPNOTSUPP;
+                break;
+            }
+        }
+    }
+    free(probe);
+    return rv;
+}
+
+int uring_init(uring_t *ring, unsigned entries, const int *ops, size_t ops_len) {
+    struct io_uring_params p;
+    int rv;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        return errno;
+    }
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)(void *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(void *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(void *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(void *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)(void *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(void *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(void *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(void *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+    rv = check_ops(ring, ops, ops_len);
+    if (rv != 0) {
+        uring_free(ring);
+        return rv;
+    }
+    return 0;
+
+fail:
+    rv = errno;
+    uring_free(ring);
+    return rv;
+}
+
+void uring_free(uring_t *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int uring_register_buffers(uring_t *ring, void *base, size_t buf_size, unsigned count) {
+    struct iovec *iovs = ag_malloc(count * sizeof(struct iovec));
+    unsigned i;
+    int rv;
+
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = (char *)base + i * buf_size;
+        iovs[i].iov_len = buf_size;
+    }
+    rv = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, count);
+    free(iovs);
+    return rv < 0 ? errno : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->to_submit;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= ring->entries) {
+        return NULL;
+    }
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+    unsigned submitted;
+    int rv;
+
+    /* Publish the new entries before the kernel looks at the tail */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+    submitted = ring->to_submit;
+    ring->to_submit = 0;
+    for (;;) {
+        rv = sys_io_uring_enter(ring->fd, submitted, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (rv >= 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            /* Interrupted while waiting. The entries were already submitted. */
+            submitted = 0;
+        } else if (errno != EAGAIN) {
+            /* EAGAIN means the kernel couldn't take the entries just now. Anything else won't
+             * get better by trying again. */
+            break;
+        }
+    }
+    return rv < 0 ? -errno : rv;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STRUCT_STATX_STX_SIZE)
+#define USE_IO_URING
+#endif
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* Just enough of io_uring to batch up opens, statx and reads, talking to the kernel directly so
+ * there's no need for liburing */
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned to_submit;
+    /* Submission ring */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Completion ring */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+/* Returns 0, or an errno value if io_uring can't be used (not supported, disabled, or lacking one
+ * of the operations in ops) */
+int uring_init(uring_t *ring, unsigned entries, const int *ops, size_t ops_len);
+void uring_free(uring_t *ring);
+/* Register buffers for IORING_OP_READ_FIXED */
+int uring_register_buffers(uring_t *ring, void *base, size_t buf_size, unsigned count);
+/* A cleared submission queue entry, or NULL if the ring is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+/* Submit what's been queued and wait for at least wait_nr completions. Returns a negative errno
+ * value if the ring has stopped working. */
+int uring_submit(uring_t *ring, unsigned wait_nr);
+/* The next completion, or NULL if there isn't one yet. Call uring_cqe_seen() when done with it. */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+#endif
+
+#endif
@@ -1,9 +1,12 @@
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "util.h"
@@ -589,6 +592,53 @@ char *join_paths(const char *a, const char *b) {
     return buf;
 }
 
+/*
+ * Read a whole file into a malloc'd buffer with as few read() calls as possible.
+ * The buffer is always one byte longer than *len_out so callers can null-terminate it.
+ * Returns NULL (with errno set) if the file can't be opened or read.
+ */
+char *read_file(const char *path, size_t *len_out) {
+    struct stat statbuf;
+    size_t buf_size = 4096;
+    size_t len = 0;
+    char *buf;
+    ssize_t r;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size > 0) {
+        /* room for the whole file, the null, and one more byte so we see EOF without a realloc */
+        buf_size = (size_t)statbuf.st_size + 2;
+    }
+
+    buf = ag_malloc(buf_size);
+    while ((r = read(fd, buf + len, buf_size - len - 1)) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved_errno = errno;
+            free(buf);
+            close(fd);
+            errno = saved_errno;
+            return NULL;
+        }
+        len += r;
+        if (len == buf_size - 1) {
+            buf_size *= 2;
+            buf = ag_realloc(buf, buf_size);
+        }
+    }
+    close(fd);
+
+    buf[len] = '\0';
+    *len_out = len;
+    return buf;
+}
+
 void ag_asprintf(char **ret, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -64,6 +64,15 @@ extern FILE *out_fd;
 #endif
 #undef GCC_VERSION
 
+/* Nanoseconds part of a struct stat's mtime, where the platform has it */
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+#define STAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+#define STAT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) 0
+#endif
+
 void *ag_malloc(size_t size);
 void *ag_realloc(void *ptr, size_t size);
 void *ag_calloc(size_t nelem, size_t elsize);
@@ -80,6 +89,16 @@ typedef struct {
     size_t total_files;
     size_t total_matches;
     size_t total_file_matches;
+    size_t files_read;   /* loaded with read() */
+    size_t files_mapped; /* loaded with mmap() */
+    size_t cache_bytes_read;     /* from files, with --no-cache-pollution */
+    size_t cache_bytes_retained; /* of those, still in the page cache afterwards */
+    size_t files_populated;      /* with --populate-min */
+    size_t faults_avoided;       /* by populating them */
+    size_t direct_bytes;         /* read with O_DIRECT */
+    size_t files_indexed;        /* with --index-build */
+    size_t files_index_skipped;  /* with --index, as they can't match */
+    size_t files_index_stale;    /* that the index has, but have changed since */
     struct timeval time_start;
     struct timeval time_end;
 } ag_stats;
@@ -145,6 +164,7 @@ int is_symlink(const char *path, const struct dirent *d);
 int is_named_pipe(const char *path, const struct dirent *d);
 
 char *join_paths(const char *a, const char *b);
+char *read_file(const char *path, size_t *len_out);
 
 void die(const char *fmt, ...) FORMAT_PRINTF(1, 2) NORETURN;
 
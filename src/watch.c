@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "log.h"
+#include "options.h"
+#include "print.h"
+#include "search.h"
+#include "server.h"
+#include "util.h"
+#include "uthash.h"
+#include "watch.h"
+
+/*
+ * With --watch, ag doesn't exit after searching. Every directory search_dir() reads gets an
+ * inotify watch, which keeps the ignores the directory was searched with, so that whatever
+ * changes in it can be filtered and searched just as it would have been on a fresh run:
+ *
+ * - A file that's written and closed, or moved into the directory, is searched again.
+ * - A new directory is walked (and watched) like any other.
+ * - A file given on the command line is searched again (all of it) whenever it's written to,
+ *   even if it's still open.
+ *
+ * Changes are gathered until they stop coming for WATCH_SETTLE_MS, so that a file written in
+ * several goes is only searched once, and then searched on the main thread: the workers are gone
+ * by then, and there's rarely enough to search to make it worth bringing them back.
+ *
+ * Changes to ignore files aren't picked up. Neither are files that change while the first search
+ * is still going: only what changes after a directory has been read is.
+ *
+ * A server (--server) watches the same way, but lists what's found for later searches rather than
+ * searching it, and also has to hear about files that are deleted or moved away, to unlist them.
+ */
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define WATCH_DIR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define WATCH_SERVER_EVENTS (WATCH_DIR_EVENTS | IN_DELETE | IN_MOVED_FROM)
+#define WATCH_FILE_EVENTS (IN_CLOSE_WRITE | IN_MODIFY)
+
+typedef struct {
+    int wd;
+    int is_dir;
+    char *path;
+    const char *base_path;
+    ignores *ig;
+    int depth;
+    dev_t original_dev;
+    UT_hash_handle hh;
+} watched_t;
+
+/* Something that has changed, waiting to be searched */
+typedef struct {
+    char *key; /* wd and name, to only search it once */
+    int wd;
+    char *name; /* in the watched directory, or NULL for the watched file itself */
+    int is_dir; /* it was (or is) a directory */
+    UT_hash_handle hh;
+} change_t;
+
+static int watch_fd = -1;
+static watched_t *watched = NULL;
+static change_t *changes = NULL;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void free_watched(watched_t *w) {
+    cleanup_ignore(w->ig);
+    free(w->path);
+    free(w);
+}
+
+void watch_init(void) {
+    watch_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch_fd == -1) {
+        die("Can't watch for changes: %s", strerror(errno));
+    }
+}
+
+void watch_path(ignores *ig, const char *base_path, const char *path, int is_dir, int depth, dev_t original_dev) {
+    static int out_of_watches = FALSE;
+    watched_t *w;
+    int wd;
+
+    if (!is_dir) {
+        wd = inotify_add_watch(watch_fd, path, WATCH_FILE_EVENTS);
+    } else {
+        wd = inotify_add_watch(watch_fd, path, opts.server ? WATCH_SERVER_EVENTS : WATCH_DIR_EVENTS);
+    }
+    if (wd == -1) {
+        if (errno != ENOSPC) {
+            log_err("Can't watch %s for changes: %s", path, strerror(errno));
+        } else if (!out_of_watches) {
+            log_err("Can't watch %s or any more directories for changes. "
+                    "Raise /proc/sys/fs/inotify/max_user_watches to watch them all.",
+                    path);
+            out_of_watches = TRUE;
+        }
+        return;
+    }
+
+    ig->refs++;
+    HASH_FIND_INT(watched, &wd, w);
+    if (w == NULL) {
+        w = ag_calloc(1, sizeof(watched_t));
+        w->wd = wd;
+        w->ig = ig;
+        w->path = ag_strdup(path);
+        HASH_ADD_INT(watched, wd, w);
+    } else {
+        /* Searched again, maybe from somewhere else if it was moved. (So ig and path can be the
+         * watch's own.) */
+        if (strcmp(path, w->path) != 0) {
+            log_debug("%s moved to %s", w->path, path);
+            free(w->path);
+            w->path = ag_strdup(path);
+        }
+        cleanup_ignore(w->ig);
+        w->ig = ig;
+    }
+    w->is_dir = is_dir;
+    w->base_path = base_path;
+    w->depth = depth;
+    w->original_dev = original_dev;
+    log_debug("Watching %s", path);
+}
+
+static void add_change(int wd, const char *name, int is_dir) {
+    change_t *c;
+    char *key;
+
+    ag_asprintf(&key, "%d/%s", wd, name ? name : "");
+    HASH_FIND_STR(changes, key, c);
+    if (c != NULL) {
+        c->is_dir |= is_dir;
+        free(key);
+        return;
+    }
+    c = ag_malloc(sizeof(change_t));
+    c->key = key;
+    c->wd = wd;
+    c->name = name ? ag_strdup(name) : NULL;
+    c->is_dir = is_dir;
+    HASH_ADD_KEYPTR(hh, changes, c->key, strlen(c->key), c);
+}
+
+/* Stop watching path and everything under it, which has been deleted or moved away */
+static void unwatch(const char *path) {
+    size_t path_len = strlen(path);
+    watched_t *w, *tmp;
+
+    HASH_ITER(hh, watched, w, tmp) {
+        if (strncmp(w->path, path, path_len) == 0 && (w->path[path_len] == '\0' || w->path[path_len] == '/')) {
+            log_debug("No longer watching %s", w->path);
+            inotify_rm_watch(watch_fd, w->wd);
+            HASH_DEL(watched, w);
+            free_watched(w);
+        }
+    }
+}
+
+int watch_get_fd(void) {
+    return watch_fd;
+}
+
+static void read_events(const char *buf, ssize_t len) {
+    const struct inotify_event *ev;
+    const char *p;
+    watched_t *w;
+    int wd;
+
+    for (p = buf; p < buf + len;) {
+        ev = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+        if (ev->mask & IN_Q_OVERFLOW) {
+            log_err("Too many changes at once. Some of them weren't searched.");
+            continue;
+        }
+        wd = ev->wd;
+        HASH_FIND_INT(watched, &wd, w);
+        if (w == NULL) {
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) {
+            /* Deleted, or on a filesystem that's been unmounted */
+            log_debug("No longer watching %s", w->path);
+            HASH_DEL(watched, w);
+            free_watched(w);
+        } else if (!w->is_dir) {
+            add_change(w->wd, NULL, FALSE);
+        } else if (ev->len > 0 && (opts.server || !(ev->mask & IN_CREATE) || (ev->mask & IN_ISDIR))) {
+            /* New files are searched once they've been written and closed (but listed right away) */
+            log_debug("%s/%s changed", w->path, ev->name);
+            add_change(w->wd, ev->name, !!(ev->mask & IN_ISDIR));
+        }
+    }
+}
+
+void watch_read_changes(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    for (;;) {
+        len = read(watch_fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            if (len < 0 && errno != EAGAIN) {
+                die("Error reading inotify events: %s", strerror(errno));
+            }
+            return;
+        }
+        read_events(buf, len);
+    }
+}
+
+int watch_has_changes(void) {
+    return changes != NULL;
+}
+
+/* Unlist whatever is gone from the directory w is watching, and list what's new */
+static void list_change(watched_t *w, const change_t *c) {
+    char *path = join_paths(w->path, c->name);
+    struct stat s;
+    int exists = lstat(path, &s) == 0;
+
+    if (!exists || c->is_dir) {
+        /* Whatever was under a directory that's been moved in goes too: it's listed again below */
+        server_unlist(path, c->is_dir);
+    }
+    if (c->is_dir) {
+        unwatch(path);
+    }
+    if (exists) {
+        search_dir_entry(w->ig, w->base_path, w->path, c->name, w->depth, w->original_dev);
+    }
+    free(path);
+}
+
+void watch_handle_changes(void) {
+    change_t *c, *tmp;
+    watched_t *w;
+
+    HASH_ITER(hh, changes, c, tmp) {
+        HASH_FIND_INT(watched, &c->wd, w);
+        if (w == NULL) {
+            /* It's gone since */
+        } else if (c->name && opts.server) {
+            list_change(w, c);
+        } else if (c->name) {
+            search_dir_entry(w->ig, w->base_path, w->path, c->name, w->depth, w->original_dev);
+        } else {
+            search_dir(w->ig, w->base_path, w->path, w->depth, w->original_dev);
+        }
+        HASH_DEL(changes, c);
+        free(c->key);
+        free(c->name);
+        free(c);
+    }
+    if (!opts.server) {
+        print_flush();
+        fflush(out_fd);
+    }
+}
+
+void watch_run(void) {
+    struct pollfd pfd;
+    long long first_change = 0;
+    int timeout;
+
+    fflush(out_fd);
+    while (watched != NULL) {
+        timeout = -1;
+        if (changes != NULL) {
+            timeout = WATCH_MAX_DELAY_MS - (int)(now_ms() - first_change);
+            if (timeout > WATCH_SETTLE_MS) {
+                timeout = WATCH_SETTLE_MS;
+            }
+            if (timeout < 0) {
+                timeout = 0;
+            }
+        }
+        pfd.fd = watch_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) > 0) {
+            if (changes == NULL) {
+                first_change = now_ms();
+            }
+            watch_read_changes();
+            if (changes == NULL || now_ms() - first_change < WATCH_MAX_DELAY_MS) {
+                continue;
+            }
+        }
+        if (changes != NULL) {
+            watch_handle_changes();
+        }
+    }
+    log_debug("Nothing left to watch");
+}
+
+void watch_cleanup(void) {
+    watched_t *w, *tmp;
+
+    HASH_ITER(hh, watched, w, tmp) {
+        HASH_DEL(watched, w);
+        free_watched(w);
+    }
+    if (watch_fd != -1) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+
+#else
+/* No inotify here */
+void watch_init(void) {
+    die("Watching for changes isn't supported on this platform.");
+}
+
+void watch_path(ignores *ig, const char *base_path, const char *path, int is_dir, int depth, dev_t original_dev) {
+    (void)ig;
+    (void)base_path;
+    (void)path;
+    (void)is_dir;
+    (void)depth;
+    (void)original_dev;
+}
+
+int watch_get_fd(void) {
+    return -1;
+}
+
+void watch_read_changes(void) {
+}
+
+int watch_has_changes(void) {
+    return FALSE;
+}
+
+void watch_handle_changes(void) {
+}
+
+void watch_run(void) {
+}
+
+void watch_cleanup(void) {
+}
+#endif
@@ -0,0 +1,32 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <sys/types.h>
+
+#include "ignore.h"
+
+/* Wait this long for changes to stop coming before searching what's changed */
+#define WATCH_SETTLE_MS 100
+/* But don't put off searching a file that keeps changing for longer than this */
+#define WATCH_MAX_DELAY_MS 1000
+
+/* Set up for --watch, before the search starts. Dies if changes can't be watched for. */
+void watch_init(void);
+/* Watch path, a directory search_dir() has read or (if not is_dir) a file it was given to search.
+ * The watch holds a reference to ig, the ignores path was searched with, for searching what
+ * changes in it. */
+void watch_path(ignores *ig, const char *base_path, const char *path, int is_dir, int depth, dev_t original_dev);
+/* The inotify file descriptor, to wait for changes along with other things (--server) */
+int watch_get_fd(void);
+/* Read the changes that have come in so far, without waiting for more */
+void watch_read_changes(void);
+/* Whether there are changes that haven't been handled yet */
+int watch_has_changes(void);
+/* Search what's changed, or with --server, list and unlist it */
+void watch_handle_changes(void);
+/* Search files as they're written, created or moved into the watched directories, and the
+ * watched files as they're written, until there's nothing left to watch */
+void watch_run(void);
+void watch_cleanup(void);
+
+#endif
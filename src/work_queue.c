@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "log.h"
+#include "util.h"
+#include "work_queue.h"
+
+/*
+ * Queue of files between the walker and the workers.
+ *
+ * Items live in a ring buffer that grows as needed, so queueing a file doesn't need an
+ * allocation of its own. The walker pushes files in batches (a directory's worth at a time) and
+ * workers take several files per pop, so the mutex is taken a handful of times per directory
+ * rather than twice per file. Workers only get signaled when some of them are actually waiting.
+ *
+ * The queue is bounded so that a walker that's much faster than the workers doesn't pile up
+ * millions of paths in memory: once it holds queue_limit files, pushes block until the workers
+ * have worked it down to half that.
+ *
+ * Only the first workers_len workers take files. The rest are parked until workers_len goes up
+ * again, or until all the files have been queued, at which point they help finish off.
+ *
+ * On a machine with several NUMA nodes, the queue is split into a shard per node, and workers
+ * pinned to a node take files from its shard first. The queue is hash-sharded: a directory's
+ * files go to the shard picked by a hash of its path, not by where the files or their cached
+ * pages are. That keeps a directory's files together on one node's workers, and spreads the
+ * directories evenly over the nodes. A worker whose shard is empty takes files from the fullest
+ * one rather than waiting. The shards share one mutex; it's taken rarely enough that splitting it
+ * too wouldn't buy much.
+ *
+ * With --prefetch, the prefetcher walks along the front of each shard, a limited distance ahead
+ * of the workers. Each shard counts how many of its first files have been handed to the
+ * prefetcher already.
+ */
+
+typedef struct {
+    work_item_t *ring;
+    size_t size;
+    size_t head;
+    size_t len;
+    size_t prefetched; /* files at the front that have been handed to the prefetcher */
+} shard_t;
+
+static shard_t *shards = NULL;
+static int shards_len = 0;
+static size_t ring_len = 0; /* files in all the shards */
+static size_t queue_limit = 0;
+static int workers_len = 1;
+static int idle_workers = 0;
+static size_t popped = 0;
+static int walker_waiting = FALSE;
+static int prefetcher_waiting = FALSE;
+static int done_adding_files = FALSE;
+
+static pthread_mutex_t work_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t files_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_drained = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workers_unparked = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefetch_wanted = PTHREAD_COND_INITIALIZER;
+
+work_dir_t *work_dir_new(const char *path, size_t names_size) {
+    size_t path_len = strlen(path);
+    work_dir_t *dir = ag_malloc(sizeof(work_dir_t) + path_len + 1 + names_size);
+    size_t i;
+
+    dir->refs = 1;
+    dir->hash = 2166136261u;
+    for (i = 0; i < path_len; i++) {
+        dir->hash = (dir->hash ^ (unsigned char)path[i]) * 16777619u;
+    }
+    memcpy(dir->data, path, path_len);
+    dir->data[path_len] = '/';
+    dir->path_len = path_len + 1;
+    dir->len = dir->path_len;
+    dir->size = dir->path_len + names_size;
+    return dir;
+}
+
+work_item_t work_dir_add(work_dir_t **dir, const char *name, size_t name_len) {
+    work_dir_t *d = *dir;
+    work_item_t item;
+
+    if (d->len + name_len + 1 > d->size) {
+        /* Files already queued point into the old block, so it can't be moved. Start a new one. */
+        size_t names_size = d->size - d->path_len;
+        work_dir_t *next = ag_malloc(sizeof(work_dir_t) + d->path_len + names_size * 2 + name_len + 1);
+        next->refs = 1;
+        next->hash = d->hash;
+        memcpy(next->data, d->data, d->path_len);
+        next->path_len = next->len = d->path_len;
+        next->size = d->path_len + names_size * 2 + name_len + 1;
+        work_dir_release(d);
+        *dir = d = next;
+    }
+    memcpy(d->data + d->len, name, name_len);
+    d->data[d->len + name_len] = '\0';
+    item.dir = d;
+    item.name = d->len;
+    item.seq = 0;
+    d->len += name_len + 1;
+    __sync_add_and_fetch(&d->refs, 1);
+    return item;
+}
+
+void work_dir_release(work_dir_t *dir) {
+    if (__sync_sub_and_fetch(&dir->refs, 1) == 0) {
+        free(dir);
+    }
+}
+
+const char *work_item_path(const work_item_t *item, char **buf, size_t *buf_size) {
+    const work_dir_t *dir = item->dir;
+    size_t name_len = strlen(dir->data + item->name);
+
+    if (dir->path_len + name_len + 1 > *buf_size) {
+        *buf_size = dir->path_len + name_len + 1;
+        *buf = ag_realloc(*buf, *buf_size);
+    }
+    memcpy(*buf, dir->data, dir->path_len);
+    memcpy(*buf + dir->path_len, dir->data + item->name, name_len + 1);
+    return *buf;
+}
+
+void work_queue_init(int workers, size_t limit, int shards_wanted) {
+    int i;
+
+    if (pthread_cond_init(&files_ready, NULL)) {
+        die("pthread_cond_init failed!");
+    }
+    if (pthread_cond_init(&queue_drained, NULL)) {
+        die("pthread_cond_init failed!");
+    }
+    if (pthread_cond_init(&workers_unparked, NULL)) {
+        die("pthread_cond_init failed!");
+    }
+    if (pthread_cond_init(&prefetch_wanted, NULL)) {
+        die("pthread_cond_init failed!");
+    }
+    if (pthread_mutex_init(&work_queue_mtx, NULL)) {
+        die("pthread_mutex_init failed!");
+    }
+    workers_len = workers > 0 ? workers : 1;
+    queue_limit = limit;
+    walker_waiting = FALSE;
+    shards_len = shards_wanted > 0 ? shards_wanted : 1;
+    shards = ag_calloc(shards_len, sizeof(shard_t));
+    for (i = 0; i < shards_len; i++) {
+        shards[i].size = 1024;
+        shards[i].ring = ag_malloc(shards[i].size * sizeof(work_item_t));
+    }
+    if (shards_len > 1) {
+        log_debug("Work queue split into %i shards", shards_len);
+    }
+    ring_len = 0;
+    idle_workers = 0;
+    popped = 0;
+    done_adding_files = FALSE;
+}
+
+void work_queue_cleanup(void) {
+    size_t i;
+    int s;
+    for (s = 0; s < shards_len; s++) {
+        shard_t *shard = &shards[s];
+        for (i = 0; i < shard->len; i++) {
+            work_dir_release(shard->ring[(shard->head + i) % shard->size].dir);
+        }
+        free(shard->ring);
+    }
+    free(shards);
+    shards = NULL;
+    shards_len = 0;
+    ring_len = 0;
+    pthread_cond_destroy(&files_ready);
+    pthread_cond_destroy(&queue_drained);
+    pthread_cond_destroy(&workers_unparked);
+    pthread_cond_destroy(&prefetch_wanted);
+    pthread_mutex_destroy(&work_queue_mtx);
+}
+
+static void grow_ring(shard_t *shard, size_t needed) {
+    size_t new_size = shard->size;
+    work_item_t *new_ring;
+    size_t first;
+
+    while (new_size < needed) {
+        new_size *= 2;
+    }
+    new_ring = ag_malloc(new_size * sizeof(work_item_t));
+    /* Unwrap into the start of the new ring */
+    first = shard->size - shard->head < shard->len ? shard->size - shard->head : shard->len;
+    memcpy(new_ring, shard->ring + shard->head, first * sizeof(work_item_t));
+    memcpy(new_ring + first, shard->ring, (shard->len - first) * sizeof(work_item_t));
+    free(shard->ring);
+    shard->ring = new_ring;
+    shard->size = new_size;
+    shard->head = 0;
+}
+
+static void shard_push(shard_t *shard, const work_item_t *items, size_t items_len) {
+    size_t tail, first;
+
+    if (shard->len + items_len > shard->size) {
+        grow_ring(shard, shard->len + items_len);
+    }
+    tail = (shard->head + shard->len) % shard->size;
+    first = shard->size - tail < items_len ? shard->size - tail : items_len;
+    memcpy(shard->ring + tail, items, first * sizeof(work_item_t));
+    memcpy(shard->ring, items + first, (items_len - first) * sizeof(work_item_t));
+    shard->len += items_len;
+}
+
+void work_queue_push(const work_item_t *items, size_t items_len) {
+    size_t i, run;
+
+    if (items_len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&work_queue_mtx);
+    if (queue_limit && ring_len > 0 && ring_len + items_len > queue_limit) {
+        log_debug("Work queue is full (%zu files). Waiting for workers to catch up.", ring_len);
+        while (ring_len > 0 && ring_len + items_len > queue_limit) {
+            walker_waiting = TRUE;
+            pthread_cond_wait(&queue_drained, &work_queue_mtx);
+        }
+        walker_waiting = FALSE;
+    }
+    if (shards_len == 1) {
+        shard_push(&shards[0], items, items_len);
+    } else {
+        /* Batches are mostly a directory at a time, so push runs of items from the same one */
+        for (i = 0; i < items_len; i += run) {
+            for (run = 1; i + run < items_len && items[i + run].dir->hash == items[i].dir->hash; run++) {
+            }
+            shard_push(&shards[items[i].dir->hash % shards_len], items + i, run);
+        }
+    }
+    ring_len += items_len;
+    if (prefetcher_waiting) {
+        pthread_cond_signal(&prefetch_wanted);
+    }
+
+    if (idle_workers > 1 && items_len > 1) {
+        pthread_cond_broadcast(&files_ready);
+    } else if (idle_workers > 0) {
+        pthread_cond_signal(&files_ready);
+    }
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+size_t work_queue_pop(const work_queue_worker_t *worker, work_item_t *items, size_t max) {
+    shard_t *shard;
+    size_t n, i;
+    int s;
+
+    pthread_mutex_lock(&work_queue_mtx);
+    while (worker->id >= workers_len && !done_adding_files) {
+        pthread_cond_wait(&workers_unparked, &work_queue_mtx);
+    }
+    while (ring_len == 0) {
+        if (done_adding_files) {
+            pthread_mutex_unlock(&work_queue_mtx);
+            return 0;
+        }
+        idle_workers++;
+        pthread_cond_wait(&files_ready, &work_queue_mtx);
+        idle_workers--;
+    }
+
+    /* Take a fair share, so one worker doesn't end up with a batch of big files to itself */
+    n = ring_len / workers_len;
+    if (n < 1) {
+        n = 1;
+    } else if (n > max) {
+        n = max;
+    }
+    shard = &shards[worker->shard % shards_len];
+    if (shard->len == 0) {
+        for (s = 0; s < shards_len; s++) {
+            if (shards[s].len > shard->len) {
+                shard = &shards[s];
+            }
+        }
+    }
+    if (n > shard->len) {
+        n = shard->len;
+    }
+    for (i = 0; i < n; i++) {
+        items[i] = shard->ring[shard->head];
+        shard->head = (shard->head + 1) % shard->size;
+    }
+    shard->len -= n;
+    shard->prefetched = shard->prefetched > n ? shard->prefetched - n : 0;
+    ring_len -= n;
+    popped += n;
+    if (prefetcher_waiting) {
+        pthread_cond_signal(&prefetch_wanted);
+    }
+    if (walker_waiting && ring_len <= queue_limit / 2) {
+        pthread_cond_signal(&queue_drained);
+    }
+    pthread_mutex_unlock(&work_queue_mtx);
+    return n;
+}
+
+void work_queue_done(void) {
+    pthread_mutex_lock(&work_queue_mtx);
+    done_adding_files = TRUE;
+    pthread_cond_broadcast(&files_ready);
+    pthread_cond_signal(&prefetch_wanted);
+    pthread_cond_broadcast(&workers_unparked);
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+void work_queue_set_workers(int workers) {
+    pthread_mutex_lock(&work_queue_mtx);
+    if (workers > workers_len) {
+        pthread_cond_broadcast(&workers_unparked);
+    }
+    workers_len = workers > 0 ? workers : 1;
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+void work_queue_get_stats(work_queue_stats_t *out) {
+    pthread_mutex_lock(&work_queue_mtx);
+    out->queued = ring_len;
+    out->idle = idle_workers;
+    out->popped = popped;
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+int work_queue_prefetch_next(work_item_t *item, size_t depth) {
+    shard_t *shard;
+    int s;
+
+    pthread_mutex_lock(&work_queue_mtx);
+    for (;;) {
+        /* Keep level with the workers in every shard */
+        shard = NULL;
+        for (s = 0; s < shards_len; s++) {
+            size_t limit = shards[s].len < depth ? shards[s].len : depth;
+            if (shards[s].prefetched < limit && (shard == NULL || shards[s].prefetched < shard->prefetched)) {
+                shard = &shards[s];
+            }
+        }
+        if (shard != NULL) {
+            break;
+        }
+        if (done_adding_files && ring_len == 0) {
+            pthread_mutex_unlock(&work_queue_mtx);
+            return FALSE;
+        }
+        prefetcher_waiting = TRUE;
+        pthread_cond_wait(&prefetch_wanted, &work_queue_mtx);
+        prefetcher_waiting = FALSE;
+    }
+    *item = shard->ring[(shard->head + shard->prefetched) % shard->size];
+    shard->prefetched++;
+    __sync_add_and_fetch(&item->dir->refs, 1);
+    pthread_mutex_unlock(&work_queue_mtx);
+    return TRUE;
+}
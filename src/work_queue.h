@@ -0,0 +1,75 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stddef.h>
+
+/* Most files the walker hands over at once, unless --dispatch asks for a bigger window */
+#define WORK_QUEUE_BATCH 64
+/* Most files a worker takes at once */
+#define WORK_QUEUE_POP_MAX 16
+
+/* A directory's path, followed by the names of the files in it that have been queued. This saves
+ * allocating (and later freeing, on another thread) a full path for every file. The block is
+ * shared by those files and freed once the last of them has been searched. */
+typedef struct {
+    size_t refs;
+    unsigned int hash; /* of the directory's path, to pick a shard of the queue with */
+    size_t path_len; /* length of the directory's path, including a trailing '/' */
+    size_t len;
+    size_t size;
+    char data[];
+} work_dir_t;
+
+typedef struct {
+    work_dir_t *dir;
+    size_t name; /* offset of the file's name in dir->data */
+    size_t seq;  /* order the file was found in, for --sort=path */
+} work_item_t;
+
+/* names_size is a guess at how much room the file names will take */
+work_dir_t *work_dir_new(const char *path, size_t names_size);
+/* Copy a file name into *dir, starting a new block for the same directory if it's full */
+work_item_t work_dir_add(work_dir_t **dir, const char *name, size_t name_len);
+void work_dir_release(work_dir_t *dir);
+/* The full path of an item, built in *buf (which is grown as needed) */
+const char *work_item_path(const work_item_t *item, char **buf, size_t *buf_size);
+
+/* What a worker thread is started with */
+typedef struct {
+    int id;
+    int shard; /* the shard of the queue to take files from first */
+} work_queue_worker_t;
+
+/* workers is how many workers are active to begin with. limit is the most files to hold before
+ * pushes block, or 0 for no limit. Files are split between shards (one per NUMA node in use) by
+ * a hash of their directory's path. */
+void work_queue_init(int workers, size_t limit, int shards);
+void work_queue_cleanup(void);
+
+/* Add items to the queue, waiting for room if it's full. The queue takes over their references to
+ * their directories. */
+void work_queue_push(const work_item_t *items, size_t items_len);
+/* Take up to max items off the queue, waiting for some if it's empty. They come from the worker's
+ * own shard if it has any, or else from the fullest one. Workers whose id isn't below the number
+ * of active workers wait until they're needed again. Returns 0 once the queue is empty and
+ * work_queue_done() has been called. */
+size_t work_queue_pop(const work_queue_worker_t *worker, work_item_t *items, size_t max);
+/* Change how many workers are active */
+void work_queue_set_workers(int workers);
+
+typedef struct {
+    size_t queued; /* files waiting right now */
+    int idle;      /* active workers waiting for files right now */
+    size_t popped; /* files taken off the queue so far */
+} work_queue_stats_t;
+
+void work_queue_get_stats(work_queue_stats_t *out);
+/* No more items will be pushed */
+void work_queue_done(void);
+
+/* For the prefetcher: wait for a file within the first depth files of a shard that it hasn't
+ * been given yet. The item holds a reference to its directory, to be released. Returns FALSE
+ * once the queue is empty and work_queue_done() has been called. */
+int work_queue_prefetch_next(work_item_t *item, size_t depth);
+
+#endif
@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_CPUSET_H
+#include <sys/cpuset.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__FreeBSD__)
+#include <pthread_np.h>
+#endif
+
+#include "cpus.h"
+#include "log.h"
+#include "options.h"
+#include "search.h"
+#include "util.h"
+#include "work_queue.h"
+#include "workers.h"
+
+/*
+ * Worker threads, and the monitor that decides how many of them should be searching.
+ *
+ * A fixed number of workers is a guess: too few leave cores (or a fast disk) idle, too many just
+ * contend for them. With adaptive workers, the monitor looks at the work queue and at how busy
+ * the workers are every WORKERS_INTERVAL_MS:
+ *
+ * - If files are piling up and no worker is idle, it adds a worker, as long as there's a spare
+ *   core or the workers are spending much of their time waiting on I/O rather than on the CPU.
+ * - An added worker is kept only if throughput goes up by a few percent in the next interval.
+ *   Otherwise it's parked again and the monitor backs off for longer each time that happens.
+ * - If the queue is empty and several workers are waiting for files, one of them is parked.
+ *
+ * Threads are only created once they're needed, and parked workers just wait in
+ * work_queue_pop(), so they cost nothing but their stacks.
+ */
+
+/* Fraction of the time workers need to spend on the CPU to count as CPU bound */
+#define WORKERS_CPU_BOUND 0.75
+/* How much faster things need to get to keep an added worker */
+#define WORKERS_MIN_GAIN 1.05
+/* Most intervals to wait before trying to add a worker again after one didn't help */
+#define WORKERS_MAX_HOLDOFF 64
+
+typedef struct {
+    pthread_t thread;
+    work_queue_worker_t worker;
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+    clockid_t cpu_clock;
+    int has_cpu_clock;
+#endif
+    double cpu_time;
+} worker_t;
+
+static worker_t *workers = NULL;
+static int workers_spawned = 0;
+static int workers_active = 0;
+static int workers_max = 0;
+static int cores = 1;
+
+static struct {
+    int baseline;
+    int peak;
+    int added;
+    int parked;
+} worker_stats;
+
+static pthread_t monitor;
+static int monitor_running = FALSE;
+static int monitor_stopping = FALSE;
+static pthread_mutex_t monitor_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_stop = PTHREAD_COND_INITIALIZER;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void start_worker(int i) {
+    int rv;
+
+    workers[i].worker.id = i;
+    /* Workers pinned to a NUMA node take files from that node's shard of the queue first */
+    workers[i].worker.shard = opts.use_thread_affinity ? cpus_node_index(i) : 0;
+    rv = pthread_create(&(workers[i].thread), NULL, &search_file_worker, &(workers[i].worker));
+    if (rv != 0) {
+        die("Error in pthread_create(): %s", strerror(rv));
+    }
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+    workers[i].has_cpu_clock = pthread_getcpuclockid(workers[i].thread, &workers[i].cpu_clock) == 0;
+#endif
+    workers[i].cpu_time = 0;
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && (defined(USE_CPU_SET) || defined(HAVE_SYS_CPUSET_H))
+    if (opts.use_thread_affinity) {
+#if defined(HAVE_CPU_SET_T) || defined(__midipix__)
+        cpu_set_t cpu_set;
+#elif defined(HAVE_CPU_SET)
+        cpuset_t cpu_set;
+#endif
+        int cpu = cpus_nth(i);
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu, &cpu_set);
+        rv = pthread_setaffinity_np(workers[i].thread, sizeof(cpu_set), &cpu_set);
+        if (rv) {
+            log_err("Error in pthread_setaffinity_np(): %s", strerror(rv));
+            log_err("Performance may be affected. Use --noaffinity to suppress this message.");
+        } else {
+            log_debug("Thread %i set to CPU %i (queue shard %i)", i, cpu, workers[i].worker.shard);
+        }
+    } else {
+        log_debug("Thread affinity disabled.");
+    }
+#else
+    log_debug("No CPU affinity support.");
+#endif
+    workers_spawned++;
+}
+
+static void set_active_workers(int n) {
+    while (workers_spawned < n) {
+        start_worker(workers_spawned);
+    }
+    workers_active = n;
+    if (!opts.io_threads) {
+        /* Otherwise the I/O threads are the ones taking files off the queue */
+        work_queue_set_workers(n);
+    }
+    if (n > worker_stats.peak) {
+        worker_stats.peak = n;
+    }
+}
+
+/* Fraction of the last interval the active workers spent on the CPU, or -1 if that's unknown */
+static double workers_busy(double elapsed) {
+#ifdef HAVE_PTHREAD_GETCPUCLOCKID
+    double total = 0;
+    int i;
+
+    for (i = 0; i < workers_spawned; i++) {
+        struct timespec ts;
+        double cpu_time;
+        if (!workers[i].has_cpu_clock || clock_gettime(workers[i].cpu_clock, &ts) != 0) {
+            return -1;
+        }
+        cpu_time = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+        total += cpu_time - workers[i].cpu_time;
+        workers[i].cpu_time = cpu_time;
+    }
+    return total / (elapsed * workers_active);
+#else
+    (void)elapsed;
+    return -1;
+#endif
+}
+
+static void *monitor_thread(void *unused) {
+    work_queue_stats_t queue_stats;
+    size_t last_popped = 0;
+    double last_time = now_seconds();
+    double trial_rate = 0;
+    int trial = FALSE;
+    int holdoff = 0;
+    int backoff = 1;
+
+    (void)unused;
+    pthread_mutex_lock(&monitor_mtx);
+    while (!monitor_stopping) {
+        struct timeval tv;
+        struct timespec deadline;
+        double now, elapsed, rate, busy;
+
+        gettimeofday(&tv, NULL);
+        deadline.tv_sec = tv.tv_sec + (tv.tv_usec + WORKERS_INTERVAL_MS * 1000) / 1000000;
+        deadline.tv_nsec = ((tv.tv_usec + WORKERS_INTERVAL_MS * 1000) % 1000000) * 1000;
+        if (pthread_cond_timedwait(&monitor_stop, &monitor_mtx, &deadline) != ETIMEDOUT) {
+            continue;
+        }
+
+        now = now_seconds();
+        elapsed = now - last_time;
+        last_time = now;
+        work_queue_get_stats(&queue_stats);
+        rate = (double)(queue_stats.popped - last_popped) / elapsed;
+        last_popped = queue_stats.popped;
+        busy = workers_busy(elapsed);
+        log_debug("%i workers: %zu files queued, %i idle, %.0f files/s, %.0f%% busy",
+                  workers_active, queue_stats.queued, queue_stats.idle, rate, busy * 100);
+
+        if (trial) {
+            trial = FALSE;
+            if (rate < trial_rate * WORKERS_MIN_GAIN) {
+                log_debug("Another worker didn't help (%.0f files/s before). Parking it.", trial_rate);
+                set_active_workers(workers_active - 1);
+                worker_stats.parked++;
+                holdoff = backoff;
+                if (backoff < WORKERS_MAX_HOLDOFF) {
+                    backoff *= 2;
+                }
+                continue;
+            }
+            backoff = 1;
+        }
+        if (holdoff > 0) {
+            holdoff--;
+            continue;
+        }
+
+        if (queue_stats.queued > (size_t)workers_active * WORK_QUEUE_POP_MAX && queue_stats.idle == 0 &&
+            workers_active < workers_max) {
+            if (workers_active < cores || (busy >= 0 && busy < WORKERS_CPU_BOUND)) {
+                log_debug("Files are piling up. Adding worker %i.", workers_active + 1);
+                set_active_workers(workers_active + 1);
+                worker_stats.added++;
+                trial = TRUE;
+                trial_rate = rate;
+            }
+        } else if (queue_stats.queued == 0 && queue_stats.idle > 1 && workers_active > 1) {
+            log_debug("%i workers are waiting for files. Parking one.", queue_stats.idle);
+            set_active_workers(workers_active - 1);
+            worker_stats.parked++;
+        }
+    }
+    pthread_mutex_unlock(&monitor_mtx);
+    return NULL;
+}
+
+void workers_start(int baseline, int max_workers, int num_cores) {
+    int rv;
+
+    cores = num_cores > 0 ? num_cores : 1;
+    workers_max = max_workers > baseline ? max_workers : baseline;
+    workers = ag_calloc(workers_max, sizeof(worker_t));
+    workers_spawned = 0;
+    memset(&worker_stats, 0, sizeof(worker_stats));
+    worker_stats.baseline = baseline;
+    set_active_workers(baseline);
+
+    if (workers_max > baseline) {
+        log_debug("Starting with %i workers, and up to %i if they help", baseline, workers_max);
+        monitor_stopping = FALSE;
+        rv = pthread_create(&monitor, NULL, &monitor_thread, NULL);
+        if (rv != 0) {
+            die("Error in pthread_create(): %s", strerror(rv));
+        }
+        monitor_running = TRUE;
+    }
+}
+
+void workers_finish(void) {
+    int i;
+
+    if (monitor_running) {
+        pthread_mutex_lock(&monitor_mtx);
+        monitor_stopping = TRUE;
+        pthread_cond_signal(&monitor_stop);
+        pthread_mutex_unlock(&monitor_mtx);
+        if (pthread_join(monitor, NULL)) {
+            die("pthread_join failed!");
+        }
+        monitor_running = FALSE;
+    }
+    for (i = 0; i < workers_spawned; i++) {
+        if (pthread_join(workers[i].thread, NULL)) {
+            die("pthread_join failed!");
+        }
+    }
+    free(workers);
+    workers = NULL;
+}
+
+void workers_print_stats(void) {
+    if (workers_max == worker_stats.baseline) {
+        /* Not adaptive, so there's nothing to tell */
+        return;
+    }
+    fprintf(stderr, "%i workers at most (started with %i, added %i, parked %i, finished with %i)\n",
+            worker_stats.peak, worker_stats.baseline, worker_stats.added, worker_stats.parked, workers_active);
+}
@@ -0,0 +1,16 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/* How often the number of workers is reconsidered when they're adaptive */
+#define WORKERS_INTERVAL_MS 50
+
+/* Start the worker threads. baseline workers search files to begin with. If max_workers is more
+ * than that, a monitor thread adds workers (up to max_workers) while that speeds things up, and
+ * parks them again when there isn't enough to do. */
+void workers_start(int baseline, int max_workers, int num_cores);
+/* Wait for the workers to finish, once done_adding_files() has been called */
+void workers_finish(void);
+/* For --stats, summarize what the monitor did, if there was one */
+void workers_print_stats(void);
+
+#endif
@@ -0,0 +1,22 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ for i in $(seq 20); do printf 'needle\n' > file$i.txt; done
+
+Without a fixed number of workers, --stats says how many were used:
+
+  $ ag --workers=0 --stats needle 2>&1 | grep 'workers at most'
+  \d+ workers at most \(started with \d+, added \d+, parked \d+, finished with \d+\) (re)
+  $ ag --workers=0 -D needle 2>&1 | grep -o 'Starting with .*'
+  Starting with \d+ workers, and up to \d+ if they help (re)
+
+With --noadaptive-workers, or a number of workers given, the count stays fixed:
+
+  $ ag --workers=0 --noadaptive-workers --stats -D needle 2>&1 | grep -c 'workers at most\|Starting with\|Adding worker\|Parking'
+  0
+  [1]
+  $ ag --workers=2 --stats -D needle 2>&1 | grep -c 'workers at most\|Starting with\|Adding worker\|Parking'
+  0
+  [1]
+  $ ag --workers=0 --noadaptive-workers -c needle | wc -l
+  20
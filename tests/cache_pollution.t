@@ -0,0 +1,31 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'needle\n' > small.txt
+  $ head -c 100000 /dev/zero | tr '\0' 'a' > big.txt
+  $ printf '\nneedle\n' >> big.txt
+
+Files are searched the same way without polluting the page cache:
+
+  $ ag --nocache-pollution -c needle | sort
+  big.txt:1
+  small.txt:1
+  $ ag --nocache-pollution --direct-min=4096 -c needle | sort
+  big.txt:1
+  small.txt:1
+  $ ag --nocache-pollution --direct-min=4096 --nommap -c needle | sort
+  big.txt:1
+  small.txt:1
+
+Files that were already cached are left there:
+
+  $ ag --stats --nocache-pollution needle 2>&1 | grep 'page cache'
+  100015 bytes read from files, 100015 left in the page cache
+
+  $ ag --nocache-pollution --prefetch -c needle small.txt
+  WARN: --prefetch does nothing with --no-cache-pollution
+  1
+
+  $ ag --direct-min=big needle
+  ERR: Invalid direct I/O size: big
+  [2]
@@ -0,0 +1,24 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'needle\n' > a.txt
+  $ cpu=$(grep Cpus_allowed_list /proc/self/status | sed 's/.*:\s*//; s/[-,].*//')
+
+Workers are sized by the CPUs in the affinity mask, not the ones online:
+
+  $ taskset -c $cpu $AGPROG $AGOPTS --workers=0 --noadaptive-workers -D needle 2>&1 | grep -o '[0-9]* in the affinity mask\|Using [0-9]* workers'
+  1 in the affinity mask
+  Using 1 workers
+
+Workers are only pinned to CPUs in the mask, cycling through them:
+
+  $ taskset -c $cpu $AGPROG $AGOPTS --affinity --workers=3 -D needle 2>&1 | grep -o 'set to CPU [0-9]*' | sort -u | sed "s/CPU $cpu\$/CPU in the mask/"
+  set to CPU in the mask
+
+Unless they aren't pinned at all:
+
+  $ ag --affinity --noaffinity --workers=2 -D needle 2>&1 | grep -c 'set to CPU'
+  0
+  [1]
+  $ ag --affinity --noaffinity --workers=2 -D needle 2>&1 | grep -o 'Thread affinity disabled' | sort -u
+  Thread affinity disabled
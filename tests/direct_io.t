@@ -0,0 +1,35 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'needle\n' > small.txt
+  $ head -c 8191 /dev/zero | tr '\0' 'a' > aligned.txt
+  $ printf '\nneedle\n' >> aligned.txt
+  $ head -c 3000000 /dev/zero | tr '\0' 'a' > big.txt
+  $ printf '\nneedle\nend\n' >> big.txt
+
+Files are searched the same way when they're read with direct I/O, including the
+last partial block:
+
+  $ ag --direct --direct-min=1 --sort=path --numbers needle
+  aligned.txt:2:needle
+  big.txt:2:needle
+  small.txt:1:needle
+  $ ag --direct --sort=path -c needle
+  aligned.txt:1
+  big.txt:1
+  small.txt:1
+  $ ag --direct --direct-min=1 --workers=2 --sort=path -c needle
+  aligned.txt:1
+  big.txt:1
+  small.txt:1
+  $ ag --direct --direct-min=1 --io-threads=2 --sort=path -c needle
+  aligned.txt:1
+  big.txt:1
+  small.txt:1
+  $ ag --direct --direct-min=1 end big.txt
+  end
+
+Only big.txt is read with direct I/O by default:
+
+  $ ag --stats --direct needle 2>&1 | grep 'direct I/O'
+  2998272 bytes read with direct I/O
@@ -0,0 +1,21 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ for i in 5 3 9 1 7 2 8 4 6; do printf 'needle\n' > file$i.txt; done
+
+Reordering files doesn't change which of them are searched, whatever the
+window:
+
+  $ ls *.txt > expected
+  $ for order in readdir inode extent; do ag --dispatch=$order -l needle | sort | cmp - expected || echo $order; done
+  $ ag --dispatch=inode --dispatch-window=2 -l needle | sort | cmp - expected
+  $ ag --dispatch=extent --dispatch-window=4 -l needle | sort | cmp - expected
+
+Invalid values:
+
+  $ ag --dispatch=random needle
+  ERR: Invalid dispatch order: random (expected readdir, inode, or extent)
+  [2]
+  $ ag --dispatch-window=0 needle
+  ERR: Invalid dispatch window: 0
+  [2]
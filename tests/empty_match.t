@@ -14,6 +14,7 @@ A genuine zero-length match should succeed:
 
 Empty files should be listed with --unrestricted --files-with-matches (-ul)
   $ ag -lu --stats 2>&1 | sed '$d' | sort # Remove the last line about timing which will differ
+  1 files read, 0 mapped
   2 files contained matches
   2 files searched
   2 matches
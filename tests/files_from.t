@@ -0,0 +1,49 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foo\n' > a.txt
+  $ mkdir sub
+  $ printf 'foo\nbar foo\n' > sub/b.c
+  $ printf 'foo\n' > unlisted.txt
+  $ printf 'a.txt\nsub/b.c\n' > list
+
+Search only the files in the list, in the order they're listed:
+
+  $ ag --files-from=list --sort=path foo
+  a.txt:1:foo
+  sub/b.c:1:foo
+  sub/b.c:2:bar foo
+
+Read the list from stdin:
+
+  $ printf 'sub/b.c\na.txt\n' | ag --files-from=- --sort=path -l foo
+  sub/b.c
+  a.txt
+
+NUL-terminated lists with -0, where the last path needn't be terminated:
+
+  $ printf 'a.txt\0sub/b.c' | ag --files-from=- -0 -l foo | tr '\0' '\n'
+  a.txt
+  sub/b.c
+
+File name filters still apply:
+
+  $ ag --files-from=list -G '\.c$' -c foo
+  sub/b.c:2
+
+Empty lines and missing files are skipped:
+
+  $ printf '\nmissing.txt\n./a.txt\n' | ag --files-from=- foo
+  a.txt:1:foo
+
+Paths can't be given too:
+
+  $ ag --files-from=list foo sub
+  ERR: --files-from can't be used with paths to search.
+  [2]
+
+A missing list is an error:
+
+  $ ag --files-from=nolist foo
+  ERR: Error opening file list nolist: No such file or directory
+  [1]
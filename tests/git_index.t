@@ -0,0 +1,53 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ git init --quiet
+  $ mkdir -p dir/sub
+  $ printf 'needle\n' > dir/sub/tracked.txt
+  $ printf 'needle\n' > dir/dot_ignored.txt
+  $ printf 'needle\n' > forced.log
+  $ printf 'needle\n' > untracked.txt
+  $ printf 'needle\n' > deleted.txt
+  $ printf '*.log\n' > .gitignore
+  $ printf 'dot_ignored.txt\n' > dir/.ignore
+  $ git add dir .gitignore deleted.txt
+  $ git add -f forced.log
+  $ rm deleted.txt
+
+Search tracked files only. Tracked files aren't subject to .gitignore:
+
+  $ ag --git-index needle | sort
+  dir/sub/tracked.txt:1:needle
+  forced.log:1:needle
+
+Also search untracked files:
+
+  $ ag --git-untracked needle | sort
+  dir/sub/tracked.txt:1:needle
+  forced.log:1:needle
+  untracked.txt:1:needle
+
+Search a subdirectory:
+
+  $ ag --git-index needle dir
+  dir/sub/tracked.txt:1:needle
+
+Index v4 and split indexes:
+
+  $ git update-index --index-version 4
+  $ ag --git-index needle | sort
+  dir/sub/tracked.txt:1:needle
+  forced.log:1:needle
+  $ git update-index --index-version 2 --split-index
+  $ git add untracked.txt
+  $ ag --git-index needle | sort
+  dir/sub/tracked.txt:1:needle
+  forced.log:1:needle
+  untracked.txt:1:needle
+
+Fall back to reading directories outside a git work tree:
+
+  $ rm -rf .git
+  $ ag --git-index needle | sort
+  dir/sub/tracked.txt:1:needle
+  untracked.txt:1:needle
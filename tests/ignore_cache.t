@@ -0,0 +1,36 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'ignored.txt\n' > .ignore
+  $ touch -t 200001010000 .ignore
+  $ printf 'match\n' > ignored.txt
+  $ printf 'match\n' > other.txt
+
+First run parses the ignore file and caches it:
+
+  $ ag --ignore-cache=cache match
+  other.txt:1:match
+  $ ls cache | wc -l | tr -d ' '
+  1
+
+Second run uses the cached entry:
+
+  $ ag --debug --ignore-cache=cache match | grep -c 'Ignore cache hit for ./.ignore'
+  1
+  $ ag --ignore-cache=cache match
+  other.txt:1:match
+
+Changing the ignore file invalidates the entry:
+
+  $ printf 'other.txt\n' > .ignore
+  $ touch -t 200001010000 .ignore
+  $ ag --ignore-cache=cache match
+  ignored.txt:1:match
+  $ ag --debug --ignore-cache=cache match | grep -c 'Ignore cache hit for ./.ignore'
+  1
+
+Files modified too recently aren't cached:
+
+  $ printf 'ignored.txt\n' > .ignore
+  $ ag --debug --ignore-cache=cache match | grep 'Not caching'
+  DEBUG: .*: Not caching ./.ignore: modified too recently (re)
@@ -0,0 +1,21 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foo.txt\nbar.txt\n*.log\nfoo.txt\n  \n# comment\n*.log\n/baz.txt\n/baz.txt\n' > .ignore
+  $ printf 'match\n' > foo.txt
+  $ printf 'match\n' > bar.txt
+  $ printf 'match\n' > baz.txt
+  $ printf 'match\n' > other.log
+  $ printf 'match\n' > keep.txt
+
+Patterns that appear more than once still ignore files:
+
+  $ ag match
+  keep.txt:1:match
+
+Duplicates from --ignore are only stored once:
+
+  $ ag --debug --ignore keep.txt --ignore keep.txt match | grep -c 'added ignore pattern keep.txt'
+  1
+  $ ag --ignore keep.txt --ignore keep.txt match
+  [1]
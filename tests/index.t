@@ -0,0 +1,66 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ printf 'foo bar\n' > dir/a.txt
+  $ printf 'foo 123 bar\n' > dir/sub/b.txt
+  $ printf 'nothing here\n' > dir/c.txt
+  $ touch -d '2020-01-01' dir/a.txt dir/sub/b.txt dir/c.txt
+  $ cd dir
+  $ ag --index-build --stats 2>&1 | grep indexed
+  3 files indexed
+
+Files the index says can't match aren't searched:
+
+  $ ag --index --sort=path --stats 'foo bar' 2>&1 | grep -v seconds
+  a.txt:1:foo bar
+  1 matches
+  1 files contained matches
+  1 files searched
+  8 bytes searched
+  1 files read, 0 mapped
+  2 files skipped with the index, 0 changed since it was built
+
+Regexes are looked up by the literal strings in them, whatever the case:
+
+  $ ag --index --sort=path 'FOO\s\d+\sBAR' -i
+  sub/b.txt:1:foo 123 bar
+
+Parts of a regex that a match might not have, like groups and optional
+characters, aren't looked up:
+
+  $ ag --index --stats 'f(o|x)o \d+ ba?r' 2>&1 | grep skipped
+  0 files skipped with the index, 0 changed since it was built
+
+Files that have changed or are new since the index was built are searched:
+
+  $ printf 'foo bar again\n' > c.txt
+  $ printf 'foo bar too\n' > sub/d.txt
+  $ ag --index --sort=path --stats 'foo bar' 2>&1 | grep -v seconds | grep -v 'bytes searched'
+  a.txt:1:foo bar
+  c.txt:1:foo bar again
+  sub/d.txt:1:foo bar too
+  3 matches
+  3 files contained matches
+  3 files searched
+  3 files read, 0 mapped
+  1 files skipped with the index, 1 changed since it was built
+
+Files without matches are still found with -v:
+
+  $ ag --index -v --sort=path 'foo bar'
+  sub/b.txt:1:foo 123 bar
+  $ ag --index -L --sort=path 'bar again'
+  a.txt
+  sub/b.txt
+  sub/d.txt
+
+Without a usable index, everything is searched:
+
+  $ ag --index=missing 'foo bar' c.txt
+  WARN: Can't open the index missing: No such file or directory. Searching every file.
+  foo bar again
+  $ cd sub
+  $ ag --index=../.agindex 'foo bar'
+  WARN: The index ../.agindex was built in /.*/dir. Searching every file. (re)
+  d.txt:1:foo bar too
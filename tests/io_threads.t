@@ -0,0 +1,38 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ for f in a b c; do printf 'needle %s\n' $f > dir/$f.txt; printf 'hay\n' > dir/sub/$f.txt; done
+  $ touch dir/empty.txt
+
+Files loaded by I/O threads are searched as usual:
+
+  $ ag --io-threads=4 --sort=path needle
+  dir/a.txt:1:needle a
+  dir/b.txt:1:needle b
+  dir/c.txt:1:needle c
+
+Including files with no matches:
+
+  $ ag --io-threads=4 --sort=path -L needle
+  dir/sub/a.txt
+  dir/sub/b.txt
+  dir/sub/c.txt
+
+And without memory-mapping them:
+
+  $ ag --io-threads=2 --nommap --sort=path -c needle
+  dir/a.txt:1
+  dir/b.txt:1
+  dir/c.txt:1
+
+Or with io_uring, which falls back to the usual way of loading files where it isn't available:
+
+  $ ag --io-uring --sort=path needle
+  dir/a.txt:1:needle a
+  dir/b.txt:1:needle b
+  dir/c.txt:1:needle c
+  $ ag --io-uring --io-threads=2 --sort=path -L needle
+  dir/sub/a.txt
+  dir/sub/b.txt
+  dir/sub/c.txt
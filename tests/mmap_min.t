@@ -0,0 +1,42 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'needle\n' > small.txt
+  $ head -c 100000 /dev/zero | tr '\0' 'a' > big.txt
+  $ printf '\nneedle\n' >> big.txt
+
+Small files are read and big ones mapped:
+
+  $ ag --stats -c needle 2>&1 | grep -e '^big' -e '^small' -e 'files read' | sort
+  1 files read, 1 mapped
+  big.txt:1
+  small.txt:1
+
+The size to start mapping files at can be changed:
+
+  $ ag --stats --mmap-min=0 -c needle 2>&1 | grep 'files read'
+  0 files read, 2 mapped
+  $ ag --stats --mmap-min=1000000 -c needle 2>&1 | grep 'files read'
+  2 files read, 0 mapped
+
+Without mmap, everything is read:
+
+  $ ag --stats --nommap -c needle 2>&1 | grep -e '^big' -e '^small' -e 'files read' | sort
+  2 files read, 0 mapped
+  big.txt:1
+  small.txt:1
+
+  $ ag --mmap-min=lots needle
+  ERR: Invalid mmap size: lots
+  [2]
+
+Files that change size while they're being read are searched as far as they
+got:
+
+  $ : > changing.txt
+  $ (yes needle >> changing.txt) &
+  $ writer=$!
+  $ (for i in $(seq 200); do : > changing.txt; sleep 0.005; done) &
+  $ for i in $(seq 20); do ag --nommap -c needle changing.txt > /dev/null; rc=$?; [ $rc -le 1 ] || echo "exit $rc"; done
+  $ kill $writer
+  $ wait
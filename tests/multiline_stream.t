@@ -0,0 +1,57 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ AGOPTS="--noagrc --nocolor --workers=1"
+
+Multiline matches work on streams:
+
+  $ printf 'what\never\nwhatever\nx\n' | ag --multiline --numbers 'wh[^w]+er'
+  1:what
+  2:ever
+  3:whatever
+
+Even when the rest of a match hasn't been read yet:
+
+  $ (printf 'a\nwhat\n'; sleep 0.3; printf 'ever\nz\n') | ag --multiline --numbers -C1 'wh[^w]+er'
+  1-a
+  2:what
+  3:ever
+  4-z
+
+Or when it spans blocks:
+
+  $ seq 1 30000 | ag --multiline --numbers '24999\n25000\n25001'
+  24999:24999
+  25000:25000
+  25001:25001
+
+Not without --multiline:
+
+  $ printf 'what\never\n' | ag 'wh[^w]+er'
+  [1]
+
+A match that's still going after --max-match-span bytes is given up on:
+
+  $ (printf 'aaa\nbbb\n'; sleep 0.3; printf 'ccc\n') | ag --multiline --max-match-span=4 'aaa\nbbb\nccc'
+  [1]
+  $ (printf 'aaa\nbbb\n'; sleep 0.3; printf 'ccc\n') | ag --multiline --max-match-span=12 'aaa\nbbb\nccc'
+  aaa
+  bbb
+  ccc
+
+Searching carries on from the line after one that's given up on, rather
+than trying again from every byte of it:
+
+  $ (head -c 200000 /dev/zero | tr '\0' 'a'; printf '\nab\n'; sleep 0.3; printf 'ab\n') | ag --multiline --max-match-span=100 --numbers -D '(?s)a.*b' 2>&1 | grep -c 'Giving up'
+  1
+  $ (head -c 200000 /dev/zero | tr '\0' 'a'; printf '\nab\n'; sleep 0.3; printf 'ab\n') | ag --multiline --max-match-span=100 --numbers '(?s)a.*b' | cut -c 1-10
+  2:ab
+  3:ab
+  $ (seq 20000 | sed 's/.*/aaaaaaaaaa/'; sleep 0.3; printf 'ab\n') | ag --multiline --max-match-span=100 -D '(?s)a.*b' 2>&1 | grep -c 'Giving up' | awk '{ print $1 < 100 }'
+  1
+
+Invalid spans:
+
+  $ echo foo | ag --multiline --max-match-span=abc foo
+  ERR: Invalid match span: abc
+  [2]
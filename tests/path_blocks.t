@@ -0,0 +1,25 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ git init --quiet
+  $ long=a_rather_long_directory_name_to_fill_up_blocks
+  $ mkdir -p many $long/$long/$long
+  $ for i in $(seq 200); do printf 'needle\n' > many/file_with_a_fairly_long_name_$i.txt; done
+  $ for i in $(seq 50); do printf 'needle\n' > $long/$long/$long/$i.txt; done
+  $ printf 'needle\n' > top.txt
+  $ git add .
+  $ find . -name '*.txt' | sed 's|^\./||' | sort > expected
+
+Queued files share a block of names per directory. Every path comes out
+whole, from a directory walk, the git index (where a directory's files can
+fill more than one block), or a list of files:
+
+  $ ag --workers=4 -l needle | sort | cmp - expected
+  $ ag --workers=4 --git-index -l needle | sort | cmp - expected
+  $ ag --workers=4 --files-from=expected -l needle | sort | cmp - expected
+  $ ag --workers=4 -l needle $long many/file_with_a_fairly_long_name_7.txt top.txt | sort > found
+  $ grep -c "^$long/$long/$long/[0-9]*.txt$" found
+  50
+  $ grep -v "^$long/" found
+  many/file_with_a_fairly_long_name_7.txt
+  top.txt
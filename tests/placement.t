@@ -0,0 +1,35 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ for f in a b c; do printf 'needle\n' > dir/$f.txt; printf 'needle\n' > dir/sub/$f.txt; done
+
+Every placement finds the same files:
+
+  $ ag --affinity --placement=spread --workers=4 --sort=path -l needle
+  dir/a.txt
+  dir/b.txt
+  dir/c.txt
+  dir/sub/a.txt
+  dir/sub/b.txt
+  dir/sub/c.txt
+  $ ag --affinity --placement=compact --workers=4 --sort=path -l needle
+  dir/a.txt
+  dir/b.txt
+  dir/c.txt
+  dir/sub/a.txt
+  dir/sub/b.txt
+  dir/sub/c.txt
+  $ ag --affinity --placement=cores --sort=path -l needle
+  dir/a.txt
+  dir/b.txt
+  dir/c.txt
+  dir/sub/a.txt
+  dir/sub/b.txt
+  dir/sub/c.txt
+
+Unknown placements are rejected:
+
+  $ ag --placement=random needle
+  ERR: Invalid placement: random (expected spread, compact or cores)
+  [2]
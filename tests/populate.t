@@ -0,0 +1,34 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'needle\n' > small.txt
+  $ head -c 100000 /dev/zero | tr '\0' 'a' > big.txt
+  $ printf '\nneedle\n' >> big.txt
+
+Large files are searched the same way with their pages faulted in up front:
+
+  $ ag --populate-min=4096 -c needle | sort
+  big.txt:1
+  small.txt:1
+  $ ag --populate-min=4096 --huge-pages -c needle | sort
+  big.txt:1
+  small.txt:1
+  $ (head -c 3000000 /dev/zero | tr '\0' 'a'; printf '\nneedle\n') > huge.txt
+  $ ag --populate-min=4096 --huge-pages --numbers needle huge.txt
+  2:needle
+  $ rm huge.txt
+
+  $ ag --stats --populate-min=4096 needle 2>&1 | grep -o '.* pre-faulted'
+  1 files pre-faulted
+
+  $ ag --populate-min=big needle
+  ERR: Invalid populate size: big
+  [2]
+
+With --nommap, files are read as usual and nothing is pre-faulted:
+
+  $ ag --stats --nommap --populate-min=4096 needle 2>&1 | grep -o '.* pre-faulted'
+  0 files pre-faulted
+  $ ag --nommap --populate-min=4096 -c needle | sort
+  big.txt:1
+  small.txt:1
@@ -0,0 +1,28 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ for i in 1 2 3 4 5 6 7 8 9; do mkdir dir$i; printf 'needle\n' > dir$i/a.txt; printf 'hay\n' > dir$i/b.txt; done
+
+Prefetching doesn't change what's found:
+
+  $ ag --prefetch --sort=path -l needle
+  dir1/a.txt
+  dir2/a.txt
+  dir3/a.txt
+  dir4/a.txt
+  dir5/a.txt
+  dir6/a.txt
+  dir7/a.txt
+  dir8/a.txt
+  dir9/a.txt
+  $ ag --prefetch=2 --sort=path -l needle | wc -l | tr -d ' '
+  9
+  $ ag --prefetch=2 --stats needle 2>&1 | grep -c 'prefetched, 2 ahead'
+  1
+
+  $ ag --prefetch=none needle
+  ERR: Invalid prefetch depth: none
+  [2]
+  $ ag --prefetch=0 needle
+  ERR: Invalid prefetch depth: 0
+  [2]
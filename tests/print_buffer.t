@@ -0,0 +1,45 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ for i in $(seq 8); do seq 2000 | sed 's/^/needle /' > small$i.txt; done
+  $ seq 60000 | sed 's/^/needle needle needle /' > big.txt
+
+A file's output is written in one piece, even with several workers printing
+at once:
+
+  $ ag --workers=4 --noheading --nobreak needle | grep -v '^big.txt:' | cut -d: -f1 | uniq | sort
+  small1.txt
+  small2.txt
+  small3.txt
+  small4.txt
+  small5.txt
+  small6.txt
+  small7.txt
+  small8.txt
+
+Unless it has more than a buffer's worth of output. Then it's written a few
+whole lines at a time, so as not to hold up the other files:
+
+  $ ag --workers=4 --noheading --nobreak needle > out
+  $ wc -l < out | tr -d ' '
+  76000
+  $ grep -cv '^small[0-9].txt:[0-9]*:needle [0-9]*$\|^big.txt:[0-9]*:needle needle needle [0-9]*$' out
+  0
+  [1]
+  $ grep '^big.txt:' out | cut -d: -f2 | sort -n | uniq | wc -l | tr -d ' '
+  60000
+  $ rm out
+
+With --sort=path, output stays in order:
+
+  $ ag --workers=4 --sort=path --noheading --nobreak needle big.txt small1.txt | cut -d: -f1 | uniq
+  big.txt
+  small1.txt
+
+Files are still separated by a blank line, with none at the start or end:
+
+  $ ag --workers=4 --heading --break needle | grep -c '^$'
+  8
+  $ ag --workers=4 --heading --break needle | sed -n '1p;$p' | grep -c '^$'
+  0
+  [1]
@@ -0,0 +1,36 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p a b
+  $ for i in 1 2 3 4 5; do printf 'needle\n' > a/$i.txt; printf 'needle\n' > b/$i.txt; done
+
+Every file is still searched when the walker has to wait for the workers:
+
+  $ ag --queue-limit=2 -l needle | sort
+  a/1.txt
+  a/2.txt
+  a/3.txt
+  a/4.txt
+  a/5.txt
+  b/1.txt
+  b/2.txt
+  b/3.txt
+  b/4.txt
+  b/5.txt
+  $ ag --queue-limit=1 --dispatch=inode -l needle | wc -l | tr -d ' '
+  10
+
+Invalid limit:
+
+  $ ag --queue-limit=lots needle
+  ERR: Invalid queue limit: lots
+  [2]
+  $ ag --queue-limit=-1 needle
+  ERR: Invalid queue limit: -1
+  [2]
+  $ ag --queue-limit=10x needle
+  ERR: Invalid queue limit: 10x
+  [2]
+  $ ag --queue-limit= needle
+  ERR: Invalid queue limit: 
+  [2]
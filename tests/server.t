@@ -0,0 +1,88 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ printf 'foo 1\n' > dir/a.txt
+  $ printf 'foo 2\n' > dir/sub/b.txt
+  $ printf '*.log\n' > dir/.ignore
+  $ cd dir
+  $ ag --server=../sock > ../server.out 2>&1 &
+  $ server=$!
+  $ for i in $(seq 100); do [ -S ../sock ] && break; sleep 0.1; done
+
+Only the server's user can connect to it:
+
+  $ stat -c %a ../sock
+  600
+
+Searches sent to the server print just like any other:
+
+  $ ag --connect=../sock --sort=path foo
+  a.txt:1:foo 1
+  sub/b.txt:1:foo 2
+  $ ag --connect=../sock nothing
+  [1]
+
+Files that are added or deleted are noticed before the next search, and new
+files obey the same ignores:
+
+  $ printf 'foo 3\n' > new.txt
+  $ printf 'foo\n' > sub/ignored.log
+  $ rm sub/b.txt
+  $ ag --connect=../sock --sort=path foo
+  a.txt:1:foo 1
+  new.txt:1:foo 3
+
+Searches that would find other files still work:
+
+  $ ag --connect=../sock --sort=path -u foo
+  a.txt:1:foo 1
+  new.txt:1:foo 3
+  sub/ignored.log:1:foo
+  $ cd sub
+  $ ag --connect=../../sock foo
+  ignored.log:1:foo
+  $ cd ..
+
+Without a server, ag searches by itself:
+
+  $ ag --connect=../nothing-here --sort=path foo
+  a.txt:1:foo 1
+  new.txt:1:foo 3
+
+The server and its clients needn't have the same number of arguments:
+
+  $ ag --server=../sock2 --depth 5 > /dev/null 2>&1 &
+  $ server2=$!
+  $ for i in $(seq 100); do [ -S ../sock2 ] && break; sleep 0.1; done
+  $ ag --connect=../sock2 --sort=path foo
+  a.txt:1:foo 1
+  new.txt:1:foo 3
+  $ ag --connect=../sock2 foo a.txt sub
+  a.txt:1:foo 1
+  sub/ignored.log:1:foo
+  $ kill $server2
+  $ wait $server2
+
+Which files are searched is up to the client, not the file name filters the
+server was started with:
+
+  $ ag --server=../sock3 -G '\.c$' > /dev/null 2>&1 &
+  $ server3=$!
+  $ for i in $(seq 100); do [ -S ../sock3 ] && break; sleep 0.1; done
+  $ ag --connect=../sock3 --sort=path foo
+  a.txt:1:foo 1
+  new.txt:1:foo 3
+  $ ag --connect=../sock3 -G 'new' foo
+  new.txt:1:foo 3
+  $ kill $server3
+  $ wait $server3
+
+The server cleans up its socket when it's stopped:
+
+  $ kill $server
+  $ wait
+  $ ls ..
+  dir
+  server.out
+  $ cat ../server.out
@@ -0,0 +1,44 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ for f in c a b; do printf 'needle %s\n' $f > $f.txt; printf 'needle\n' > dir/$f.txt; printf 'needle\n' > dir/sub/$f.txt; done
+  $ printf 'needle\n' > dir/z.txt
+
+Files are printed in the order they're found, with each directory sorted by name:
+
+  $ ag --sort=path --workers=4 -l needle
+  a.txt
+  b.txt
+  c.txt
+  dir/a.txt
+  dir/b.txt
+  dir/c.txt
+  dir/sub/a.txt
+  dir/sub/b.txt
+  dir/sub/c.txt
+  dir/z.txt
+
+Matches stay grouped by file:
+
+  $ ag --sort=path --workers=4 --noheading needle a.txt dir/sub c.txt
+  a.txt:1:needle a
+  
+  dir/sub/a.txt:1:needle
+  
+  dir/sub/b.txt:1:needle
+  
+  dir/sub/c.txt:1:needle
+  
+  c.txt:1:needle c
+
+The order doesn't depend on the dispatch order or on how much is waiting to be printed:
+
+  $ ag --sort=path --workers=4 --dispatch=inode --queue-limit=1 -l needle | tr '\n' ' '
+  a.txt b.txt c.txt dir/a.txt dir/b.txt dir/c.txt dir/sub/a.txt dir/sub/b.txt dir/sub/c.txt dir/z.txt  (no-eol)
+
+Invalid order:
+
+  $ ag --sort=size needle
+  ERR: Invalid sort order: size (expected none or path)
+  [2]
@@ -0,0 +1,33 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ AGOPTS="--noagrc --nocolor --workers=1"
+
+Streams are read in blocks. Line numbers and context carry over from one to the next:
+
+  $ seq 1 100000 | ag --numbers -C1 '^(65536|99999)$'
+  65535-65535
+  65536:65536
+  65537-65537
+  99998-99998
+  99999:99999
+  100000-100000
+
+A line that doesn't fit in a block:
+
+  $ (seq 1 3; head -c 300000 /dev/zero | tr '\0' 'a'; printf 'needle\n4\n') | ag --numbers -o needle
+  4:needle
+  $ (seq 1 3; head -c 300000 /dev/zero | tr '\0' 'a'; printf 'needle\n4\n') | ag -c a
+  300000
+
+The last line doesn't need a delimiter:
+
+  $ printf 'a needle\nno\nlast needle' | ag needle
+  a needle
+  last needle (no-eol)
+
+Each line is a match with -v:
+
+  $ printf 'a\nb\nc\n' | ag -v b
+  a
+  c
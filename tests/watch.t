@@ -0,0 +1,31 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ printf 'foo 1\n' > dir/a.txt
+  $ printf '*.log\n' > dir/.ignore
+  $ wait_for() {
+  >   for i in $(seq 100); do grep -q "$1" out && return; sleep 0.1; done
+  >   echo "Timed out waiting for $1"
+  > }
+
+After the first search, files are searched again as they change, and new
+files and directories are searched too, obeying the same ignores:
+
+  $ ag --watch foo dir > out 2>&1 &
+  $ wait_for 'foo 1'
+  $ printf 'foo 2\n' > dir/a.txt
+  $ wait_for 'foo 2'
+  $ printf 'foo\n' > dir/sub/ignored.log
+  $ mkdir dir/new
+  $ printf 'bar\nfoo 3\n' > dir/new/b.txt
+  $ wait_for 'foo 3'
+
+ag exits once there's nothing left to watch:
+
+  $ rm -rf dir
+  $ wait
+  $ cat out
+  dir/a.txt:1:foo 1
+  dir/a.txt:1:foo 2
+  dir/new/b.txt:2:foo 3
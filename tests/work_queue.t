@@ -0,0 +1,22 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p big small/a small/b
+  $ for i in $(seq 300); do printf 'needle\n' > big/$i.txt; done
+  $ for i in $(seq 5); do printf 'needle\n' > small/a/$i.txt; printf 'needle\n' > small/b/$i.txt; done
+  $ find . -name '*.txt' | sed 's|^\./||' | sort > expected
+
+Files are queued in batches, and each is searched exactly once however many
+workers take them off the queue:
+
+  $ for workers in 1 2 4 8; do ag --workers=$workers -l needle | sort > found; cmp found expected || echo "$workers workers"; done
+  $ ag --workers=8 --dispatch=inode --dispatch-window=100 -l needle | sort | cmp - expected
+  $ ag --workers=4 -c needle | cut -d: -f2 | sort | uniq -c | sed 's/^ *//'
+  310 1
+
+With one worker, files come off the queue in the order they went on, a
+directory at a time:
+
+  $ ag --workers=1 -l needle small | cut -d/ -f1-2 | uniq | sort
+  small/a
+  small/b